@@ -0,0 +1,470 @@
+/**
+ * Access control for the router, applied between parsing and route lookup.
+ *
+ * Rules are read from a file, one per line, and the first that matches a
+ * packet decides what happens to it:
+ *
+ *   permit|deny|limit <packets/sec>[:<burst>] [src <prefix>] [dest <prefix>] [ttl <n>[-<m>]]
+ *
+ * Fields left out match anything, and packets no rule matches are let
+ * through. The TTL is the one the packet arrived with.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "acl.h"
+#include "router.h"
+
+#define ACL_SOURCE 0
+#define ACL_DESTINATION 1
+#define ACL_TTL 2
+
+static int parse_rule(AclRule* rule, char* line);
+static int parse_prefix_range(const char* text, AclKey* low, AclKey* high);
+static void compile_dimension(Acl* acl, int dimension);
+static int find_interval(const AclDimension* dimension, AclKey key);
+static AclKey key_from_bytes(const uint8_t* bytes);
+static int compare_keys(const void* a, const void* b);
+
+static const AclKey key_min = {0, 0};
+static const AclKey key_max = {UINT64_MAX, UINT64_MAX};
+
+/**
+ * Reads and compiles the rules in the file at path. Like the routing
+ * table, a file that can't be read or a rule that doesn't parse is fatal.
+ */
+Acl* Acl_new(const char* path)
+{
+	Acl* acl = calloc(1, sizeof(Acl));
+	FILE* file = fopen(path, "r");
+	char line[ACL_RULE_LENGTH * 2];
+	int capacity = 64;
+	int number = 0;
+
+	if (acl == NULL || file == NULL)
+	{
+		fprintf(stderr, "Unable to read ACL file: %s.\n", path);
+		exit(-1);
+	}
+
+	acl->rules = malloc(capacity * sizeof(AclRule));
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char* comment = strchr(line, '#');
+
+		number++;
+		if (comment != NULL)
+		{
+			*comment = 0;
+		}
+		line[strcspn(line, "\r\n")] = 0;
+		for (size_t length = strlen(line); length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t'); length--)
+		{
+			line[length - 1] = 0;
+		}
+		if (line[strspn(line, " \t")] == 0)
+		{
+			continue;
+		}
+
+		if (acl->rule_count == capacity)
+		{
+			capacity *= 2;
+			acl->rules = realloc(acl->rules, capacity * sizeof(AclRule));
+		}
+		if (parse_rule(&acl->rules[acl->rule_count], line) != 0)
+		{
+			fprintf(stderr, "Invalid ACL rule on line %d of %s.\n", number, path);
+			exit(-1);
+		}
+		acl->rule_count++;
+	}
+	fclose(file);
+
+	// a word of rule bits, and a summary bit for every word
+	acl->words = (acl->rule_count + 63) / 64;
+	acl->summary_words = (acl->words + 63) / 64;
+	for (int d = 0; d < ACL_DIMENSIONS; d++)
+	{
+		compile_dimension(acl, d);
+	}
+
+	return acl;
+}
+
+void Acl_free(Acl* acl)
+{
+	for (int d = 0; d < ACL_DIMENSIONS; d++)
+	{
+		free(acl->dimensions[d].starts);
+		free(acl->dimensions[d].bitmaps);
+		free(acl->dimensions[d].summaries);
+	}
+	free(acl->rules);
+	free(acl);
+}
+
+/**
+ * Finds the first rule matching a packet. Addresses are 16 bytes, with
+ * IPv4 mapped into IPv6 as ::ffff:a.b.c.d.
+ *
+ * Returns the index of the rule, or -1 if none match.
+ */
+int acl_classify(const Acl* acl, const uint8_t* source, const uint8_t* destination, int ttl)
+{
+	const AclDimension* dimensions = acl->dimensions;
+	// rules only go up to 255, a bigger TTL still has to match the wildcards
+	AclKey ttl_key = {0, (uint64_t) (ttl < 0 ? 0 : (ttl > 255 ? 255 : ttl))};
+	int intervals[ACL_DIMENSIONS];
+	const uint64_t* bitmaps[ACL_DIMENSIONS];
+	const uint64_t* summaries[ACL_DIMENSIONS];
+
+	if (acl->rule_count == 0)
+	{
+		return -1;
+	}
+
+	intervals[ACL_SOURCE] = find_interval(&dimensions[ACL_SOURCE], key_from_bytes(source));
+	intervals[ACL_DESTINATION] = find_interval(&dimensions[ACL_DESTINATION], key_from_bytes(destination));
+	intervals[ACL_TTL] = find_interval(&dimensions[ACL_TTL], ttl_key);
+	for (int d = 0; d < ACL_DIMENSIONS; d++)
+	{
+		bitmaps[d] = &dimensions[d].bitmaps[(size_t) intervals[d] * acl->words];
+		summaries[d] = &dimensions[d].summaries[(size_t) intervals[d] * acl->summary_words];
+	}
+
+	// rules are numbered in priority order, so the lowest common bit wins
+	for (int s = 0; s < acl->summary_words; s++)
+	{
+		uint64_t candidates = summaries[0][s] & summaries[1][s] & summaries[2][s];
+
+		while (candidates != 0)
+		{
+			int word = s * 64 + __builtin_ctzll(candidates);
+			uint64_t rules = bitmaps[0][word] & bitmaps[1][word] & bitmaps[2][word];
+
+			if (rules != 0)
+			{
+				return word * 64 + __builtin_ctzll(rules);
+			}
+			candidates &= candidates - 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Applies the first matching rule to a packet and counts it. Packets over
+ * a limit rule's rate are dropped.
+ *
+ * Returns 1 if the packet goes on to routing, 0 if it's dropped.
+ */
+int acl_filter(Acl* acl, const uint8_t* source, const uint8_t* destination, int ttl, uint64_t now_ns)
+{
+	int match = acl_classify(acl, source, destination, ttl);
+	AclRule* rule;
+
+	if (match == -1)
+	{
+		acl->unmatched++;
+		return 1;
+	}
+
+	rule = &acl->rules[match];
+	rule->hits++;
+	switch (rule->action)
+	{
+		case ACL_DENY:
+			rule->dropped++;
+			acl->denied++;
+			return 0;
+		case ACL_LIMIT:
+			if (token_bucket_take(&rule->bucket, 1, now_ns) != 0)
+			{
+				rule->dropped++;
+				acl->limited++;
+				return 0;
+			}
+			break;
+		case ACL_PERMIT:
+			break;
+	}
+
+	acl->permitted++;
+	return 1;
+}
+
+/**
+ * Parses one rule. The rule keeps its text for the statistics.
+ *
+ * Returns 0 on success, -1 if the rule is malformed.
+ */
+static int parse_rule(AclRule* rule, char* line)
+{
+	char* saved;
+	char* token;
+	char* end;
+
+	memset(rule, 0, sizeof(AclRule));
+	snprintf(rule->text, sizeof(rule->text), "%s", line + strspn(line, " \t"));
+	for (int d = 0; d < ACL_DIMENSIONS; d++)
+	{
+		rule->lows[d] = key_min;
+		rule->highs[d] = key_max;
+	}
+	rule->highs[ACL_TTL] = (AclKey) {0, 255};
+
+	token = strtok_r(line, " \t", &saved);
+	if (strcmp(token, "permit") == 0)
+	{
+		rule->action = ACL_PERMIT;
+	}
+	else if (strcmp(token, "deny") == 0)
+	{
+		rule->action = ACL_DENY;
+	}
+	else if (strcmp(token, "limit") == 0)
+	{
+		double rate, burst;
+		char* value = strtok_r(NULL, " \t", &saved);
+
+		if (value == NULL)
+		{
+			return -1;
+		}
+		rate = strtod(value, &end);
+		if (end == value || rate < 0 || (*end != 0 && *end != ':'))
+		{
+			return -1;
+		}
+
+		// the same default burst as an egress shape
+		burst = rate / 100 >= 1 ? rate / 100 : 1;
+		if (*end == ':')
+		{
+			value = end + 1;
+			burst = strtod(value, &end);
+			if (end == value || *end != 0 || burst < 1)
+			{
+				return -1;
+			}
+		}
+		rule->action = ACL_LIMIT;
+		token_bucket_init(&rule->bucket, rate, burst);
+	}
+	else
+	{
+		return -1;
+	}
+
+	while ((token = strtok_r(NULL, " \t", &saved)) != NULL)
+	{
+		char* value = strtok_r(NULL, " \t", &saved);
+
+		if (value == NULL)
+		{
+			return -1;
+		}
+
+		if (strcmp(token, "src") == 0 || strcmp(token, "dest") == 0)
+		{
+			int d = token[0] == 's' ? ACL_SOURCE : ACL_DESTINATION;
+
+			if (parse_prefix_range(value, &rule->lows[d], &rule->highs[d]) != 0)
+			{
+				return -1;
+			}
+		}
+		else if (strcmp(token, "ttl") == 0)
+		{
+			long low = strtol(value, &end, 10);
+			long high = low;
+
+			if (*end == '-')
+			{
+				char* rest = end + 1;
+
+				high = strtol(rest, &end, 10);
+				if (end == rest)
+				{
+					return -1;
+				}
+			}
+			if (end == value || *end != 0 || low < 0 || high > 255 || low > high)
+			{
+				return -1;
+			}
+			rule->lows[ACL_TTL] = (AclKey) {0, (uint64_t) low};
+			rule->highs[ACL_TTL] = (AclKey) {0, (uint64_t) high};
+		}
+		else
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Parses an IPv4 or IPv6 prefix, "<address>/<length>", into the range of
+ * keys it covers. IPv4 prefixes land inside ::ffff:0:0/96, so they never
+ * match IPv6 packets.
+ */
+static int parse_prefix_range(const char* text, AclKey* low, AclKey* high)
+{
+	uint8_t bytes[16] = {0};
+	uint8_t last[16];
+	int version, prefix_length;
+
+	if (parse_prefix(text, bytes, &version, &prefix_length) != 0)
+	{
+		return -1;
+	}
+	if (version == 4)
+	{
+		memmove(&bytes[12], bytes, 4);
+		memset(bytes, 0, 10);
+		bytes[10] = 0xff;
+		bytes[11] = 0xff;
+		prefix_length += 96;
+	}
+
+	// clear the host bits for the low end and set them for the high end
+	for (int i = 0; i < 16; i++)
+	{
+		int bits = prefix_length - i * 8;
+		uint8_t mask = bits >= 8 ? 0xff : bits <= 0 ? 0 : (0xff << (8 - bits)) & 0xff;
+
+		bytes[i] &= mask;
+		last[i] = bytes[i] | (uint8_t) ~mask;
+	}
+
+	*low = key_from_bytes(bytes);
+	*high = key_from_bytes(last);
+	return 0;
+}
+
+/**
+ * Cuts a dimension at every rule's start and just past its end, then sets
+ * each rule's bit in all the intervals it covers.
+ */
+static void compile_dimension(Acl* acl, int d)
+{
+	AclDimension* dimension = &acl->dimensions[d];
+	AclKey* points = malloc((2 * (size_t) acl->rule_count + 1) * sizeof(AclKey));
+	int count = 0;
+	int unique = 0;
+
+	if (points == NULL)
+	{
+		fprintf(stderr, "Unable to allocate ACL.\n");
+		exit(-1);
+	}
+
+	points[count++] = key_min;
+	for (int r = 0; r < acl->rule_count; r++)
+	{
+		AclKey next = acl->rules[r].highs[d];
+
+		points[count++] = acl->rules[r].lows[d];
+		if (next.high != UINT64_MAX || next.low != UINT64_MAX)
+		{
+			next.low++;
+			next.high += next.low == 0;
+			points[count++] = next;
+		}
+	}
+
+	qsort(points, count, sizeof(AclKey), compare_keys);
+	for (int i = 0; i < count; i++)
+	{
+		if (unique == 0 || compare_keys(&points[unique - 1], &points[i]) != 0)
+		{
+			points[unique++] = points[i];
+		}
+	}
+
+	dimension->starts = points;
+	dimension->interval_count = unique;
+	dimension->bitmaps = calloc((size_t) unique * acl->words + 1, sizeof(uint64_t));
+	dimension->summaries = calloc((size_t) unique * acl->summary_words + 1, sizeof(uint64_t));
+	if (dimension->bitmaps == NULL || dimension->summaries == NULL)
+	{
+		fprintf(stderr, "Unable to allocate ACL.\n");
+		exit(-1);
+	}
+
+	for (int r = 0; r < acl->rule_count; r++)
+	{
+		int first = find_interval(dimension, acl->rules[r].lows[d]);
+		int last = find_interval(dimension, acl->rules[r].highs[d]);
+
+		for (int i = first; i <= last; i++)
+		{
+			uint64_t* summary = &dimension->summaries[(size_t) i * acl->summary_words];
+
+			dimension->bitmaps[(size_t) i * acl->words + r / 64] |= 1ull << (r % 64);
+			summary[r / 64 / 64] |= 1ull << (r / 64 % 64);
+		}
+	}
+}
+
+/**
+ * Returns the interval holding key, the last one starting at or below it.
+ */
+static int find_interval(const AclDimension* dimension, AclKey key)
+{
+	int low = 0;
+	int high = dimension->interval_count - 1;
+
+	while (low < high)
+	{
+		int middle = (low + high + 1) / 2;
+
+		if (compare_keys(&dimension->starts[middle], &key) <= 0)
+		{
+			low = middle;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+
+	return low;
+}
+
+static AclKey key_from_bytes(const uint8_t* bytes)
+{
+	AclKey key = {0, 0};
+
+	for (int i = 0; i < 8; i++)
+	{
+		key.high = key.high << 8 | bytes[i];
+		key.low = key.low << 8 | bytes[i + 8];
+	}
+
+	return key;
+}
+
+static int compare_keys(const void* a, const void* b)
+{
+	const AclKey* left = a;
+	const AclKey* right = b;
+
+	if (left->high != right->high)
+	{
+		return left->high < right->high ? -1 : 1;
+	}
+	if (left->low != right->low)
+	{
+		return left->low < right->low ? -1 : 1;
+	}
+	return 0;
+}
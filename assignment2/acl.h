@@ -0,0 +1,73 @@
+#ifndef ACL_H_
+#define ACL_H_
+
+#include <stdint.h>
+
+#include "token_bucket.h"
+
+/*
+ * Source address, destination address and TTL, the fields rules look at.
+ * The TTL is the one the packet arrived with, before the router took one
+ * off, which is also what egress class rules see.
+ */
+#define ACL_DIMENSIONS 3
+#define ACL_RULE_LENGTH 256
+
+/* An address widened to 128 bits, IPv4 as ::ffff:a.b.c.d, or a TTL */
+typedef struct {
+	uint64_t high;
+	uint64_t low;
+} AclKey;
+
+typedef enum {
+	ACL_PERMIT,
+	ACL_DENY,
+	ACL_LIMIT
+} AclAction;
+
+/* One line of the rule file, with a range of keys in every dimension */
+typedef struct {
+	AclAction action;
+	AclKey lows[ACL_DIMENSIONS];
+	AclKey highs[ACL_DIMENSIONS];
+	TokenBucket bucket;
+	char text[ACL_RULE_LENGTH];
+	uint64_t hits;
+	uint64_t dropped;
+} AclRule;
+
+/*
+ * A dimension cut into elementary intervals, each with a bitmap of the
+ * rules covering it and a summary with a bit per nonzero bitmap word.
+ */
+typedef struct {
+	AclKey* starts;
+	uint64_t* bitmaps;
+	uint64_t* summaries;
+	int interval_count;
+} AclDimension;
+
+/*
+ * Rules compiled for bitmap intersection: a binary search per dimension
+ * finds three bitmaps, and the lowest bit set in all of them is the first
+ * rule that matches. Summaries skip the words that can't have it, so a
+ * lookup stays close to three binary searches however many rules there are.
+ */
+typedef struct {
+	AclRule* rules;
+	int rule_count;
+	int words;
+	int summary_words;
+	AclDimension dimensions[ACL_DIMENSIONS];
+	uint64_t permitted;
+	uint64_t denied;
+	uint64_t limited;
+	uint64_t unmatched;
+} Acl;
+
+Acl* Acl_new(const char* path);
+void Acl_free(Acl* acl);
+int acl_classify(const Acl* acl, const uint8_t* source, const uint8_t* destination, int ttl);
+int acl_filter(Acl* acl, const uint8_t* source, const uint8_t* destination, int ttl, uint64_t now_ns);
+
+#endif
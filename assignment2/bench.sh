@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# End to end router benchmark. Starts a fresh router on loopback for every
+# offered rate, drives it with pktgen's load mode for DURATION seconds and
+# prints one CSV row per rate.
+#
+# usage: ./bench.sh [offered rates in packets/sec, 0 for unlimited]
+#
+# Environment overrides: ROUTER, PKTGEN, PORT, TABLE, DURATION,
+# ROUTER_ARGS for the receive backend (e.g. "-B io_uring"), and
+# PKTGEN_ARGS for extra generator flags (e.g. "-t 4 -T table.txt -D zipf").
+
+ROUTER=${ROUTER:-./router}
+PKTGEN=${PKTGEN:-./pktgen}
+PORT=${PORT:-8686}
+TABLE=${TABLE:-RT_A.txt}
+DURATION=${DURATION:-3}
+RATES=${*:-"10000 50000 100000 200000 400000 0"}
+
+ROUTER_STATS=router_bench_stats.txt
+PKTGEN_STATS=pktgen_bench_stats.txt
+
+# value <key> <stats file>
+value() {
+	awk -F': ' -v key="$1" '$1 == key { print $2; exit }' "$2"
+}
+
+echo "offered_pps,sent,achieved_pps,received,delivered_pps,loss_pct,cpu_ns_per_packet,latency_p50_ns,latency_p90_ns,latency_p99_ns,latency_p999_ns,latency_max_ns"
+
+for rate in $RATES
+do
+	rm -f $ROUTER_STATS $PKTGEN_STATS
+
+	$ROUTER $ROUTER_ARGS $PORT $TABLE $ROUTER_STATS > /dev/null &
+	router_pid=$!
+	sleep 0.5
+
+	$PKTGEN -r $rate -d $DURATION -L $PKTGEN_ARGS $PORT $PKTGEN_STATS > /dev/null
+
+	# let the router drain its socket before asking for the final stats
+	sleep 0.5
+	kill -INT $router_pid
+	wait $router_pid 2> /dev/null
+
+	sent=$(value "Packets sent" $PKTGEN_STATS)
+	achieved=$(value "Achieved rate" $PKTGEN_STATS | awk '{ print $1 }')
+	received=$(value "packets received" $ROUTER_STATS)
+
+	delivered=$(awk -v r="$received" -v d="$DURATION" 'BEGIN { printf "%.0f", r / d }')
+	loss=$(awk -v s="$sent" -v r="$received" 'BEGIN { printf "%.3f", (s > 0 ? (s - r) * 100 / s : 0) }')
+
+	printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n" \
+		"$rate" "$sent" "$achieved" "$received" "$delivered" "$loss" \
+		"$(value "cpu ns per packet" $ROUTER_STATS)" \
+		"$(value "latency p50 ns" $ROUTER_STATS)" \
+		"$(value "latency p90 ns" $ROUTER_STATS)" \
+		"$(value "latency p99 ns" $ROUTER_STATS)" \
+		"$(value "latency p99.9 ns" $ROUTER_STATS)" \
+		"$(value "latency max ns" $ROUTER_STATS)"
+done
+
+rm -f $ROUTER_STATS $PKTGEN_STATS
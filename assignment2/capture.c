@@ -0,0 +1,324 @@
+/**
+ * Offline packet sources for the router. Files are mapped read only and
+ * every datagram is handed out as a pointer into the mapping.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_LENGTH 24
+#define PCAP_RECORD_LENGTH 16
+
+/* Link layers a UDP capture is likely to come with */
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define IP_PROTOCOL_UDP 17
+#define UDP_HEADER_LENGTH 8
+
+static int next_line(CaptureReader* reader, const char** data, size_t* length);
+static int next_pcap(CaptureReader* reader, const char** data, size_t* length);
+static int udp_payload(const unsigned char* frame, size_t size, uint32_t link_type, const char** data, size_t* length);
+static int ip_payload(const unsigned char* packet, size_t size, const char** data, size_t* length);
+static uint32_t read_u32(CaptureReader* reader, const unsigned char* field);
+static uint16_t read_be16(const unsigned char* field);
+
+/**
+ * Maps a capture file and works out its format.
+ */
+CaptureReader* capture_open(const char* path)
+{
+	CaptureReader* reader;
+	struct stat info;
+	void* data;
+	uint32_t magic;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &info) == -1)
+	{
+		fprintf(stderr, "Unable to read capture file: %s.\n", path);
+		exit(-1);
+	}
+
+	reader = malloc(sizeof(CaptureReader));
+	memset(reader, 0, sizeof(CaptureReader));
+	reader->format = CAPTURE_LINES;
+
+	// an empty file maps to nothing, but is still a valid, empty capture
+	if (info.st_size == 0)
+	{
+		close(fd);
+		return reader;
+	}
+
+	data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Unable to map capture file: %s.\n", path);
+		exit(-1);
+	}
+	madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+	reader->data = data;
+	reader->size = info.st_size;
+
+	if (reader->size >= sizeof(TraceHeader) && memcmp(data, TRACE_MAGIC, strlen(TRACE_MAGIC)) == 0)
+	{
+		// the trace reader keeps its own mapping
+		munmap(data, info.st_size);
+		reader->data = NULL;
+		reader->size = 0;
+		reader->format = CAPTURE_TRACE;
+		reader->trace = trace_reader_open(path);
+		return reader;
+	}
+
+	if (reader->size >= PCAP_HEADER_LENGTH)
+	{
+		memcpy(&magic, data, sizeof(magic));
+		if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NS ||
+			__builtin_bswap32(magic) == PCAP_MAGIC || __builtin_bswap32(magic) == PCAP_MAGIC_NS
+		) {
+			reader->format = CAPTURE_PCAP;
+			reader->swapped = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS;
+			reader->link_type = read_u32(reader, reader->data + 20) & 0xffff;
+			reader->offset = PCAP_HEADER_LENGTH;
+		}
+	}
+
+	return reader;
+}
+
+/**
+ * Points data at the next packet, no copy is made and nothing is
+ * terminated. Records that don't hold a UDP datagram are skipped and
+ * counted.
+ *
+ * Returns 0 on success, -1 at the end of the file.
+ */
+int capture_next(CaptureReader* reader, const char** data, size_t* length)
+{
+	uint64_t delta;
+
+	switch (reader->format)
+	{
+		case CAPTURE_LINES:
+			return next_line(reader, data, length);
+		case CAPTURE_PCAP:
+			return next_pcap(reader, data, length);
+		case CAPTURE_TRACE:
+			return trace_read_packet(reader->trace, &delta, data, length);
+	}
+
+	return -1;
+}
+
+const char* capture_format_name(CaptureReader* reader)
+{
+	static const char* names[] = {"lines", "pcap", "trace"};
+
+	return names[reader->format];
+}
+
+void capture_close(CaptureReader* reader)
+{
+	if (reader->trace != NULL)
+	{
+		trace_reader_close(reader->trace);
+	}
+	if (reader->data != NULL)
+	{
+		munmap((void*) reader->data, reader->size);
+	}
+	free(reader);
+}
+
+/**
+ * One packet per line, blank lines and a trailing \r are dropped.
+ */
+static int next_line(CaptureReader* reader, const char** data, size_t* length)
+{
+	while (reader->offset < reader->size)
+	{
+		const unsigned char* start = reader->data + reader->offset;
+		const unsigned char* end = memchr(start, '\n', reader->size - reader->offset);
+		size_t size = end != NULL ? (size_t) (end - start) : reader->size - reader->offset;
+
+		reader->offset += size + (end != NULL);
+		if (size > 0 && start[size - 1] == '\r')
+		{
+			size--;
+		}
+
+		if (size > 0)
+		{
+			*data = (const char*) start;
+			*length = size;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int next_pcap(CaptureReader* reader, const char** data, size_t* length)
+{
+	while (reader->size - reader->offset >= PCAP_RECORD_LENGTH)
+	{
+		const unsigned char* record = reader->data + reader->offset;
+		uint32_t captured = read_u32(reader, record + 8);
+
+		if (captured > reader->size - reader->offset - PCAP_RECORD_LENGTH)
+		{
+			break;
+		}
+
+		reader->offset += PCAP_RECORD_LENGTH + captured;
+		if (udp_payload(record + PCAP_RECORD_LENGTH, captured, reader->link_type, data, length) == 0)
+		{
+			return 0;
+		}
+		reader->skipped++;
+	}
+
+	return -1;
+}
+
+/**
+ * Strips the link layer off a captured frame.
+ */
+static int udp_payload(const unsigned char* frame, size_t size, uint32_t link_type, const char** data, size_t* length)
+{
+	size_t header;
+	uint16_t ethertype;
+
+	switch (link_type)
+	{
+		case LINKTYPE_NULL:
+			// the address family is in the capturing host's byte order, the IP version says enough
+			header = 4;
+			break;
+		case LINKTYPE_ETHERNET:
+			if (size < 14)
+			{
+				return -1;
+			}
+			header = 14;
+			ethertype = read_be16(frame + 12);
+			if (ethertype == ETHERTYPE_VLAN && size >= 18)
+			{
+				header = 18;
+				ethertype = read_be16(frame + 16);
+			}
+			if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+			{
+				return -1;
+			}
+			break;
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			header = 0;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			header = 16;
+			break;
+		case LINKTYPE_LINUX_SLL2:
+			header = 20;
+			break;
+		default:
+			return -1;
+	}
+
+	if (size < header)
+	{
+		return -1;
+	}
+
+	return ip_payload(frame + header, size - header, data, length);
+}
+
+/**
+ * Finds the UDP payload of an IPv4 or IPv6 packet. Later fragments and IPv6
+ * extension headers aren't followed.
+ */
+static int ip_payload(const unsigned char* packet, size_t size, const char** data, size_t* length)
+{
+	size_t header;
+	size_t udp_length;
+
+	if (size < 1)
+	{
+		return -1;
+	}
+
+	if ((packet[0] >> 4) == 4)
+	{
+		header = (packet[0] & 0x0f) * 4;
+		if (size < 20 || header < 20 || packet[9] != IP_PROTOCOL_UDP || (read_be16(packet + 6) & 0x1fff) != 0)
+		{
+			return -1;
+		}
+	}
+	else if ((packet[0] >> 4) == 6)
+	{
+		header = 40;
+		if (size < header || packet[6] != IP_PROTOCOL_UDP)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		return -1;
+	}
+
+	if (size < header + UDP_HEADER_LENGTH)
+	{
+		return -1;
+	}
+
+	// trust the UDP length, but never past what was captured
+	udp_length = read_be16(packet + header + 4);
+	if (udp_length < UDP_HEADER_LENGTH || udp_length > size - header)
+	{
+		udp_length = size - header;
+	}
+
+	*data = (const char*) packet + header + UDP_HEADER_LENGTH;
+	*length = udp_length - UDP_HEADER_LENGTH;
+	return 0;
+}
+
+static uint32_t read_u32(CaptureReader* reader, const unsigned char* field)
+{
+	uint32_t value;
+
+	memcpy(&value, field, sizeof(value));
+	return reader->swapped ? __builtin_bswap32(value) : value;
+}
+
+static uint16_t read_be16(const unsigned char* field)
+{
+	return (uint16_t) (field[0] << 8 | field[1]);
+}
@@ -0,0 +1,36 @@
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "trace.h"
+
+typedef enum {
+	CAPTURE_LINES,
+	CAPTURE_PCAP,
+	CAPTURE_TRACE
+} CaptureFormat;
+
+/*
+ * Packets read straight out of a memory mapped file, in one of three
+ * formats picked from the file's first bytes: a pcap capture of UDP
+ * datagrams, a pktgen trace, or plain text with one packet per line.
+ */
+typedef struct {
+	const unsigned char* data;
+	size_t size;
+	size_t offset;
+	CaptureFormat format;
+	int swapped;
+	uint32_t link_type;
+	TraceReader* trace;
+	unsigned long skipped;
+} CaptureReader;
+
+CaptureReader* capture_open(const char* path);
+int capture_next(CaptureReader* reader, const char** data, size_t* length);
+const char* capture_format_name(CaptureReader* reader);
+void capture_close(CaptureReader* reader);
+
+#endif
@@ -0,0 +1,296 @@
+/**
+ * Heavy hitter tracking for destinations, cheap enough to run per packet.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "count_min.h"
+
+static uint64_t mix(uint64_t value);
+static int index_find(CountMin* sketch, const uint8_t* address, int version, uint64_t hash);
+static void index_insert(CountMin* sketch, int entry);
+static void index_remove(CountMin* sketch, int entry);
+static void heap_swap(CountMin* sketch, int a, int b);
+static void heap_sift_up(CountMin* sketch, int position);
+static void heap_sift_down(CountMin* sketch, int position);
+
+/**
+ * Allocates a sketch with 2^width_bits counters per row that tracks the
+ * top_size heaviest destinations.
+ */
+CountMin* CountMin_new(int width_bits, int top_size)
+{
+	CountMin* sketch = malloc(sizeof(CountMin));
+	size_t width = (size_t) 1 << width_bits;
+	uint32_t index_size = 2;
+
+	// at most half full, so probes stay short
+	while (index_size < 2 * (uint32_t) top_size)
+	{
+		index_size <<= 1;
+	}
+
+	sketch->counters = calloc(COUNT_MIN_DEPTH * width, sizeof(uint64_t));
+	sketch->width_bits = width_bits;
+	sketch->width_mask = width - 1;
+	sketch->top = calloc(top_size, sizeof(CountMinEntry));
+	sketch->heap = calloc(top_size, sizeof(int));
+	sketch->heap_positions = calloc(top_size, sizeof(int));
+	sketch->index = calloc(index_size, sizeof(int));
+	sketch->index_mask = index_size - 1;
+	sketch->top_size = top_size;
+	sketch->top_count = 0;
+	sketch->total = 0;
+
+	if (
+		sketch->counters == NULL || sketch->top == NULL || sketch->heap == NULL ||
+		sketch->heap_positions == NULL || sketch->index == NULL
+	)
+	{
+		fprintf(stderr, "Unable to allocate count-min sketch.\n");
+		exit(-1);
+	}
+
+	return sketch;
+}
+
+void CountMin_free(CountMin* sketch)
+{
+	free(sketch->counters);
+	free(sketch->top);
+	free(sketch->heap);
+	free(sketch->heap_positions);
+	free(sketch->index);
+	free(sketch);
+}
+
+/**
+ * Counts weight against a 16 byte address, IPv4 in the first 4, and keeps
+ * it in the top table if its estimate is now among the largest.
+ */
+void count_min_add(CountMin* sketch, const uint8_t* address, int version, uint64_t weight)
+{
+	uint64_t high, low, hash, estimate = UINT64_MAX;
+	uint32_t h1, h2;
+	int entry;
+
+	memcpy(&high, address, sizeof(high));
+	memcpy(&low, address + 8, sizeof(low));
+	hash = mix(high ^ mix(low ^ (uint64_t) version));
+
+	// the rows come from two halves of one hash rather than four hashes
+	h1 = (uint32_t) hash;
+	h2 = (uint32_t) (hash >> 32) | 1;
+	for (int row = 0; row < COUNT_MIN_DEPTH; row++)
+	{
+		uint64_t* counter = &sketch->counters[((size_t) row << sketch->width_bits) + ((h1 + row * h2) & sketch->width_mask)];
+
+		*counter += weight;
+		if (*counter < estimate)
+		{
+			estimate = *counter;
+		}
+	}
+	sketch->total += weight;
+
+	// counters only grow, so anything not above the smallest kept is
+	// either not kept or already kept at this count
+	if (sketch->top_count == sketch->top_size && estimate <= sketch->top[sketch->heap[0]].count)
+	{
+		return;
+	}
+
+	entry = index_find(sketch, address, version, hash);
+	if (entry != -1)
+	{
+		sketch->top[entry].count = estimate;
+		heap_sift_down(sketch, sketch->heap_positions[entry]);
+		return;
+	}
+
+	if (sketch->top_count < sketch->top_size)
+	{
+		entry = sketch->top_count++;
+		sketch->heap[entry] = entry;
+		sketch->heap_positions[entry] = entry;
+	}
+	else
+	{
+		entry = sketch->heap[0];
+		index_remove(sketch, entry);
+	}
+
+	memcpy(sketch->top[entry].address, address, sizeof(sketch->top[entry].address));
+	sketch->top[entry].version = version;
+	sketch->top[entry].count = estimate;
+	sketch->top[entry].hash = hash;
+	index_insert(sketch, entry);
+	heap_sift_up(sketch, sketch->heap_positions[entry]);
+	heap_sift_down(sketch, sketch->heap_positions[entry]);
+}
+
+/**
+ * Orders the top table heaviest first, for output. The index and heap are
+ * rebuilt for the entries' new places; ascending order is already a heap.
+ */
+void count_min_sort(CountMin* sketch)
+{
+	for (int i = 1; i < sketch->top_count; i++)
+	{
+		CountMinEntry entry = sketch->top[i];
+		int j = i;
+
+		while (j > 0 && sketch->top[j - 1].count < entry.count)
+		{
+			sketch->top[j] = sketch->top[j - 1];
+			j--;
+		}
+		sketch->top[j] = entry;
+	}
+
+	memset(sketch->index, 0, (sketch->index_mask + 1) * sizeof(int));
+	for (int i = 0; i < sketch->top_count; i++)
+	{
+		sketch->heap[i] = sketch->top_count - 1 - i;
+		sketch->heap_positions[sketch->top_count - 1 - i] = i;
+		index_insert(sketch, i);
+	}
+}
+
+/**
+ * Looks up address in the top table.
+ *
+ * Returns its entry, or -1 if it isn't kept.
+ */
+static int index_find(CountMin* sketch, const uint8_t* address, int version, uint64_t hash)
+{
+	for (uint32_t slot = (uint32_t) hash & sketch->index_mask; sketch->index[slot] != 0; slot = (slot + 1) & sketch->index_mask)
+	{
+		CountMinEntry* entry = &sketch->top[sketch->index[slot] - 1];
+
+		if (
+			entry->hash == hash && entry->version == version &&
+			memcmp(entry->address, address, sizeof(entry->address)) == 0
+		)
+		{
+			return sketch->index[slot] - 1;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Adds entry to the index, which holds entries plus one so 0 is empty.
+ */
+static void index_insert(CountMin* sketch, int entry)
+{
+	uint32_t slot = (uint32_t) sketch->top[entry].hash & sketch->index_mask;
+
+	while (sketch->index[slot] != 0)
+	{
+		slot = (slot + 1) & sketch->index_mask;
+	}
+	sketch->index[slot] = entry + 1;
+}
+
+/**
+ * Takes entry out of the index, shifting back whatever probed past it so
+ * no lookup stops short at the hole.
+ */
+static void index_remove(CountMin* sketch, int entry)
+{
+	uint32_t mask = sketch->index_mask;
+	uint32_t hole = (uint32_t) sketch->top[entry].hash & mask;
+
+	while (sketch->index[hole] != entry + 1)
+	{
+		hole = (hole + 1) & mask;
+	}
+	sketch->index[hole] = 0;
+
+	for (uint32_t next = (hole + 1) & mask; sketch->index[next] != 0; next = (next + 1) & mask)
+	{
+		uint32_t home = (uint32_t) sketch->top[sketch->index[next] - 1].hash & mask;
+
+		// only move it if its home isn't between the hole and where it is
+		if (((next - home) & mask) >= ((next - hole) & mask))
+		{
+			sketch->index[hole] = sketch->index[next];
+			sketch->index[next] = 0;
+			hole = next;
+		}
+	}
+}
+
+/**
+ * Swaps two places in the heap, keeping each entry's position up to date.
+ */
+static void heap_swap(CountMin* sketch, int a, int b)
+{
+	int entry = sketch->heap[a];
+
+	sketch->heap[a] = sketch->heap[b];
+	sketch->heap[b] = entry;
+	sketch->heap_positions[sketch->heap[a]] = a;
+	sketch->heap_positions[sketch->heap[b]] = b;
+}
+
+/**
+ * Moves the entry at position up past any heavier parents.
+ */
+static void heap_sift_up(CountMin* sketch, int position)
+{
+	while (position > 0)
+	{
+		int parent = (position - 1) / 2;
+
+		if (sketch->top[sketch->heap[parent]].count <= sketch->top[sketch->heap[position]].count)
+		{
+			return;
+		}
+		heap_swap(sketch, parent, position);
+		position = parent;
+	}
+}
+
+/**
+ * Moves the entry at position down past any lighter children, after its
+ * count has grown.
+ */
+static void heap_sift_down(CountMin* sketch, int position)
+{
+	for (;;)
+	{
+		int smallest = position;
+		int child = 2 * position + 1;
+
+		for (int i = child; i < child + 2 && i < sketch->top_count; i++)
+		{
+			if (sketch->top[sketch->heap[i]].count < sketch->top[sketch->heap[smallest]].count)
+			{
+				smallest = i;
+			}
+		}
+		if (smallest == position)
+		{
+			return;
+		}
+		heap_swap(sketch, smallest, position);
+		position = smallest;
+	}
+}
+
+/**
+ * The splitmix64 finalizer.
+ */
+static uint64_t mix(uint64_t value)
+{
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+	return value ^ (value >> 31);
+}
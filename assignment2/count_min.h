@@ -0,0 +1,44 @@
+#ifndef COUNT_MIN_H_
+#define COUNT_MIN_H_
+
+#include <stdint.h>
+
+#define COUNT_MIN_DEPTH 4
+
+/* A destination being tracked as one of the heaviest */
+typedef struct {
+	uint8_t address[16];
+	int version;
+	uint64_t count;
+	uint64_t hash;
+} CountMinEntry;
+
+/*
+ * A count-min sketch over destination addresses with a small table of the
+ * heaviest seen so far. Memory is fixed whatever the traffic, and counts can
+ * only be overestimated, by roughly total / width.
+ *
+ * The table's entries are found by a linear probing index on the hash, and
+ * kept in a min-heap by count, so a packet costs the same however large the
+ * table is.
+ */
+typedef struct {
+	uint64_t* counters;
+	int width_bits;
+	uint32_t width_mask;
+	CountMinEntry* top;
+	int* heap;
+	int* heap_positions;
+	int* index;
+	uint32_t index_mask;
+	int top_size;
+	int top_count;
+	uint64_t total;
+} CountMin;
+
+CountMin* CountMin_new(int width_bits, int top_size);
+void CountMin_free(CountMin* sketch);
+void count_min_add(CountMin* sketch, const uint8_t* address, int version, uint64_t weight);
+void count_min_sort(CountMin* sketch);
+
+#endif
@@ -0,0 +1,553 @@
+/**
+ * Output queueing for the router, so one congested next hop can't hold up
+ * the others.
+ *
+ * Each next hop gets a ring per priority class and a token bucket. The
+ * scheduler visits next hops round robin, taking up to EGRESS_QUANTUM
+ * packets from each while its bucket allows, and picks between classes by
+ * strict priority or by weighted round robin.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "egress.h"
+#include "router.h"
+
+static void ring_init(EgressRing* ring, int depth);
+static int ring_push(EgressRing* ring, const EgressPacket* packet);
+static EgressPacket* ring_peek(EgressRing* ring);
+static void ring_pop(EgressRing* ring);
+static int pick_class(Egress* egress, EgressQueue* queue);
+
+/**
+ * Allocates an empty set of queues, each class of each next hop holding up
+ * to depth packets, rounded up to a power of two.
+ */
+Egress* Egress_new(int depth)
+{
+	Egress* egress = malloc(sizeof(Egress));
+
+	egress->queues = NULL;
+	egress->queue_count = 0;
+	egress->queue_capacity = 0;
+	egress->next = 0;
+	egress->depth = depth > 0 ? depth : EGRESS_DEFAULT_DEPTH;
+	egress->scheduler = EGRESS_STRICT;
+	egress->rule_count = 0;
+	egress->source_rules = 0;
+	egress->shapes = NULL;
+	egress->shape_count = 0;
+	for (int c = 0; c < EGRESS_CLASSES; c++)
+	{
+		egress->weights[c] = 1;
+	}
+
+	return egress;
+}
+
+void Egress_free(Egress* egress)
+{
+	for (int i = 0; i < egress->queue_count; i++)
+	{
+		for (int c = 0; c < EGRESS_CLASSES; c++)
+		{
+			free(egress->queues[i]->rings[c].slots);
+		}
+		free(egress->queues[i]->name);
+		free(egress->queues[i]);
+	}
+	for (int i = 0; i < egress->shape_count; i++)
+	{
+		free(egress->shapes[i].name);
+	}
+	free(egress->queues);
+	free(egress->shapes);
+	free(egress);
+}
+
+/**
+ * Parses "strict", or "weighted:<w0>,<w1>,..." where each class may send
+ * its weight in packets per round. Missing weights stay at 1.
+ *
+ * Returns 0 on success, -1 if the spec is malformed.
+ */
+int egress_set_scheduler(Egress* egress, const char* spec)
+{
+	const char* weights;
+	char* end;
+
+	if (strcmp(spec, "strict") == 0)
+	{
+		egress->scheduler = EGRESS_STRICT;
+		return 0;
+	}
+
+	if (strncmp(spec, "weighted", 8) != 0 || (spec[8] != 0 && spec[8] != ':'))
+	{
+		return -1;
+	}
+
+	weights = spec[8] == ':' ? &spec[9] : "";
+	for (int c = 0; c < EGRESS_CLASSES && *weights != 0; c++)
+	{
+		long weight = strtol(weights, &end, 10);
+
+		if (end == weights || weight < 1 || (*end != 0 && *end != ','))
+		{
+			return -1;
+		}
+		egress->weights[c] = weight;
+		weights = *end == ',' ? end + 1 : end;
+	}
+
+	egress->scheduler = EGRESS_WEIGHTED;
+	return *weights == 0 ? 0 : -1;
+}
+
+/**
+ * Parses a classification rule, "<class>:<field><op><value>". src and dest
+ * take "=<prefix>", ttl and len take "=", "<=" or ">=" a number. The TTL
+ * is the one the packet arrived with, as for ACL rules.
+ *
+ * Returns 0 on success, -1 if the rule is malformed or there are too many.
+ */
+int egress_add_rule(Egress* egress, const char* spec)
+{
+	EgressRule rule;
+	const char* value;
+	char* end;
+	long number;
+	char op;
+
+	memset(&rule, 0, sizeof(rule));
+	rule.class = strtol(spec, &end, 10);
+	if (end == spec || *end != ':' || rule.class < 0 || rule.class >= EGRESS_CLASSES || egress->rule_count == EGRESS_MAX_RULES)
+	{
+		return -1;
+	}
+	spec = end + 1;
+
+	if (strncmp(spec, "src=", 4) == 0 || strncmp(spec, "dest=", 5) == 0)
+	{
+		rule.field = spec[0] == 's' ? EGRESS_FIELD_SOURCE : EGRESS_FIELD_DESTINATION;
+		if (parse_prefix(strchr(spec, '=') + 1, rule.network, &rule.version, &rule.prefix_length) != 0)
+		{
+			return -1;
+		}
+		egress->source_rules += rule.field == EGRESS_FIELD_SOURCE;
+		egress->rules[egress->rule_count++] = rule;
+		return 0;
+	}
+
+	if (strncmp(spec, "ttl", 3) == 0)
+	{
+		rule.field = EGRESS_FIELD_TTL;
+		value = &spec[3];
+	}
+	else if (strncmp(spec, "len", 3) == 0)
+	{
+		rule.field = EGRESS_FIELD_LENGTH;
+		value = &spec[3];
+	}
+	else
+	{
+		return -1;
+	}
+
+	// "<=" and ">=" leave the other end open, a negative maximum has no bound
+	op = value[0] == '=' ? '=' : (value[0] != 0 && value[1] == '=' ? value[0] : 0);
+	if (op != '=' && op != '<' && op != '>')
+	{
+		return -1;
+	}
+
+	value += op == '=' ? 1 : 2;
+	number = strtol(value, &end, 10);
+	if (end == value || *end != 0 || number < 0)
+	{
+		return -1;
+	}
+
+	rule.minimum = op == '<' ? 0 : number;
+	rule.maximum = op == '>' ? -1 : number;
+	egress->rules[egress->rule_count++] = rule;
+	return 0;
+}
+
+/**
+ * Parses "<next hop>:<packets/sec>[:<burst>]", for queues created from
+ * then on. The burst defaults to 10ms worth of packets, and "*" as the next
+ * hop limits every one without a limit of its own.
+ *
+ * Returns 0 on success, -1 if the spec is malformed.
+ */
+int egress_add_shape(Egress* egress, const char* spec)
+{
+	const char* colon = strchr(spec, ':');
+	EgressShape shape;
+	char* end;
+
+	if (colon == NULL || colon == spec)
+	{
+		return -1;
+	}
+
+	shape.rate = strtod(colon + 1, &end);
+	if (end == colon + 1 || shape.rate < 0 || (*end != 0 && *end != ':'))
+	{
+		return -1;
+	}
+
+	shape.burst = shape.rate / 100 >= 1 ? shape.rate / 100 : 1;
+	if (*end == ':')
+	{
+		const char* burst = end + 1;
+
+		shape.burst = strtod(burst, &end);
+		if (end == burst || *end != 0 || shape.burst < 1)
+		{
+			return -1;
+		}
+	}
+
+	shape.name = malloc(colon - spec + 1);
+	memcpy(shape.name, spec, colon - spec);
+	shape.name[colon - spec] = 0;
+
+	egress->shapes = realloc(egress->shapes, (egress->shape_count + 1) * sizeof(EgressShape));
+	egress->shapes[egress->shape_count++] = shape;
+	return 0;
+}
+
+/**
+ * Finds the queues for a next hop by name, creating them the first time.
+ * Queues outlive routing table reloads, so anything waiting in them still
+ * goes out after its next hop is renamed or removed.
+ */
+EgressQueue* egress_queue(Egress* egress, const char* next_hop)
+{
+	EgressQueue* queue;
+	const EgressShape* shape = NULL;
+
+	for (int i = 0; i < egress->queue_count; i++)
+	{
+		if (strcmp(egress->queues[i]->name, next_hop) == 0)
+		{
+			return egress->queues[i];
+		}
+	}
+
+	queue = calloc(1, sizeof(EgressQueue));
+	if (queue == NULL)
+	{
+		fprintf(stderr, "Unable to allocate egress queue.\n");
+		exit(-1);
+	}
+
+	queue->name = malloc(strlen(next_hop) + 1);
+	strcpy(queue->name, next_hop);
+	for (int c = 0; c < EGRESS_CLASSES; c++)
+	{
+		ring_init(&queue->rings[c], egress->depth);
+	}
+	queue->credit = egress->weights[0];
+
+	// a limit for this next hop beats the wildcard, whichever came first
+	for (int i = 0; i < egress->shape_count; i++)
+	{
+		if (strcmp(egress->shapes[i].name, next_hop) == 0 || (shape == NULL && strcmp(egress->shapes[i].name, "*") == 0))
+		{
+			shape = &egress->shapes[i];
+		}
+	}
+	token_bucket_init(&queue->bucket, shape != NULL ? shape->rate : 0, shape != NULL ? shape->burst : 0);
+
+	if (egress->queue_count == egress->queue_capacity)
+	{
+		egress->queue_capacity = egress->queue_capacity == 0 ? 8 : egress->queue_capacity * 2;
+		egress->queues = realloc(egress->queues, egress->queue_capacity * sizeof(EgressQueue*));
+	}
+	egress->queues[egress->queue_count++] = queue;
+	return queue;
+}
+
+/**
+ * Picks the class for a packet. Addresses are 16 bytes, IPv4 in the first
+ * 4, and source is only looked at if some rule needs it.
+ *
+ * Returns the class of the first matching rule, or the lowest class.
+ */
+int egress_classify(const Egress* egress, int version, const uint8_t* source, const uint8_t* destination, int ttl, int length)
+{
+	for (int i = 0; i < egress->rule_count; i++)
+	{
+		const EgressRule* rule = &egress->rules[i];
+		long value;
+
+		switch (rule->field)
+		{
+			case EGRESS_FIELD_SOURCE:
+				if (rule->version == version && source != NULL && prefix_matches(rule->network, rule->prefix_length, source))
+				{
+					return rule->class;
+				}
+				continue;
+
+			case EGRESS_FIELD_DESTINATION:
+				if (rule->version == version && prefix_matches(rule->network, rule->prefix_length, destination))
+				{
+					return rule->class;
+				}
+				continue;
+
+			case EGRESS_FIELD_TTL:
+				value = ttl;
+				break;
+
+			default:
+				value = length;
+				break;
+		}
+
+		if (value >= rule->minimum && (rule->maximum < 0 || value <= rule->maximum))
+		{
+			return rule->class;
+		}
+	}
+
+	return EGRESS_CLASSES - 1;
+}
+
+/**
+ * Queues a packet without ever blocking.
+ *
+ * Returns 0 if it was queued, -1 if its ring was full and it was dropped.
+ */
+int egress_enqueue(EgressQueue* queue, int class, const EgressPacket* packet)
+{
+	uint32_t depth;
+
+	if (ring_push(&queue->rings[class], packet) != 0)
+	{
+		queue->dropped[class]++;
+		return -1;
+	}
+
+	queue->enqueued++;
+	depth = egress_depth(queue);
+	if (depth > queue->peak_depth)
+	{
+		queue->peak_depth = depth;
+	}
+	return 0;
+}
+
+/**
+ * Sends everything the token buckets allow right now, going round the next
+ * hops so each one gets its quantum in turn.
+ *
+ * Returns the number of packets sent.
+ */
+int egress_run(Egress* egress, uint64_t now_ns, EgressTransmit transmit, void* context)
+{
+	int sent = 0;
+	int progress = 1;
+
+	while (progress && egress->queue_count > 0)
+	{
+		progress = 0;
+		for (int n = 0; n < egress->queue_count; n++)
+		{
+			EgressQueue* queue = egress->queues[(egress->next + n) % egress->queue_count];
+
+			for (int q = 0; q < EGRESS_QUANTUM; q++)
+			{
+				int class = pick_class(egress, queue);
+
+				if (class == -1)
+				{
+					break;
+				}
+
+				if (token_bucket_take(&queue->bucket, 1, now_ns) != 0)
+				{
+					EgressPacket* waiting = ring_peek(&queue->rings[class]);
+
+					// the scheduler comes back to it every pass, count it the first time only
+					if (!waiting->held)
+					{
+						waiting->held = 1;
+						queue->throttled++;
+					}
+					break;
+				}
+
+				transmit(context, queue, ring_peek(&queue->rings[class]), now_ns);
+				ring_pop(&queue->rings[class]);
+				queue->credit--;
+				queue->sent++;
+				sent++;
+				progress = 1;
+			}
+		}
+
+		// the next round starts one next hop further on
+		egress->next = (egress->next + 1) % egress->queue_count;
+	}
+
+	return sent;
+}
+
+/**
+ * Returns how long until some queued packet may be sent, 0 if one may go
+ * now, or UINT64_MAX if nothing is queued at all.
+ */
+uint64_t egress_wait_ns(Egress* egress, uint64_t now_ns)
+{
+	uint64_t wait = UINT64_MAX;
+
+	for (int i = 0; i < egress->queue_count; i++)
+	{
+		EgressQueue* queue = egress->queues[i];
+		uint64_t queue_wait;
+
+		if (egress_depth(queue) == 0)
+		{
+			continue;
+		}
+
+		queue_wait = token_bucket_wait_ns(&queue->bucket, 1, now_ns);
+		if (queue_wait < wait)
+		{
+			wait = queue_wait;
+		}
+	}
+
+	return wait;
+}
+
+/**
+ * Returns the packets waiting across every class of the queue.
+ */
+uint32_t egress_depth(EgressQueue* queue)
+{
+	uint32_t depth = 0;
+
+	for (int c = 0; c < EGRESS_CLASSES; c++)
+	{
+		EgressRing* ring = &queue->rings[c];
+
+		depth += __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	}
+
+	return depth;
+}
+
+uint64_t egress_dropped(const EgressQueue* queue)
+{
+	uint64_t dropped = 0;
+
+	for (int c = 0; c < EGRESS_CLASSES; c++)
+	{
+		dropped += queue->dropped[c];
+	}
+
+	return dropped;
+}
+
+static void ring_init(EgressRing* ring, int depth)
+{
+	uint32_t size = 1;
+
+	while (size < (uint32_t) depth)
+	{
+		size <<= 1;
+	}
+
+	ring->slots = malloc(size * sizeof(EgressPacket));
+	if (ring->slots == NULL)
+	{
+		fprintf(stderr, "Unable to allocate egress queue.\n");
+		exit(-1);
+	}
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/**
+ * Producer side. The release store on tail publishes the slot contents
+ * together with the new tail.
+ */
+static int ring_push(EgressRing* ring, const EgressPacket* packet)
+{
+	uint32_t tail = ring->tail;
+
+	if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+	{
+		return -1;
+	}
+
+	ring->slots[tail & ring->mask] = *packet;
+	ring->slots[tail & ring->mask].held = 0;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Consumer side, returns the oldest packet or NULL. It stays in place until
+ * ring_pop hands the slot back to the producer.
+ */
+static EgressPacket* ring_peek(EgressRing* ring)
+{
+	uint32_t head = ring->head;
+
+	if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+
+	return &ring->slots[head & ring->mask];
+}
+
+static void ring_pop(EgressRing* ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Returns the class the next packet should come from, or -1 if the queue is
+ * empty. Weighted round robin stays on a class until it has used up its
+ * credit or run dry, then moves on with a fresh credit for the next class.
+ */
+static int pick_class(Egress* egress, EgressQueue* queue)
+{
+	if (egress->scheduler == EGRESS_STRICT)
+	{
+		for (int c = 0; c < EGRESS_CLASSES; c++)
+		{
+			if (ring_peek(&queue->rings[c]) != NULL)
+			{
+				return c;
+			}
+		}
+		return -1;
+	}
+
+	for (int tries = 0; tries <= EGRESS_CLASSES; tries++)
+	{
+		if (queue->credit > 0 && ring_peek(&queue->rings[queue->current]) != NULL)
+		{
+			return queue->current;
+		}
+
+		queue->current = (queue->current + 1) % EGRESS_CLASSES;
+		queue->credit = egress->weights[queue->current];
+	}
+
+	return -1;
+}
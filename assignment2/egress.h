@@ -0,0 +1,111 @@
+#ifndef EGRESS_H_
+#define EGRESS_H_
+
+#include <stdint.h>
+
+#include "token_bucket.h"
+
+/* Priority classes per next hop, class 0 goes first under strict priority */
+#define EGRESS_CLASSES 4
+#define EGRESS_DEFAULT_DEPTH 256
+#define EGRESS_MAX_RULES 32
+/* Packets one next hop may send before the scheduler moves to the next */
+#define EGRESS_QUANTUM 8
+
+/* A packet waiting to go out, with as much of it kept as transmitting needs */
+typedef struct {
+	int id;
+	uint32_t length;
+	uint64_t enqueued_ns;
+	int held;
+	char address[48];
+} EgressPacket;
+
+/*
+ * A bounded single producer, single consumer ring. The router only moves
+ * tail and the scheduler only moves head, so neither side ever waits on the
+ * other, and a full ring drops the packet instead of blocking ingress.
+ */
+typedef struct {
+	EgressPacket* slots;
+	uint32_t mask;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+} EgressRing;
+
+/* Everything queued for one next hop, with its own rate limit */
+typedef struct {
+	char* name;
+	EgressRing rings[EGRESS_CLASSES];
+	TokenBucket bucket;
+	int current;
+	int credit;
+	uint32_t peak_depth;
+	uint64_t enqueued;
+	uint64_t sent;
+	/* Packets that had to wait for tokens, each counted once however long */
+	uint64_t throttled;
+	uint64_t dropped[EGRESS_CLASSES];
+} EgressQueue;
+
+typedef enum {
+	EGRESS_STRICT,
+	EGRESS_WEIGHTED
+} EgressScheduler;
+
+typedef enum {
+	EGRESS_FIELD_SOURCE,
+	EGRESS_FIELD_DESTINATION,
+	EGRESS_FIELD_TTL,
+	EGRESS_FIELD_LENGTH
+} EgressField;
+
+/* Puts packets whose field matches into class, the first match wins */
+typedef struct {
+	int class;
+	EgressField field;
+	int version;
+	uint8_t network[16];
+	int prefix_length;
+	long minimum;
+	long maximum;
+} EgressRule;
+
+/* A rate limit waiting for its next hop, "*" applies to every one */
+typedef struct {
+	char* name;
+	double rate;
+	double burst;
+} EgressShape;
+
+typedef struct {
+	EgressQueue** queues;
+	int queue_count;
+	int queue_capacity;
+	int next;
+	int depth;
+	EgressScheduler scheduler;
+	int weights[EGRESS_CLASSES];
+	EgressRule rules[EGRESS_MAX_RULES];
+	int rule_count;
+	int source_rules;
+	EgressShape* shapes;
+	int shape_count;
+} Egress;
+
+typedef void (*EgressTransmit)(void* context, EgressQueue* queue, EgressPacket* packet, uint64_t now_ns);
+
+Egress* Egress_new(int depth);
+void Egress_free(Egress* egress);
+int egress_set_scheduler(Egress* egress, const char* spec);
+int egress_add_rule(Egress* egress, const char* spec);
+int egress_add_shape(Egress* egress, const char* spec);
+EgressQueue* egress_queue(Egress* egress, const char* next_hop);
+int egress_classify(const Egress* egress, int version, const uint8_t* source, const uint8_t* destination, int ttl, int length);
+int egress_enqueue(EgressQueue* queue, int class, const EgressPacket* packet);
+int egress_run(Egress* egress, uint64_t now_ns, EgressTransmit transmit, void* context);
+uint64_t egress_wait_ns(Egress* egress, uint64_t now_ns);
+uint32_t egress_depth(EgressQueue* queue);
+uint64_t egress_dropped(const EgressQueue* queue);
+
+#endif
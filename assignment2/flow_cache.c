@@ -0,0 +1,142 @@
+/**
+ * A small set associative cache mapping destination addresses to the index
+ * of the route that resolved them, so repeat destinations skip the table
+ * search entirely.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "flow_cache.h"
+
+static void flow_cache_clear(FlowCache* cache);
+static uint32_t flow_cache_set_index(FlowCache* cache, uint32_t key);
+
+/**
+ * Allocates a cache with set_count sets, rounded up to a power of two so a
+ * set can be picked with a shift rather than a modulo.
+ */
+FlowCache* FlowCache_new(int set_count)
+{
+	FlowCache* cache = malloc(sizeof(FlowCache));
+	void* sets;
+	int bits = 0;
+
+	while ((1 << bits) < set_count)
+	{
+		bits++;
+	}
+
+	// line the sets up with cache lines so a probe never straddles two
+	if (posix_memalign(&sets, 64, (1 << bits) * sizeof(FlowCacheSet)) != 0)
+	{
+		fprintf(stderr, "Unable to allocate flow cache.\n");
+		exit(-1);
+	}
+
+	cache->sets = sets;
+	cache->set_bits = bits;
+	cache->set_mask = (1 << bits) - 1;
+	cache->generation = 0;
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->evictions = 0;
+	cache->invalidations = 0;
+	flow_cache_clear(cache);
+
+	return cache;
+}
+
+void FlowCache_free(FlowCache* cache)
+{
+	free(cache->sets);
+	free(cache);
+}
+
+/**
+ * Drops every cached entry if the routing table has changed since the cache
+ * was last filled. Cheap enough to call once per received batch.
+ */
+void flow_cache_sync(FlowCache* cache, unsigned int generation)
+{
+	if (cache->generation != generation)
+	{
+		flow_cache_clear(cache);
+		cache->generation = generation;
+		cache->invalidations++;
+	}
+}
+
+/**
+ * Probes the set for key, storing the cached route index in value.
+ *
+ * Returns 0 on a hit, -1 on a miss.
+ */
+int flow_cache_lookup(FlowCache* cache, uint32_t key, int* value)
+{
+	FlowCacheSet* set = &cache->sets[flow_cache_set_index(cache, key)];
+
+	for (int way = 0; way < FLOW_CACHE_WAYS; way++)
+	{
+		if (set->keys[way] == key && set->values[way] != FLOW_CACHE_EMPTY)
+		{
+			*value = set->values[way];
+			cache->hits++;
+			return 0;
+		}
+	}
+
+	cache->misses++;
+	return -1;
+}
+
+/**
+ * Inserts key at the front of its set, pushing the oldest way out the back.
+ */
+void flow_cache_insert(FlowCache* cache, uint32_t key, int value)
+{
+	FlowCacheSet* set = &cache->sets[flow_cache_set_index(cache, key)];
+
+	if (set->values[FLOW_CACHE_WAYS - 1] != FLOW_CACHE_EMPTY)
+	{
+		cache->evictions++;
+	}
+
+	for (int way = FLOW_CACHE_WAYS - 1; way > 0; way--)
+	{
+		set->keys[way] = set->keys[way - 1];
+		set->values[way] = set->values[way - 1];
+	}
+
+	set->keys[0] = key;
+	set->values[0] = value;
+}
+
+static void flow_cache_clear(FlowCache* cache)
+{
+	for (uint32_t i = 0; i <= cache->set_mask; i++)
+	{
+		for (int way = 0; way < FLOW_CACHE_WAYS; way++)
+		{
+			cache->sets[i].keys[way] = 0;
+			cache->sets[i].values[way] = FLOW_CACHE_EMPTY;
+		}
+	}
+}
+
+/**
+ * Fibonacci hashing, addresses in the same subnet differ only in their low
+ * bits so those need spreading across the sets.
+ */
+static uint32_t flow_cache_set_index(FlowCache* cache, uint32_t key)
+{
+	if (cache->set_bits == 0)
+	{
+		return 0;
+	}
+
+	return (key * 2654435761u) >> (32 - cache->set_bits);
+}
@@ -0,0 +1,35 @@
+#ifndef FLOW_CACHE_H_
+#define FLOW_CACHE_H_
+
+#include <stdint.h>
+
+#define FLOW_CACHE_WAYS 4
+#define FLOW_CACHE_DEFAULT_SETS 1024
+
+/* marks a way that holds nothing, -1 is left free for "unroutable" */
+#define FLOW_CACHE_EMPTY -2
+
+/* One set is 32 bytes so two sets share a single cache line */
+typedef struct {
+	uint32_t keys[FLOW_CACHE_WAYS];
+	int32_t values[FLOW_CACHE_WAYS];
+} FlowCacheSet;
+
+typedef struct {
+	FlowCacheSet* sets;
+	uint32_t set_mask;
+	int set_bits;
+	unsigned int generation;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long invalidations;
+} FlowCache;
+
+FlowCache* FlowCache_new(int set_count);
+void FlowCache_free(FlowCache* cache);
+void flow_cache_sync(FlowCache* cache, unsigned int generation);
+int flow_cache_lookup(FlowCache* cache, uint32_t key, int* value);
+void flow_cache_insert(FlowCache* cache, uint32_t key, int value);
+
+#endif
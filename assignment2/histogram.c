@@ -0,0 +1,117 @@
+/**
+ * Fixed size latency histograms, cheap enough to record into per packet.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static int histogram_bucket(uint64_t value);
+static uint64_t histogram_bucket_value(int bucket);
+
+void histogram_reset(Histogram* histogram)
+{
+	memset(histogram, 0, sizeof(Histogram));
+}
+
+void histogram_record(Histogram* histogram, uint64_t value)
+{
+	histogram_record_n(histogram, value, 1);
+}
+
+/**
+ * Records count samples of the same value.
+ */
+void histogram_record_n(Histogram* histogram, uint64_t value, unsigned long count)
+{
+	unsigned long* bucket = &histogram->counts[histogram_bucket(value)];
+
+	__atomic_store_n(bucket, *bucket + count, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->total, histogram->total + count, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copies a histogram that may still be recorded into by its owner. The
+ * total is summed from the buckets copied, so it always agrees with them.
+ */
+void histogram_snapshot(Histogram* into, const Histogram* from)
+{
+	into->total = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		into->counts[i] = __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+		into->total += into->counts[i];
+	}
+}
+
+void histogram_merge(Histogram* into, const Histogram* from)
+{
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		into->counts[i] += from->counts[i];
+	}
+	into->total += from->total;
+}
+
+/**
+ * Returns the smallest bucket value with at least percentile (0 - 100) of
+ * the recorded values at or below it, or 0 if nothing was recorded.
+ */
+uint64_t histogram_percentile(const Histogram* histogram, double percentile)
+{
+	unsigned long seen = 0;
+	double wanted = histogram->total * percentile / 100.0;
+
+	if (histogram->total == 0)
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += histogram->counts[i];
+		if (seen > 0 && seen >= wanted)
+		{
+			return histogram_bucket_value(i);
+		}
+	}
+
+	return histogram_bucket_value(HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * Values below HISTOGRAM_SUB_BUCKETS get a bucket each, above that the top
+ * HISTOGRAM_SUB_BITS bits under the leading one pick the step within its
+ * power of two.
+ */
+static int histogram_bucket(uint64_t value)
+{
+	int exponent;
+
+	if (value < HISTOGRAM_SUB_BUCKETS)
+	{
+		return (int) value;
+	}
+
+	exponent = 63 - __builtin_clzll(value);
+	return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS +
+		(int) ((value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/**
+ * The lowest value that lands in bucket.
+ */
+static uint64_t histogram_bucket_value(int bucket)
+{
+	int exponent;
+	uint64_t step;
+
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+	{
+		return bucket;
+	}
+
+	exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+	step = bucket % HISTOGRAM_SUB_BUCKETS;
+	return (1ull << exponent) | (step << (exponent - HISTOGRAM_SUB_BITS));
+}
@@ -0,0 +1,32 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+/*
+ * Log-linear buckets in the style of HdrHistogram: every power of two is
+ * split into 2^HISTOGRAM_SUB_BITS linear steps, so any recorded value is
+ * off by at most about 6%, across the whole range of a uint64_t.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * A histogram has a single writer. Counters are word sized and updated with
+ * relaxed atomic stores, so any other thread can take a snapshot while it is
+ * being recorded into, without locks or torn reads.
+ */
+typedef struct {
+	unsigned long counts[HISTOGRAM_BUCKETS];
+	unsigned long total;
+} Histogram;
+
+void histogram_reset(Histogram* histogram);
+void histogram_record(Histogram* histogram, uint64_t value);
+void histogram_record_n(Histogram* histogram, uint64_t value, unsigned long count);
+void histogram_snapshot(Histogram* into, const Histogram* from);
+void histogram_merge(Histogram* into, const Histogram* from);
+uint64_t histogram_percentile(const Histogram* histogram, double percentile);
+
+#endif
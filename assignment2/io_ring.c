@@ -0,0 +1,324 @@
+/**
+ * io_uring receive path for the router, driven through raw syscalls so it
+ * builds anywhere the kernel headers are installed.
+ *
+ * One multishot recvmsg stays armed on the socket and takes its buffers from
+ * a registered buffer ring. Buffers handed out by io_ring_receive go back to
+ * the kernel in a single tail update on io_ring_release.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io_ring.h"
+
+#define IO_RING_ENTRIES 8
+#define IO_RING_BUFFER_GROUP 0
+
+static int io_ring_enter(IoRing* ring, unsigned int submit, unsigned int wait);
+static void io_ring_arm(IoRing* ring);
+static void io_ring_provide(IoRing* ring, unsigned short id);
+
+/**
+ * Sets up a ring receiving from the given socket. control_length bytes are
+ * kept in front of each datagram for ancillary data like receive timestamps.
+ *
+ * Returns 0 on success, -1 with errno set if the kernel can't run it.
+ */
+int io_ring_open(IoRing* ring, int socketfd, size_t control_length)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg registration;
+	size_t sq_size, cq_size;
+	size_t ring_bytes = IO_RING_BUFFERS * sizeof(struct io_uring_buf);
+	int saved;
+
+	memset(ring, 0, sizeof(IoRing));
+	memset(&params, 0, sizeof(params));
+
+	// every buffer can be waiting in the completion queue at once
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = IO_RING_BUFFERS;
+
+	ring->socketfd = socketfd;
+	ring->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+	if (ring->fd < 0)
+	{
+		return -1;
+	}
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		close(ring->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->buffer_ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffers = malloc((size_t) IO_RING_BUFFERS * IO_RING_BUFFER_SIZE);
+
+	if (ring->rings == MAP_FAILED || ring->sqes == MAP_FAILED ||
+		ring->buffer_ring == MAP_FAILED || ring->buffers == NULL
+	) {
+		saved = errno;
+		io_ring_close(ring);
+		errno = saved;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int*) ((char*) ring->rings + params.sq_off.head);
+	ring->sq_tail = (unsigned int*) ((char*) ring->rings + params.sq_off.tail);
+	ring->sq_mask = (unsigned int*) ((char*) ring->rings + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int*) ((char*) ring->rings + params.sq_off.array);
+	ring->cq_head = (unsigned int*) ((char*) ring->rings + params.cq_off.head);
+	ring->cq_tail = (unsigned int*) ((char*) ring->rings + params.cq_off.tail);
+	ring->cq_mask = (unsigned int*) ((char*) ring->rings + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) ((char*) ring->rings + params.cq_off.cqes);
+
+	memset(&registration, 0, sizeof(registration));
+	registration.ring_addr = (uintptr_t) ring->buffer_ring;
+	registration.ring_entries = IO_RING_BUFFERS;
+	registration.bgid = IO_RING_BUFFER_GROUP;
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0)
+	{
+		saved = errno;
+		io_ring_close(ring);
+		errno = saved;
+		return -1;
+	}
+
+	for (int i = 0; i < IO_RING_BUFFERS; i++)
+	{
+		io_ring_provide(ring, i);
+	}
+	__atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+
+	// only ancillary data comes back, the sender's address isn't needed
+	ring->message.msg_namelen = 0;
+	ring->message.msg_controllen = control_length;
+
+	// multishot recvmsg needs a 6.0 kernel, older ones reject it right away
+	io_ring_arm(ring);
+	if (io_ring_enter(ring, 1, 0) < 0)
+	{
+		saved = errno;
+		io_ring_close(ring);
+		errno = saved;
+		return -1;
+	}
+
+	if (*ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe* cqe = &ring->cqes[*ring->cq_head & *ring->cq_mask];
+		if (cqe->res < 0)
+		{
+			saved = -cqe->res;
+			io_ring_close(ring);
+			errno = saved;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Takes up to max of whatever datagrams have completed, waiting for at
+ * least one if asked to. Everything returned by the previous call has to be
+ * released first.
+ *
+ * Returns the number of packets, or -1 with errno set, EAGAIN if not
+ * waiting and nothing is ready.
+ */
+int io_ring_receive(IoRing* ring, IoRingPacket* packets, int max, int wait)
+{
+	unsigned int head, tail;
+	size_t offset = sizeof(struct io_uring_recvmsg_out) + ring->message.msg_controllen;
+	int count = 0;
+
+	if (max > IO_RING_MAX_BATCH)
+	{
+		max = IO_RING_MAX_BATCH;
+	}
+
+	while (count == 0)
+	{
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			// an ended multishot is rearmed in the same call that waits
+			unsigned int submit = 0;
+			if (!ring->armed)
+			{
+				io_ring_arm(ring);
+				submit = 1;
+			}
+
+			if (io_ring_enter(ring, submit, wait ? 1 : 0) < 0)
+			{
+				return -1;
+			}
+
+			if (!wait)
+			{
+				errno = EAGAIN;
+				return -1;
+			}
+			continue;
+		}
+
+		while (head != tail && count < max)
+		{
+			struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+			head++;
+
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+			{
+				ring->armed = 0;
+				ring->rearms++;
+			}
+
+			// -ENOBUFS just means we're holding every buffer, keep going
+			if (cqe->res < 0 && cqe->res != -ENOBUFS && count == 0)
+			{
+				__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+				errno = -cqe->res;
+				return -1;
+			}
+
+			if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+			{
+				continue;
+			}
+
+			unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			char* buffer = ring->buffers + (size_t) id * IO_RING_BUFFER_SIZE;
+			struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*) buffer;
+			unsigned int room = IO_RING_BUFFER_SIZE - offset - 1;
+
+			// the buffer goes straight back, there's nothing to hand out
+			if ((out->flags & MSG_TRUNC) || out->payloadlen > room)
+			{
+				ring->truncated++;
+				io_ring_provide(ring, id);
+				__atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+				continue;
+			}
+
+			packets[count].control = buffer + sizeof(*out) + ring->message.msg_namelen;
+			packets[count].control_length = out->controllen;
+			packets[count].data = buffer + offset;
+			packets[count].length = out->payloadlen;
+			ring->pending[ring->pending_count++] = id;
+			count++;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+/**
+ * Hands the buffers from the last receive back to the kernel, and restarts
+ * the receive if it stopped for lack of them.
+ */
+void io_ring_release(IoRing* ring)
+{
+	for (int i = 0; i < ring->pending_count; i++)
+	{
+		io_ring_provide(ring, ring->pending[i]);
+	}
+
+	ring->pending_count = 0;
+	__atomic_store_n(&ring->buffer_ring->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+
+	// nothing else would wake a caller polling the ring fd
+	if (!ring->armed)
+	{
+		io_ring_arm(ring);
+		io_ring_enter(ring, 1, 0);
+	}
+}
+
+void io_ring_close(IoRing* ring)
+{
+	if (ring->rings != NULL && ring->rings != MAP_FAILED)
+	{
+		munmap(ring->rings, ring->rings_size);
+	}
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+	{
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->buffer_ring != NULL && ring->buffer_ring != MAP_FAILED)
+	{
+		munmap(ring->buffer_ring, IO_RING_BUFFERS * sizeof(struct io_uring_buf));
+	}
+
+	free(ring->buffers);
+	close(ring->fd);
+}
+
+static int io_ring_enter(IoRing* ring, unsigned int submit, unsigned int wait)
+{
+	unsigned int flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	return syscall(__NR_io_uring_enter, ring->fd, submit, wait, flags, NULL, 0);
+}
+
+/**
+ * Queues the multishot recvmsg, the caller submits it.
+ */
+static void io_ring_arm(IoRing* ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = ring->socketfd;
+	sqe->addr = (uintptr_t) &ring->message;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = IO_RING_BUFFER_GROUP;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->armed = 1;
+}
+
+/**
+ * Adds a buffer to the ring, visible to the kernel once the tail is stored.
+ */
+static void io_ring_provide(IoRing* ring, unsigned short id)
+{
+	struct io_uring_buf* buffer = &ring->buffer_ring->bufs[ring->buffer_tail & (IO_RING_BUFFERS - 1)];
+
+	buffer->addr = (uintptr_t) (ring->buffers + (size_t) id * IO_RING_BUFFER_SIZE);
+	buffer->len = IO_RING_BUFFER_SIZE;
+	buffer->bid = id;
+	ring->buffer_tail++;
+}
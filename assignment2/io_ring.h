@@ -0,0 +1,69 @@
+#ifndef IO_RING_H_
+#define IO_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * Provided receive buffers, each one holds a whole datagram. Anything
+ * larger arrives cut short, so it's dropped and counted rather than routed.
+ */
+#define IO_RING_BUFFERS 256
+#define IO_RING_BUFFER_SIZE 4096
+#define IO_RING_MAX_BATCH 64
+
+/*
+ * A datagram taken from the ring. Data lives in a provided buffer and stays
+ * valid until the next io_ring_release, with room for one more byte past
+ * length so it can be terminated in place.
+ */
+typedef struct {
+	char* data;
+	unsigned int length;
+	void* control;
+	unsigned int control_length;
+} IoRingPacket;
+
+/*
+ * An io_uring set up with raw syscalls, running a single multishot recvmsg
+ * against one socket. The kernel picks a buffer from the registered buffer
+ * ring for every datagram, so receiving costs no syscall at all while
+ * completions are already waiting.
+ */
+typedef struct {
+	int fd;
+	int socketfd;
+	int armed;
+	unsigned long rearms;
+	unsigned long truncated;
+
+	void* rings;
+	size_t rings_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	struct io_uring_buf_ring* buffer_ring;
+	char* buffers;
+	unsigned short buffer_tail;
+	unsigned short pending[IO_RING_MAX_BATCH];
+	int pending_count;
+
+	struct msghdr message;
+} IoRing;
+
+int io_ring_open(IoRing* ring, int socketfd, size_t control_length);
+int io_ring_receive(IoRing* ring, IoRingPacket* packets, int max, int wait);
+void io_ring_release(IoRing* ring);
+void io_ring_close(IoRing* ring);
+
+#endif
@@ -0,0 +1,576 @@
+/**
+ * Route lookup microbenchmark. Builds synthetic IPv4 tables of growing size
+ * and times every lookup engine on the same destinations, away from sockets
+ * and packet parsing, after checking each one against the linear scan.
+ *
+ * Results are one CSV row per table shape, size and engine.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "router.h"
+#include "route_match.h"
+#include "route_trie.h"
+#include "flow_cache.h"
+#include "token_bucket.h"
+#include "xoshiro.h"
+
+#define MAX_SIZES 16
+#define NEXT_HOPS 16
+/* Routes visited by the linear engines per size, so 1M routes stays bounded */
+#define LINEAR_WORK 200000000.0
+/* Share of destinations drawn from inside a table prefix, the rest are random */
+#define HIT_FRACTION 0.9
+
+typedef enum {
+	SHAPE_RANDOM,
+	SHAPE_INTERNET
+} TableShape;
+
+/* The same table laid out for each engine */
+typedef struct {
+	RouterTable* table;
+	RouteMatcher* matcher;
+	RouteTrie* trie;
+	FlowCache* cache;
+} Engines;
+
+typedef int (*LookupBatch)(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count);
+
+typedef struct {
+	const char* name;
+	LookupBatch lookup;
+	int linear;
+} Engine;
+
+static RouterTable* build_table(TableShape shape, int size, uint32_t* rng);
+static int internet_prefix_length(uint32_t* rng);
+static void draw_destinations(RouterTable* table, uint32_t* destinations, int count, uint32_t* rng);
+static void load_engines(Engines* engines);
+static int check_equivalence(Engines* engines, const char* shape_name, const uint32_t* destinations, int count);
+static void run_engine(Engines* engines, const char* shape_name, const Engine* engine, const uint32_t* destinations, char (*strings)[16], int count);
+static size_t engine_memory(Engines* engines, const Engine* engine);
+static int open_cache_counter();
+static int lookup_linear(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count);
+static int lookup_matcher(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count);
+static int lookup_trie(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count);
+static int lookup_cached(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count);
+static void format_address(uint32_t address, char* out);
+void usage();
+
+static const Engine engine_list[] = {
+	{"linear", lookup_linear, 1},
+	{"matcher", lookup_matcher, 0},
+	{"trie", lookup_trie, 0},
+	{"flow cache+trie", lookup_cached, 0},
+};
+
+static int cache_counter = -1;
+/* Lookup results end up here so they can't be optimized away */
+static volatile int sink;
+
+int main(int argc, char *argv[])
+{
+	int sizes[MAX_SIZES] = {10, 100, 1000, 10000, 100000, 1000000};
+	int size_count = 6;
+	int lookups = 1000000;
+	int checks = 10000;
+	uint64_t seed = 1;
+	uint32_t rng[4];
+	uint32_t* destinations;
+	char (*strings)[16];
+	int failures = 0;
+	int option;
+
+	while ((option = getopt(argc, argv, "n:k:s:S:")) != -1)
+	{
+		switch (option)
+		{
+			case 'n':
+				lookups = atoi(optarg);
+				break;
+			case 'k':
+				checks = atoi(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'S':
+				size_count = 0;
+				for (char* size = strtok(optarg, ","); size != NULL && size_count < MAX_SIZES; size = strtok(NULL, ","))
+				{
+					sizes[size_count++] = atoi(size);
+				}
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (argc != optind || lookups < 1 || checks < 1 || size_count == 0)
+	{
+		usage();
+	}
+
+	destinations = malloc(lookups * sizeof(uint32_t));
+	strings = malloc(lookups * sizeof(*strings));
+	if (destinations == NULL || strings == NULL)
+	{
+		fprintf(stderr, "Unable to allocate destinations.\n");
+		exit(-1);
+	}
+
+	cache_counter = open_cache_counter();
+	xoshiro_seed(rng, seed);
+	printf("shape,routes,engine,lookups,lookups per sec,ns per lookup,cache misses per lookup,memory bytes\n");
+
+	for (int shape = SHAPE_RANDOM; shape <= SHAPE_INTERNET; shape++)
+	{
+		const char* shape_name = shape == SHAPE_RANDOM ? "random" : "internet";
+
+		for (int s = 0; s < size_count; s++)
+		{
+			Engines engines;
+
+			engines.table = build_table(shape, sizes[s], rng);
+			load_engines(&engines);
+
+			// every engine sees the same destinations, already formatted for
+			// the linear path which takes them as text
+			draw_destinations(engines.table, destinations, lookups, rng);
+			for (int i = 0; i < lookups; i++)
+			{
+				format_address(destinations[i], strings[i]);
+			}
+
+			failures += check_equivalence(&engines, shape_name, destinations, lookups < checks ? lookups : checks);
+			for (int e = 0; e < (int) (sizeof(engine_list) / sizeof(engine_list[0])); e++)
+			{
+				if (engine_list[e].lookup == lookup_matcher && engines.table->size > ROUTE_MATCH_MAX_ROUTES)
+				{
+					continue;
+				}
+				run_engine(&engines, shape_name, &engine_list[e], destinations, strings, lookups);
+			}
+
+			RouteMatcher_free(engines.matcher);
+			RouteTrie_free(engines.trie);
+			FlowCache_free(engines.cache);
+			RouterTable_free(engines.table);
+		}
+	}
+
+	free(destinations);
+	free(strings);
+	if (failures > 0)
+	{
+		fprintf(stderr, "%d lookups disagreed with the linear scan.\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
+
+void usage()
+{
+	fprintf(
+		stderr,
+		"Invalid args, should be: [-n <lookups per engine>] [-k <equivalence checks>] [-s <seed>] "
+		"[-S <comma separated table sizes>]\n"
+	);
+	exit(-1);
+}
+
+/**
+ * Builds a table of size IPv4 prefixes. Random tables spread lengths evenly
+ * over /8 to /32. Internet shaped ones follow the length mix of a real BGP
+ * table, mostly /24s, keep to unicast space and deaggregate: about a third
+ * of the prefixes are more specifics of one already in the table.
+ */
+static RouterTable* build_table(TableShape shape, int size, uint32_t* rng)
+{
+	RouterTable* table = RouterTable_new();
+	char address[16];
+	char next_hop[16];
+
+	for (int i = 0; i < size; i++)
+	{
+		uint32_t network = xoshiro_next(rng);
+		int prefix_length;
+
+		if (shape == SHAPE_RANDOM)
+		{
+			prefix_length = 8 + xoshiro_below(rng, 25);
+		}
+		else
+		{
+			prefix_length = internet_prefix_length(rng);
+			if (i > 0 && xoshiro_double(rng) < 0.3)
+			{
+				Router* parent = table->routes[xoshiro_below(rng, i)];
+
+				if (parent->prefix_length < 32)
+				{
+					if (prefix_length <= parent->prefix_length)
+					{
+						prefix_length = parent->prefix_length + 1 + xoshiro_below(rng, 32 - parent->prefix_length);
+					}
+					network = parent->network | (network & ~parent->mask);
+				}
+			}
+			else
+			{
+				// first octets 1 to 223, skipping private and loopback space
+				uint32_t first = 1 + xoshiro_below(rng, 223);
+
+				if (first == 10 || first == 127)
+				{
+					first++;
+				}
+				network = (first << 24) | (network & 0xffffff);
+			}
+		}
+
+		network &= prefix_mask(prefix_length);
+		format_address(network, address);
+		snprintf(next_hop, sizeof(next_hop), "Hop%u", xoshiro_below(rng, NEXT_HOPS));
+		add_new_router(table, address, prefix_length, next_hop);
+	}
+
+	return table;
+}
+
+/**
+ * Draws a prefix length with roughly the distribution of the global IPv4
+ * routing table.
+ */
+static int internet_prefix_length(uint32_t* rng)
+{
+	static const int lengths[] = {24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 25, 26, 27, 28, 29, 30, 32};
+	static const double shares[] = {
+		0.58, 0.07, 0.10, 0.05, 0.04, 0.03, 0.02, 0.01, 0.025, 0.003, 0.003, 0.003, 0.002, 0.001, 0.001,
+		0.0005, 0.0005, 0.006, 0.006, 0.006, 0.006, 0.006, 0.006, 0.006
+	};
+	double draw = xoshiro_double(rng);
+
+	for (int i = 0; i < (int) (sizeof(lengths) / sizeof(lengths[0])); i++)
+	{
+		draw -= shares[i];
+		if (draw < 0)
+		{
+			return lengths[i];
+		}
+	}
+
+	return 24;
+}
+
+/**
+ * Mostly addresses inside a random table prefix, so lookups find a route
+ * as they do in live traffic, and the rest anywhere at all.
+ */
+static void draw_destinations(RouterTable* table, uint32_t* destinations, int count, uint32_t* rng)
+{
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t address = xoshiro_next(rng);
+
+		if (table->size > 0 && xoshiro_double(rng) < HIT_FRACTION)
+		{
+			Router* router = table->routes[xoshiro_below(rng, table->size)];
+			address = router->network | (address & ~router->mask);
+		}
+		destinations[i] = address;
+	}
+}
+
+/**
+ * Loads every engine from the table the same way the router does.
+ */
+static void load_engines(Engines* engines)
+{
+	RouterTable* table = engines->table;
+	uint8_t* networks = malloc((table->size + 1) * 4);
+	int* prefix_lengths = malloc((table->size + 1) * sizeof(int));
+	int* routes = malloc((table->size + 1) * sizeof(int));
+
+	engines->matcher = RouteMatcher_new();
+	engines->trie = RouteTrie_new(4);
+	engines->cache = FlowCache_new(FLOW_CACHE_DEFAULT_SETS);
+
+	if (table->size <= ROUTE_MATCH_MAX_ROUTES)
+	{
+		uint32_t matcher_networks[ROUTE_MATCH_MAX_ROUTES];
+		uint32_t masks[ROUTE_MATCH_MAX_ROUTES];
+
+		for (int i = 0; i < table->size; i++)
+		{
+			matcher_networks[i] = table->routes[i]->network;
+			masks[i] = table->routes[i]->mask;
+			prefix_lengths[i] = table->routes[i]->prefix_length;
+		}
+		route_matcher_load(engines->matcher, table->size, matcher_networks, masks, prefix_lengths);
+	}
+
+	for (int i = 0; i < table->size; i++)
+	{
+		uint32_t network = table->routes[i]->network;
+
+		networks[i * 4] = network >> 24;
+		networks[i * 4 + 1] = network >> 16;
+		networks[i * 4 + 2] = network >> 8;
+		networks[i * 4 + 3] = network;
+		prefix_lengths[i] = table->routes[i]->prefix_length;
+		routes[i] = i;
+	}
+	route_trie_load(engines->trie, table->size, networks, prefix_lengths, routes);
+
+	free(networks);
+	free(prefix_lengths);
+	free(routes);
+}
+
+/**
+ * Looks up the first count destinations with every engine and compares the
+ * answers with lookup_route, the reference linear scan. Large tables check
+ * fewer destinations so the scan stays affordable.
+ *
+ * Returns the number of disagreements.
+ */
+static int check_equivalence(Engines* engines, const char* shape_name, const uint32_t* destinations, int count)
+{
+	int routes[ROUTE_MATCH_MAX_ROUTES];
+	int failures = 0;
+	double affordable = LINEAR_WORK / (engines->table->size + 1);
+
+	if (count > affordable)
+	{
+		count = affordable < 100 ? 100 : affordable;
+	}
+
+	for (int e = 0; e < (int) (sizeof(engine_list) / sizeof(engine_list[0])); e++)
+	{
+		const Engine* engine = &engine_list[e];
+
+		if (engine->linear || (engine->lookup == lookup_matcher && engines->table->size > ROUTE_MATCH_MAX_ROUTES))
+		{
+			continue;
+		}
+
+		for (int i = 0; i < count; i += ROUTE_MATCH_MAX_ROUTES)
+		{
+			int batch = count - i < ROUTE_MATCH_MAX_ROUTES ? count - i : ROUTE_MATCH_MAX_ROUTES;
+
+			engine->lookup(engines, &destinations[i], NULL, routes, batch);
+			for (int b = 0; b < batch; b++)
+			{
+				int expected = lookup_route(engines->table, destinations[i + b]);
+				char address[16];
+
+				if (routes[b] == expected)
+				{
+					continue;
+				}
+
+				format_address(destinations[i + b], address);
+				fprintf(
+					stderr,
+					"%s %d routes: %s gave route %d for %s, linear scan gave %d\n",
+					shape_name, engines->table->size, engine->name, routes[b], address, expected
+				);
+				failures++;
+			}
+		}
+	}
+
+	return failures;
+}
+
+/**
+ * Times one engine over the destinations in batches of up to
+ * ROUTE_MATCH_MAX_ROUTES, the way the router hands them over, and writes
+ * its row.
+ */
+static void run_engine(Engines* engines, const char* shape_name, const Engine* engine, const uint32_t* destinations, char (*strings)[16], int count)
+{
+	int routes[ROUTE_MATCH_MAX_ROUTES];
+	uint64_t started, elapsed;
+	uint64_t misses = 0;
+	char miss_column[32] = "";
+
+	if (engine->linear && count > LINEAR_WORK / (engines->table->size + 1))
+	{
+		count = LINEAR_WORK / (engines->table->size + 1);
+		count = count < 100 ? 100 : count;
+	}
+
+	// the equivalence check warmed the flow cache, start it cold
+	flow_cache_sync(engines->cache, engines->cache->generation + 1);
+
+	if (cache_counter != -1)
+	{
+		ioctl(cache_counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(cache_counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	started = monotonic_ns();
+	for (int i = 0; i < count; i += ROUTE_MATCH_MAX_ROUTES)
+	{
+		int batch = count - i < ROUTE_MATCH_MAX_ROUTES ? count - i : ROUTE_MATCH_MAX_ROUTES;
+
+		engine->lookup(engines, &destinations[i], &strings[i], routes, batch);
+		sink += routes[batch - 1];
+	}
+	elapsed = monotonic_ns() - started;
+
+	if (cache_counter != -1)
+	{
+		ioctl(cache_counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(cache_counter, &misses, sizeof(misses)) == sizeof(misses))
+		{
+			snprintf(miss_column, sizeof(miss_column), "%.3f", (double) misses / count);
+		}
+	}
+
+	printf(
+		"%s,%d,%s,%d,%.0f,%.1f,%s,%zu\n",
+		shape_name,
+		engines->table->size,
+		engine->name,
+		count,
+		elapsed > 0 ? count * 1e9 / elapsed : 0,
+		(double) elapsed / count,
+		miss_column,
+		engine_memory(engines, engine)
+	);
+	fflush(stdout);
+}
+
+/**
+ * Bytes an engine keeps for its lookups, on top of the routing table
+ * itself for everything but the linear scan which only has the table.
+ */
+static size_t engine_memory(Engines* engines, const Engine* engine)
+{
+	RouterTable* table = engines->table;
+	size_t bytes;
+
+	if (engine->lookup == lookup_matcher)
+	{
+		return engines->matcher->padded_size * (2 * sizeof(uint32_t) + sizeof(int32_t));
+	}
+
+	bytes = engines->trie->node_count * sizeof(RouteTrieNode) + engines->trie->leaf_count * sizeof(int32_t);
+	if (engine->lookup == lookup_trie)
+	{
+		return bytes;
+	}
+
+	if (engine->lookup == lookup_cached)
+	{
+		return bytes + (engines->cache->set_mask + 1) * sizeof(FlowCacheSet);
+	}
+
+	bytes = table->max_size * sizeof(Router*);
+	for (int i = 0; i < table->size; i++)
+	{
+		bytes += sizeof(Router) + strlen(table->routes[i]->address) + 1 + strlen(table->routes[i]->next_hop) + 1 +
+			table->routes[i]->path_count * (sizeof(int) + sizeof(uint64_t));
+	}
+	return bytes;
+}
+
+/**
+ * Counts last level cache misses in this thread, user space only.
+ *
+ * Returns the counter's descriptor, or -1 where perf events aren't allowed,
+ * in which case the column is left empty.
+ */
+static int open_cache_counter()
+{
+	struct perf_event_attr attributes;
+
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.size = sizeof(attributes);
+	attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+	attributes.disabled = 1;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+/**
+ * The router's original path, find_destination_router on the destination
+ * as text. That hands back a copy of the route rather than its index, so
+ * the result is the route's next hop id; this engine is the reference, never
+ * checked against itself.
+ */
+static int lookup_linear(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count)
+{
+	Packet packet;
+	Router router;
+
+	(void) destinations;
+	for (int i = 0; i < count; i++)
+	{
+		packet.dest = strings[i];
+		routes[i] = find_destination_router(&router, engines->table, &packet) == 0 ? router.next_hop_id : -1;
+	}
+
+	return count;
+}
+
+static int lookup_matcher(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count)
+{
+	(void) strings;
+	route_matcher_lookup_batch(engines->matcher, destinations, routes, count);
+	return count;
+}
+
+static int lookup_trie(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count)
+{
+	(void) strings;
+	for (int i = 0; i < count; i++)
+	{
+		uint8_t key[4] = {destinations[i] >> 24, destinations[i] >> 16, destinations[i] >> 8, destinations[i]};
+
+		routes[i] = route_trie_lookup(engines->trie, key);
+	}
+
+	return count;
+}
+
+/**
+ * The router's IPv4 fast path, the flow cache in front of the trie.
+ */
+static int lookup_cached(Engines* engines, const uint32_t* destinations, char (*strings)[16], int* routes, int count)
+{
+	(void) strings;
+	for (int i = 0; i < count; i++)
+	{
+		if (flow_cache_lookup(engines->cache, destinations[i], &routes[i]) != 0)
+		{
+			uint8_t key[4] = {destinations[i] >> 24, destinations[i] >> 16, destinations[i] >> 8, destinations[i]};
+
+			routes[i] = route_trie_lookup(engines->trie, key);
+			flow_cache_insert(engines->cache, destinations[i], routes[i]);
+		}
+	}
+
+	return count;
+}
+
+static void format_address(uint32_t address, char* out)
+{
+	snprintf(out, 16, "%u.%u.%u.%u", address >> 24, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff);
+}
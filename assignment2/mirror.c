@@ -0,0 +1,625 @@
+/**
+ * Packet capture for debugging a live router.
+ *
+ * The router copies packets picked out by the filters into a ring, and a
+ * writer thread turns them into pcap records, wrapped in made up IPv4 or
+ * IPv6 and UDP headers so Wireshark and router -F can read the file back.
+ * Records are gathered into MIRROR_WRITE_SIZE chunks, so the file sees a
+ * few large sequential writes rather than one per packet.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "mirror.h"
+#include "router.h"
+#include "token_bucket.h"
+
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_LENGTH 24
+#define PCAP_RECORD_LENGTH 16
+#define LINKTYPE_RAW 101
+#define IPV4_HEADER_LENGTH 20
+#define IPV6_HEADER_LENGTH 40
+#define UDP_HEADER_LENGTH 8
+/* The most one record can take up in the file */
+#define RECORD_MAX (PCAP_RECORD_LENGTH + IPV6_HEADER_LENGTH + UDP_HEADER_LENGTH + MIRROR_SNAPLEN)
+
+static const char* reason_names[] = {"forwarded", "expired", "unroutable", "queue", "filtered"};
+
+static void* writer_main(void* arg);
+static void writer_wait(Mirror* mirror, uint32_t head, int timeout_ms);
+static void wake_writer(Mirror* mirror);
+static size_t write_header(unsigned char* out);
+static size_t write_record(unsigned char* out, const MirrorRecord* record);
+static int packet_field(const char* data, int length, int index, char* out, size_t size);
+static uint16_t ipv4_checksum(const unsigned char* header);
+static void put_be16(unsigned char* out, uint16_t value);
+static void write_out(Mirror* mirror, const unsigned char* data, size_t length);
+
+/**
+ * Creates a mirror with a ring of at least slots records. Nothing is
+ * captured until mirror_start opens a file.
+ */
+Mirror* Mirror_new(int slots)
+{
+	Mirror* mirror = calloc(1, sizeof(Mirror));
+	uint32_t size = 1;
+
+	while (size < (uint32_t) slots)
+	{
+		size <<= 1;
+	}
+
+	if (mirror == NULL || (mirror->slots = malloc(size * sizeof(MirrorRecord))) == NULL)
+	{
+		fprintf(stderr, "Unable to allocate packet mirror.\n");
+		exit(-1);
+	}
+	mirror->mask = size - 1;
+	mirror->fd = -1;
+	mirror->wake_fd = -1;
+
+	return mirror;
+}
+
+/**
+ * Stops the writer, after it has written out everything still in the ring,
+ * and frees the mirror.
+ */
+void Mirror_free(Mirror* mirror)
+{
+	mirror_stop(mirror);
+	for (int i = 0; i < mirror->filter_count; i++)
+	{
+		free(mirror->filters[i].next_hop);
+	}
+	free(mirror->hops);
+	free(mirror->slots);
+	free(mirror);
+}
+
+/**
+ * Parses a filter, "dest=<prefix>", "hop=<next hop>" or
+ * "drop[=expired|unroutable|queue|filtered]". A packet is mirrored if any filter
+ * picks it, and with no filters at all every packet is.
+ *
+ * Returns 0 on success, -1 if the filter is malformed or there are too many.
+ */
+int mirror_add_filter(Mirror* mirror, const char* spec)
+{
+	MirrorFilter filter;
+
+	if (mirror->filter_count == MIRROR_MAX_FILTERS)
+	{
+		return -1;
+	}
+
+	memset(&filter, 0, sizeof(filter));
+	if (strncmp(spec, "dest=", 5) == 0)
+	{
+		filter.match = MIRROR_MATCH_PREFIX;
+		if (parse_prefix(&spec[5], filter.network, &filter.version, &filter.prefix_length) != 0)
+		{
+			return -1;
+		}
+	}
+	else if (strncmp(spec, "hop=", 4) == 0 && spec[4] != 0)
+	{
+		filter.match = MIRROR_MATCH_HOP;
+		filter.next_hop = malloc(strlen(&spec[4]) + 1);
+		strcpy(filter.next_hop, &spec[4]);
+	}
+	else if (strcmp(spec, "drop") == 0)
+	{
+		// every reason but forwarding
+		filter.match = MIRROR_MATCH_DROP;
+		filter.reason = -1;
+	}
+	else if (strncmp(spec, "drop=", 5) == 0)
+	{
+		filter.match = MIRROR_MATCH_DROP;
+		filter.reason = -1;
+		for (int r = MIRROR_EXPIRED; r < MIRROR_REASONS; r++)
+		{
+			if (strcmp(&spec[5], reason_names[r]) == 0)
+			{
+				filter.reason = r;
+			}
+		}
+		if (filter.reason == -1)
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		return -1;
+	}
+
+	mirror->filters[mirror->filter_count++] = filter;
+	return 0;
+}
+
+/**
+ * Opens the pcap file at path and starts the writer thread. The thread
+ * blocks every signal, so SIGINT always lands on the router's own thread.
+ *
+ * Returns 0 on success, -1 with errno set.
+ */
+int mirror_start(Mirror* mirror, const char* path)
+{
+	unsigned char header[PCAP_HEADER_LENGTH];
+	sigset_t all, previous;
+	int error;
+
+	mirror->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (mirror->fd == -1)
+	{
+		return -1;
+	}
+	mirror->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mirror->wake_fd == -1)
+	{
+		close(mirror->fd);
+		mirror->fd = -1;
+		return -1;
+	}
+	write_out(mirror, header, write_header(header));
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	error = pthread_create(&mirror->writer, NULL, writer_main, mirror);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (error != 0)
+	{
+		close(mirror->fd);
+		close(mirror->wake_fd);
+		mirror->fd = mirror->wake_fd = -1;
+		errno = error;
+		return -1;
+	}
+
+	mirror->running = 1;
+	return 0;
+}
+
+/**
+ * Tells the writer to finish up and waits for it, so everything mirrored
+ * so far is in the file once this returns.
+ */
+void mirror_stop(Mirror* mirror)
+{
+	if (mirror->running)
+	{
+		// the eventfd stays readable, so the writer can't miss this even if it isn't asleep yet
+		__atomic_store_n(&mirror->stopping, 1, __ATOMIC_SEQ_CST);
+		wake_writer(mirror);
+		pthread_join(mirror->writer, NULL);
+		mirror->running = 0;
+	}
+
+	if (mirror->fd != -1)
+	{
+		close(mirror->fd);
+		mirror->fd = -1;
+	}
+	if (mirror->wake_fd != -1)
+	{
+		close(mirror->wake_fd);
+		mirror->wake_fd = -1;
+	}
+}
+
+/**
+ * Works out which next hop ids the hop filters pick, since ids can change
+ * whenever the routing table is reloaded.
+ */
+void mirror_select_hops(Mirror* mirror, char** next_hops, int count)
+{
+	mirror->hops = realloc(mirror->hops, count > 0 ? count : 1);
+	memset(mirror->hops, 0, count > 0 ? count : 1);
+	mirror->hop_count = count;
+
+	for (int f = 0; f < mirror->filter_count; f++)
+	{
+		for (int i = 0; i < count && mirror->filters[f].match == MIRROR_MATCH_HOP; i++)
+		{
+			if (strcmp(mirror->filters[f].next_hop, next_hops[i]) == 0)
+			{
+				mirror->hops[i] = 1;
+			}
+		}
+	}
+}
+
+/**
+ * Decides whether a packet is mirrored. destination is the address as
+ * network order bytes, ignored when version is 0 because the packet never
+ * parsed, and next_hop is -1 if there's no route.
+ *
+ * Returns 1 if the packet should be mirrored, 0 otherwise.
+ */
+int mirror_wants(const Mirror* mirror, int reason, int version, const uint8_t* destination, int next_hop)
+{
+	if (mirror->filter_count == 0)
+	{
+		return 1;
+	}
+
+	for (int f = 0; f < mirror->filter_count; f++)
+	{
+		const MirrorFilter* filter = &mirror->filters[f];
+
+		switch (filter->match)
+		{
+			case MIRROR_MATCH_PREFIX:
+				if (filter->version == version && prefix_matches(filter->network, filter->prefix_length, destination))
+				{
+					return 1;
+				}
+				break;
+			case MIRROR_MATCH_HOP:
+				if (next_hop >= 0 && next_hop < mirror->hop_count && mirror->hops[next_hop])
+				{
+					return 1;
+				}
+				break;
+			case MIRROR_MATCH_DROP:
+				if (reason != MIRROR_FORWARDED && (filter->reason == -1 || filter->reason == reason))
+				{
+					return 1;
+				}
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Producer side. Copies up to MIRROR_SNAPLEN bytes of a datagram into the
+ * ring, or counts it as lost if the writer has fallen a full ring behind.
+ * time_ns is CLOCK_REALTIME, it becomes the record's timestamp. The writer
+ * is only woken when it's asleep and has said this record is worth it.
+ */
+void mirror_record(Mirror* mirror, int reason, const char* data, uint32_t length, uint64_t time_ns)
+{
+	uint32_t tail = mirror->tail;
+	uint32_t head = __atomic_load_n(&mirror->head, __ATOMIC_ACQUIRE);
+	uint32_t waiting;
+	MirrorRecord* record;
+
+	if (tail - head > mirror->mask)
+	{
+		mirror->lost++;
+		return;
+	}
+
+	record = &mirror->slots[tail & mirror->mask];
+	record->time_ns = time_ns;
+	record->length = length;
+	record->captured = length < MIRROR_SNAPLEN ? length : MIRROR_SNAPLEN;
+	record->reason = reason;
+	memcpy(record->data, data, record->captured);
+	mirror->mirrored[reason]++;
+
+	// sequentially consistent so the store can't pass the load of the flag
+	__atomic_store_n(&mirror->tail, tail + 1, __ATOMIC_SEQ_CST);
+	waiting = __atomic_load_n(&mirror->waiting, __ATOMIC_SEQ_CST);
+	if ((waiting == MIRROR_WAIT_RECORD ||
+		(waiting == MIRROR_WAIT_FILL && tail + 1 - head > mirror->mask / MIRROR_WAKE_FRACTION)) &&
+		__atomic_exchange_n(&mirror->waiting, MIRROR_AWAKE, __ATOMIC_SEQ_CST) != MIRROR_AWAKE
+	) {
+		wake_writer(mirror);
+	}
+}
+
+const char* mirror_reason_name(int reason)
+{
+	return reason >= 0 && reason < MIRROR_REASONS ? reason_names[reason] : "unknown";
+}
+
+/**
+ * Consumer side. Turns records into pcap in a buffer and writes it out once
+ * it's full, or once the ring has gone quiet for MIRROR_FLUSH_NS, so the
+ * file is never far behind while debugging. Sleeps on the eventfd when
+ * there's nothing to do.
+ */
+static void* writer_main(void* arg)
+{
+	Mirror* mirror = arg;
+	unsigned char* buffer = malloc(MIRROR_WRITE_SIZE);
+	uint64_t flushed = monotonic_ns();
+	uint64_t since;
+	uint32_t head = mirror->head;
+	size_t used = 0;
+	int stopping;
+
+	if (buffer == NULL)
+	{
+		fprintf(stderr, "Unable to allocate packet mirror buffer.\n");
+		exit(-1);
+	}
+
+	do
+	{
+		// read the flag first, so whatever was published before it is taken
+		stopping = __atomic_load_n(&mirror->stopping, __ATOMIC_ACQUIRE);
+		uint32_t tail = __atomic_load_n(&mirror->tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++)
+		{
+			if (used + RECORD_MAX > MIRROR_WRITE_SIZE)
+			{
+				write_out(mirror, buffer, used);
+				used = 0;
+				flushed = monotonic_ns();
+			}
+			used += write_record(&buffer[used], &mirror->slots[head & mirror->mask]);
+			__atomic_store_n(&mirror->head, head + 1, __ATOMIC_RELEASE);
+		}
+
+		if (used > 0 && (stopping || monotonic_ns() - flushed >= MIRROR_FLUSH_NS))
+		{
+			write_out(mirror, buffer, used);
+			used = 0;
+			flushed = monotonic_ns();
+		}
+
+		if (!stopping)
+		{
+			// with a chunk waiting, wake up in time to flush it
+			since = monotonic_ns() - flushed;
+			writer_wait(
+				mirror,
+				head,
+				used == 0 ? -1 : since >= MIRROR_FLUSH_NS ? 0 : (int) ((MIRROR_FLUSH_NS - since + 999999) / 1000000)
+			);
+		}
+	} while (!stopping);
+
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Sleeps until there are records worth taking, the timeout passes, or the
+ * mirror is stopped. Without a timeout any record will do, with one the
+ * ring has to fill a bit first, so a steady trickle of packets costs a
+ * wakeup per flush rather than per packet.
+ */
+static void writer_wait(Mirror* mirror, uint32_t head, int timeout_ms)
+{
+	struct pollfd wake = {mirror->wake_fd, POLLIN, 0};
+	uint64_t count;
+
+	__atomic_store_n(&mirror->waiting, timeout_ms == -1 ? MIRROR_WAIT_RECORD : MIRROR_WAIT_FILL, __ATOMIC_SEQ_CST);
+
+	// a record may have come in between taking the last one and the flag
+	if (timeout_ms == -1 && head != __atomic_load_n(&mirror->tail, __ATOMIC_SEQ_CST))
+	{
+		__atomic_store_n(&mirror->waiting, MIRROR_AWAKE, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (poll(&wake, 1, timeout_ms) > 0 && read(mirror->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+	{
+		fprintf(stderr, "Unable to read packet mirror wakeup, errno: %d\n", errno);
+	}
+	__atomic_store_n(&mirror->waiting, MIRROR_AWAKE, __ATOMIC_RELAXED);
+}
+
+static void wake_writer(Mirror* mirror)
+{
+	uint64_t one = 1;
+
+	if (write(mirror->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+	{
+		fprintf(stderr, "Unable to wake packet mirror writer, errno: %d\n", errno);
+	}
+}
+
+/**
+ * The pcap file header: nanosecond timestamps and raw IP packets.
+ *
+ * Returns the number of bytes written to out.
+ */
+static size_t write_header(unsigned char* out)
+{
+	uint32_t magic = PCAP_MAGIC_NS;
+	uint16_t versions[2] = {2, 4};
+	uint32_t fields[4] = {0, 0, RECORD_MAX - PCAP_RECORD_LENGTH, LINKTYPE_RAW};
+
+	memcpy(out, &magic, sizeof(magic));
+	memcpy(&out[4], versions, sizeof(versions));
+	memcpy(&out[8], fields, sizeof(fields));
+	return PCAP_HEADER_LENGTH;
+}
+
+/**
+ * Writes one record, with IP and UDP headers built from the addresses in
+ * the packet text. The UDP destination port is MIRROR_BASE_PORT plus the
+ * reason, so "udp.dstport == 40002" picks out the unroutable packets.
+ * Packets whose addresses don't parse, or mix families, get 0.0.0.0.
+ *
+ * Returns the number of bytes written to out.
+ */
+static size_t write_record(unsigned char* out, const MirrorRecord* record)
+{
+	unsigned char* ip = &out[PCAP_RECORD_LENGTH];
+	unsigned char source[16] = {0};
+	unsigned char destination[16] = {0};
+	char source_text[64], destination_text[64], text[64];
+	int version = 0;
+	int ttl = 64;
+	size_t header;
+	uint32_t fields[4];
+	uint32_t udp_length = UDP_HEADER_LENGTH + record->length;
+
+	if (packet_field(record->data, record->captured, 1, source_text, sizeof(source_text)) == 0 &&
+		packet_field(record->data, record->captured, 2, destination_text, sizeof(destination_text)) == 0
+	) {
+		if (inet_pton(AF_INET, source_text, source) == 1 && inet_pton(AF_INET, destination_text, destination) == 1)
+		{
+			version = 4;
+		}
+		else if (inet_pton(AF_INET6, source_text, source) == 1 && inet_pton(AF_INET6, destination_text, destination) == 1)
+		{
+			version = 6;
+		}
+	}
+	if (version == 0)
+	{
+		version = 4;
+		memset(source, 0, sizeof(source));
+		memset(destination, 0, sizeof(destination));
+	}
+	if (packet_field(record->data, record->captured, 3, text, sizeof(text)) == 0)
+	{
+		ttl = atoi(text);
+		ttl = ttl < 0 ? 0 : (ttl > 255 ? 255 : ttl);
+	}
+
+	if (version == 6)
+	{
+		header = IPV6_HEADER_LENGTH;
+		memset(ip, 0, header);
+		ip[0] = 0x60;
+		put_be16(&ip[4], udp_length > 0xffff ? 0xffff : udp_length);
+		ip[6] = IPPROTO_UDP;
+		ip[7] = ttl;
+		memcpy(&ip[8], source, 16);
+		memcpy(&ip[24], destination, 16);
+	}
+	else
+	{
+		header = IPV4_HEADER_LENGTH;
+		memset(ip, 0, header);
+		ip[0] = 0x45;
+		put_be16(&ip[2], header + udp_length > 0xffff ? 0xffff : header + udp_length);
+		// don't fragment, so nothing mistakes it for a later fragment
+		ip[6] = 0x40;
+		ip[8] = ttl;
+		ip[9] = IPPROTO_UDP;
+		memcpy(&ip[12], source, 4);
+		memcpy(&ip[16], destination, 4);
+		put_be16(&ip[10], ipv4_checksum(ip));
+	}
+
+	// no UDP checksum, the payload may have been truncated anyway
+	put_be16(&ip[header], MIRROR_BASE_PORT);
+	put_be16(&ip[header + 2], MIRROR_BASE_PORT + record->reason);
+	put_be16(&ip[header + 4], udp_length > 0xffff ? 0xffff : udp_length);
+	put_be16(&ip[header + 6], 0);
+	memcpy(&ip[header + UDP_HEADER_LENGTH], record->data, record->captured);
+
+	fields[0] = record->time_ns / 1000000000ull;
+	fields[1] = record->time_ns % 1000000000ull;
+	fields[2] = header + UDP_HEADER_LENGTH + record->captured;
+	fields[3] = header + udp_length;
+	memcpy(out, fields, sizeof(fields));
+
+	return PCAP_RECORD_LENGTH + fields[2];
+}
+
+/**
+ * Copies the index'th field of "id, src, dest, TTL, payload" into out.
+ *
+ * Returns 0 on success, -1 if the packet is too short or the field too long.
+ */
+static int packet_field(const char* data, int length, int index, char* out, size_t size)
+{
+	int start = 0;
+	int end;
+
+	for (int field = 0; field < index; field++)
+	{
+		while (start < length && data[start] != ',')
+		{
+			start++;
+		}
+		if (start == length)
+		{
+			return -1;
+		}
+		start++;
+	}
+
+	while (start < length && data[start] == ' ')
+	{
+		start++;
+	}
+	for (end = start; end < length && data[end] != ',' && data[end] != ' ' && data[end] != 0; end++)
+	{
+	}
+
+	if (end == start || (size_t) (end - start) >= size)
+	{
+		return -1;
+	}
+	memcpy(out, &data[start], end - start);
+	out[end - start] = 0;
+	return 0;
+}
+
+static uint16_t ipv4_checksum(const unsigned char* header)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; i < IPV4_HEADER_LENGTH; i += 2)
+	{
+		sum += header[i] << 8 | header[i + 1];
+	}
+	while (sum >> 16)
+	{
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return ~sum;
+}
+
+static void put_be16(unsigned char* out, uint16_t value)
+{
+	out[0] = value >> 8;
+	out[1] = value;
+}
+
+/**
+ * Writes a whole buffer, giving up on the file after the first error so a
+ * full disk can't turn into an error per flush.
+ */
+static void write_out(Mirror* mirror, const unsigned char* data, size_t length)
+{
+	while (length > 0 && mirror->fd != -1 && !mirror->failed)
+	{
+		ssize_t written = write(mirror->fd, data, length);
+
+		if (written == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		if (written == -1)
+		{
+			fprintf(stderr, "Unable to write packet mirror, errno: %d\n", errno);
+			mirror->failed = 1;
+			return;
+		}
+
+		data += written;
+		length -= written;
+		__atomic_store_n(&mirror->written, mirror->written + written, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&mirror->writes, mirror->writes + 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,98 @@
+#ifndef MIRROR_H_
+#define MIRROR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Bytes of each datagram kept, longer ones are truncated like tcpdump -s */
+#define MIRROR_SNAPLEN 256
+#define MIRROR_DEFAULT_SLOTS 8192
+#define MIRROR_MAX_FILTERS 16
+/* The writer only goes to the file in chunks this large, or when idle */
+#define MIRROR_WRITE_SIZE (1 << 20)
+#define MIRROR_FLUSH_NS 200000000ull
+/* An idle writer is woken on the first record, one with a chunk to flush soon once the ring is this full */
+#define MIRROR_WAKE_FRACTION 4
+/* Each reason is written to its own UDP port, 40000 for forwarded packets */
+#define MIRROR_BASE_PORT 40000
+
+/* Why a packet was mirrored, forwarded or the way it was dropped */
+typedef enum {
+	MIRROR_FORWARDED,
+	MIRROR_EXPIRED,
+	MIRROR_UNROUTABLE,
+	MIRROR_QUEUE_FULL,
+	MIRROR_FILTERED,
+	MIRROR_REASONS
+} MirrorReason;
+
+/* One mirrored datagram on its way from the router to the writer */
+typedef struct {
+	uint64_t time_ns;
+	uint32_t length;
+	uint16_t captured;
+	uint8_t reason;
+	char data[MIRROR_SNAPLEN];
+} MirrorRecord;
+
+/* What the writer is sleeping for, if anything */
+typedef enum {
+	MIRROR_AWAKE,
+	MIRROR_WAIT_RECORD,
+	MIRROR_WAIT_FILL
+} MirrorWait;
+
+typedef enum {
+	MIRROR_MATCH_PREFIX,
+	MIRROR_MATCH_HOP,
+	MIRROR_MATCH_DROP
+} MirrorMatch;
+
+/* Selects packets by destination prefix, next hop or drop reason */
+typedef struct {
+	MirrorMatch match;
+	int version;
+	uint8_t network[16];
+	int prefix_length;
+	char* next_hop;
+	int reason;
+} MirrorFilter;
+
+/*
+ * Copies selected packets into a single producer, single consumer ring that
+ * a writer thread drains into a pcap file. The router never waits on the
+ * writer or the disk: when the ring is full the record is counted as lost.
+ */
+typedef struct {
+	MirrorRecord* slots;
+	uint32_t mask;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t waiting;
+	uint32_t tail __attribute__((aligned(64)));
+	int stopping;
+	int running;
+	int wake_fd;
+	MirrorFilter filters[MIRROR_MAX_FILTERS];
+	int filter_count;
+	uint8_t* hops;
+	int hop_count;
+	int fd;
+	int failed;
+	pthread_t writer;
+	uint64_t mirrored[MIRROR_REASONS];
+	uint64_t lost;
+	uint64_t written;
+	uint64_t writes;
+} Mirror;
+
+Mirror* Mirror_new(int slots);
+void Mirror_free(Mirror* mirror);
+int mirror_add_filter(Mirror* mirror, const char* spec);
+int mirror_start(Mirror* mirror, const char* path);
+void mirror_stop(Mirror* mirror);
+void mirror_select_hops(Mirror* mirror, char** next_hops, int count);
+int mirror_wants(const Mirror* mirror, int reason, int version, const uint8_t* destination, int next_hop);
+void mirror_record(Mirror* mirror, int reason, const char* data, uint32_t length, uint64_t time_ns);
+const char* mirror_reason_name(int reason);
+
+#endif
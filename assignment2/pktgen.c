@@ -1,6 +1,8 @@
 /**
  * A UDP based random "Packet" streamer.
  */
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,20 +12,108 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "token_bucket.h"
+#include "trace.h"
+#include "xoshiro.h"
+#include "profile.h"
+#include "shm_ring.h"
 
 #define MAXBUF			1024
 #define MAX_TTL			4
 #define MAX_PAYLOAD_INDEX	4
 #define MAX_ROUTE_INDEX		3
+#define MAX_BATCH		256
+#define MAX_THREADS		64
+
+/*
+ * Load mode packets are a fixed width header patched in place, followed by
+ * the constant payload. The router's tokenizer skips the zero and space
+ * padding so these parse exactly like the sprintf'd packets.
+ */
+#define HEADER_ID_OFFSET	0
+#define HEADER_ID_WIDTH		10
+#define HEADER_SRC_OFFSET	12
+#define HEADER_DEST_OFFSET	29
+#define HEADER_ADDRESS_WIDTH	15
+#define HEADER_TTL_OFFSET	46
+#define HEADER_TTL_WIDTH	3
+#define HEADER_LENGTH		51
+
+/* -L swaps the payload for "t=<send time in ns>" so the router can time it */
+#define STAMP_WIDTH		19
+#define STAMP_LENGTH		(2 + STAMP_WIDTH + 1)
+
+/*
+ * Counters are only ever written by the thread that owns them, so a relaxed
+ * load and store is enough for the reporter to read them without tearing.
+ */
+#define COUNTER_ADD(counter, n) \
+	__atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define COUNTER_READ(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+typedef struct {
+	int a_to_b;
+	int a_to_c;
+	int b_to_a;
+	int b_to_c;
+	int c_to_a;
+	int c_to_b;
+	int invalid;
+} Stats;
+
+/*
+ * Per thread generator state. Each one owns its RNG, a disjoint slice of
+ * packet ids, a socket or shared memory ring and its stats, and sits on its
+ * own cache lines.
+ */
+typedef struct {
+	Stats stats;
+	unsigned long sent;
+	uint32_t rng[4];
+	unsigned int next_id;
+	unsigned int first_id;
+	unsigned int id_span;
+	int socketfd;
+	ShmRing* ring;
+	pthread_t thread;
+	ProfileState profile_state;
+} __attribute__((aligned(64))) Generator;
+
+/* Load mode settings, shared read only by every generator thread */
+typedef struct {
+	struct sockaddr_in dest;
+	double rate;
+	int batch;
+	uint64_t deadline;
+	int stamp;
+} LoadConfig;
 
 /* Packet Generator Functions */
-int rand_limit_floor(int floor, int limit);
-int rand_limit(int limit);
-void generate_packet(char* raw_packet);
+int rand_limit_floor(Generator* gen, int floor, int limit);
+int rand_limit(Generator* gen, int limit);
+void generator_init(Generator* gen, int index, int count, uint64_t seed);
+unsigned int next_packet_id(Generator* gen);
+void generate_packet(Generator* gen, char* raw_packet);
 void signal_handler(int signal);
 void update_statistics();
-void increment_stats(int src, int dest);
+void increment_stats(Stats* stats, int src, int dest);
 int build_socket(int port);
+void choose_packet(Generator* gen, char* src, char* dest, int* ttl, int* payload);
+void run_threads(int thread_count);
+void* run_load(void* arg);
+void run_replay(TraceReader* trace, Generator* gen, struct sockaddr_in* dest, double speed, int batch);
+void open_transport(Generator* gen);
+void close_transport(Generator* gen);
+int send_batch(Generator* gen, struct mmsghdr* messages, int count);
+void record_batch(struct mmsghdr* messages, int count);
+void render_header_template(char* header);
+void patch_header(char* header, unsigned int id, const char* src, const char* dest, int ttl);
+void patch_number(char* field, int width, uint64_t value);
+void usage();
 
 char** ROUTERS = (char* []) {
 	"192.168.128.0",
@@ -40,40 +130,104 @@ char** PAYLOADS = (char* []) {
 	""
 };
 
-typedef struct {
-	int a_to_b;
-	int a_to_c;
-	int b_to_a;
-	int b_to_c;
-	int c_to_a;
-	int c_to_b;
-	int invalid;
-} Stats;
-
-Stats STATS = {0, 0, 0, 0, 0, 0, 0};
-static int packet_id_counter = 0;
-static int keep_going = 1;
+static volatile sig_atomic_t keep_going = 1;
 FILE* stats_file;
 
+/* Generators are merged into one set of stats at reporting time */
+Generator* generators;
+int generator_count = 0;
+LoadConfig load;
+static int running_threads = 0;
+static uint64_t load_start_ns = 0;
+static uint64_t seed = 1;
+
+/* Set when the generated packets are being recorded to a trace */
+TraceWriter* recorder = NULL;
+
+/* Set when destinations come from a routing table rather than ROUTERS */
+Profile* profile = NULL;
+
+/* Set when packets go to the router through shared memory instead of UDP */
+char* shm_path = NULL;
+
 int main (int argc, char *argv[])
 {
-	int socketfd, port, counter;
+	int port, counter, option;
 	struct sockaddr_in dest;
 	char buffer[MAXBUF];
 	char* packet_file_path;
-
-	if (argc != 3)
+	int load_mode = 0;
+	int thread_count = 1;
+	double duration = 0;
+	double speed = 1;
+	char* record_path = NULL;
+	char* replay_path = NULL;
+	char* profile_table_path = NULL;
+	char* profile_spec = "uniform";
+	void* memory;
+
+	load.batch = 32;
+	load.rate = 0;
+	load.stamp = 0;
+
+	while ((option = getopt(argc, argv, "r:b:d:t:s:w:p:x:T:D:L")) != -1)
 	{
-		fprintf(
-			stderr,
-			"Invalid arg count, should be: <port number to connect to router> <packets file path>"
-		);
-		exit(-1);
+		switch (option)
+		{
+			case 'r':
+				load_mode = 1;
+				load.rate = atof(optarg);
+				break;
+			case 'b':
+				load.batch = atoi(optarg);
+				break;
+			case 'd':
+				duration = atof(optarg);
+				break;
+			case 't':
+				thread_count = atoi(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 'w':
+				record_path = optarg;
+				break;
+			case 'p':
+				replay_path = optarg;
+				break;
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 'T':
+				profile_table_path = optarg;
+				break;
+			case 'D':
+				profile_spec = optarg;
+				break;
+			case 'L':
+				load.stamp = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (argc - optind != 2 ||
+		load.batch < 1 || load.batch > MAX_BATCH ||
+		thread_count < 1 || thread_count > MAX_THREADS ||
+		(record_path != NULL && (thread_count > 1 || replay_path != NULL))
+	) {
+		usage();
 	}
 
-	// parse args
-	port = atoi(argv[1]);
-	packet_file_path = argv[2];
+	// parse args, shm:<path> connects to a router's shared memory listener
+	if (strncmp(argv[optind], "shm:", 4) == 0)
+	{
+		shm_path = &argv[optind][4];
+	}
+	port = atoi(argv[optind]);
+	packet_file_path = argv[optind + 1];
 
 	stats_file = fopen(packet_file_path, "w");
 	if (stats_file == NULL)
@@ -82,32 +236,107 @@ int main (int argc, char *argv[])
 		exit(-1);
 	}
 
-	// build our socket
-	/* socketfd = build_socket(port); */
-
-	socketfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
 	dest.sin_family = AF_INET;
 	dest.sin_port = htons(port);
 	dest.sin_addr.s_addr = INADDR_ANY;
 
 	signal(SIGINT, signal_handler);
 
+	if (record_path != NULL)
+	{
+		recorder = trace_writer_open(record_path, seed);
+	}
+
+	// only load mode spreads work over threads, the paced mode has one
+	generator_count = load_mode ? thread_count : 1;
+	if (posix_memalign(&memory, 64, generator_count * sizeof(Generator)) != 0)
+	{
+		fprintf(stderr, "Unable to allocate generators.\n");
+		exit(-1);
+	}
+	generators = memory;
+	for (int i = 0; i < generator_count; i++)
+	{
+		generator_init(&generators[i], i, generator_count, seed);
+	}
+
+	if (profile_table_path != NULL)
+	{
+		// shared parts of the profile come from the seed too, not a thread
+		uint32_t rng[4];
+		xoshiro_seed(rng, seed - 1);
+		profile = profile_load(profile_table_path, profile_spec, rng);
+
+		for (int i = 0; i < generator_count; i++)
+		{
+			profile_state_init(profile, &generators[i].profile_state, generators[i].rng);
+		}
+	}
+	open_transport(&generators[0]);
+
+	if (replay_path != NULL)
+	{
+		TraceReader* trace = trace_reader_open(replay_path);
+		load_start_ns = monotonic_ns();
+		run_replay(trace, &generators[0], &dest, speed, load.batch);
+		trace_reader_close(trace);
+
+		update_statistics();
+		close_transport(&generators[0]);
+		fclose(stats_file);
+		free(generators);
+		return 0;
+	}
+
+	if (load_mode)
+	{
+		load.dest = dest;
+		load.rate = load.rate / thread_count;
+		load_start_ns = monotonic_ns();
+		load.deadline = duration > 0 ? load_start_ns + (uint64_t) (duration * 1e9) : 0;
+
+		run_threads(thread_count);
+
+		if (recorder != NULL)
+		{
+			trace_writer_close(recorder);
+		}
+		update_statistics();
+		for (int i = 0; i < generator_count; i++)
+		{
+			close_transport(&generators[i]);
+		}
+		fclose(stats_file);
+		free(generators);
+		return 0;
+	}
+
 	counter = 0;
 	while(keep_going)
 	{
+		struct iovec packet;
+		struct mmsghdr message;
+
 		bzero(buffer, MAXBUF);
-		generate_packet(buffer);
-
-		if (sendto(
-				socketfd,
-				buffer,
-				strlen(buffer) + 1,
-				0,
-				(struct sockaddr*) &dest,
-				sizeof(dest)) != -1
-		) {
+		generate_packet(&generators[0], buffer);
+
+		packet.iov_base = buffer;
+		packet.iov_len = strlen(buffer) + 1;
+		memset(&message, 0, sizeof(message));
+		message.msg_hdr.msg_name = &dest;
+		message.msg_hdr.msg_namelen = sizeof(dest);
+		message.msg_hdr.msg_iov = &packet;
+		message.msg_hdr.msg_iovlen = 1;
+
+		if (send_batch(&generators[0], &message, 1) == 1)
+		{
+			COUNTER_ADD(generators[0].sent, 1);
 			counter++;
+
+			if (recorder != NULL)
+			{
+				trace_write_packet(recorder, monotonic_ns(), &packet, 1);
+			}
 			if (counter == 20)
 			{
 				update_statistics();
@@ -120,28 +349,443 @@ int main (int argc, char *argv[])
 	}
 
 	// now tear everything back down
-	close(socketfd);
+	if (recorder != NULL)
+	{
+		trace_writer_close(recorder);
+	}
+	update_statistics();
+	close_transport(&generators[0]);
 	fclose(stats_file);
+	free(generators);
 
 	return 0;
 }
 
+void usage()
+{
+	fprintf(
+		stderr,
+		"Invalid args, should be: [-r <packets/sec, 0 for unlimited> [-b <batch size>] [-d <seconds>] [-t <threads>] [-L]] "
+		"[-s <seed>] [-w <record trace path, single thread only>] [-p <replay trace path> [-x <speed, 0 for max>]] "
+		"[-T <routing table to draw destinations from> [-D uniform|zipf[:<exponent>[:<flows>]]|hot[:<size>[:<fraction>[:<churn interval>]]]]] "
+		"<port number to connect to router, or shm:<router socket path>> <packets file path>\n"
+	);
+	exit(-1);
+}
+
+/**
+ * Starts a load generator per thread and reports their merged stats once a
+ * second until they have all stopped.
+ */
+void run_threads(int thread_count)
+{
+	struct timespec tick = {0, 100000000};
+	int ticks = 0;
+
+	running_threads = thread_count;
+	for (int i = 0; i < thread_count; i++)
+	{
+		if (i > 0)
+		{
+			open_transport(&generators[i]);
+		}
+
+		if (pthread_create(&generators[i].thread, NULL, run_load, &generators[i]) != 0)
+		{
+			fprintf(stderr, "Unable to start generator thread %d.\n", i);
+			exit(-1);
+		}
+	}
+
+	// a file write every 20 packets would dominate at these rates
+	while (__atomic_load_n(&running_threads, __ATOMIC_ACQUIRE) > 0)
+	{
+		nanosleep(&tick, NULL);
+		if (++ticks == 10)
+		{
+			update_statistics();
+			ticks = 0;
+		}
+	}
+
+	for (int i = 0; i < thread_count; i++)
+	{
+		pthread_join(generators[i].thread, NULL);
+	}
+}
+
+/**
+ * Floods the router at a target rate, sending batches of packets with
+ * sendmmsg. Each batch waits on a token bucket for a batch worth of tokens.
+ * The bucket holds an extra millisecond of tokens so oversleeping in
+ * nanosleep doesn't drag the achieved rate under the target.
+ */
+void* run_load(void* arg)
+{
+	Generator* gen = arg;
+	char headers[MAX_BATCH][HEADER_LENGTH];
+	char stamps[MAX_BATCH][STAMP_LENGTH];
+	struct mmsghdr messages[MAX_BATCH];
+	struct iovec iovecs[MAX_BATCH][2];
+	TokenBucket bucket;
+	uint64_t now, wait;
+	char src[16], dest[16];
+	int ttl, payload, sent;
+	int batch = load.batch;
+	struct timespec pause;
+
+	memset(messages, 0, sizeof(messages));
+	for (int i = 0; i < batch; i++)
+	{
+		render_header_template(headers[i]);
+		memcpy(stamps[i], "t=", 2);
+		stamps[i][STAMP_LENGTH - 1] = '\0';
+		iovecs[i][0].iov_base = headers[i];
+		iovecs[i][0].iov_len = HEADER_LENGTH;
+		messages[i].msg_hdr.msg_name = &load.dest;
+		messages[i].msg_hdr.msg_namelen = sizeof(load.dest);
+		messages[i].msg_hdr.msg_iov = iovecs[i];
+		messages[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	token_bucket_init(&bucket, load.rate, batch + load.rate / 1000);
+
+	while (keep_going)
+	{
+		now = monotonic_ns();
+		if (load.deadline != 0 && now >= load.deadline)
+		{
+			break;
+		}
+
+		wait = token_bucket_wait_ns(&bucket, batch, now);
+		if (wait > 0)
+		{
+			pause.tv_sec = wait / 1000000000ull;
+			pause.tv_nsec = wait % 1000000000ull;
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		token_bucket_take(&bucket, batch, now);
+
+		// only the fields that change get rewritten, the payload is shared
+		for (int i = 0; i < batch; i++)
+		{
+			choose_packet(gen, src, dest, &ttl, &payload);
+			patch_header(headers[i], next_packet_id(gen), src, dest, ttl);
+
+			// send the payload's terminator too, like the sprintf path does
+			iovecs[i][1].iov_base = PAYLOADS[payload];
+			iovecs[i][1].iov_len = strlen(PAYLOADS[payload]) + 1;
+		}
+
+		if (load.stamp)
+		{
+			now = monotonic_ns();
+			for (int i = 0; i < batch; i++)
+			{
+				patch_number(&stamps[i][2], STAMP_WIDTH, now);
+				iovecs[i][1].iov_base = stamps[i];
+				iovecs[i][1].iov_len = STAMP_LENGTH;
+			}
+		}
+
+		for (int offset = 0; offset < batch && keep_going; offset += sent)
+		{
+			sent = send_batch(gen, &messages[offset], batch - offset);
+			if (sent == -1)
+			{
+				if (errno != EINTR && errno != ENOBUFS && errno != EAGAIN)
+				{
+					fprintf(stderr, "Sendmmsg err#: %d\n", errno);
+					keep_going = 0;
+				}
+				sent = 0;
+			}
+			else if (recorder != NULL)
+			{
+				record_batch(&messages[offset], sent);
+			}
+			COUNTER_ADD(gen->sent, sent);
+		}
+	}
+
+	__atomic_fetch_sub(&running_threads, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/**
+ * Appends a just sent batch to the trace, stamped with the time it went out.
+ */
+void record_batch(struct mmsghdr* messages, int count)
+{
+	uint64_t now = monotonic_ns();
+
+	for (int i = 0; i < count; i++)
+	{
+		trace_write_packet(
+			recorder,
+			now,
+			messages[i].msg_hdr.msg_iov,
+			messages[i].msg_hdr.msg_iovlen
+		);
+	}
+}
+
+/**
+ * Streams a recorded trace back out, keeping its original spacing scaled by
+ * speed, or as fast as possible when speed is 0. Packets that are already
+ * due are gathered into one sendmmsg straight out of the mapped file.
+ */
+void run_replay(TraceReader* trace, Generator* gen, struct sockaddr_in* dest, double speed, int batch)
+{
+	struct mmsghdr messages[MAX_BATCH];
+	struct iovec iovecs[MAX_BATCH];
+	uint64_t start = monotonic_ns();
+	uint64_t trace_ns = 0;
+	uint64_t delta, due, now;
+	const char* data;
+	size_t length;
+	int pending = 0;
+	int finished = 0;
+	int count, sent;
+	struct timespec pause;
+
+	memset(messages, 0, sizeof(messages));
+	for (int i = 0; i < MAX_BATCH; i++)
+	{
+		messages[i].msg_hdr.msg_name = dest;
+		messages[i].msg_hdr.msg_namelen = sizeof(*dest);
+		messages[i].msg_hdr.msg_iov = &iovecs[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (keep_going && !finished)
+	{
+		count = 0;
+		now = monotonic_ns();
+
+		while (count < batch)
+		{
+			if (!pending)
+			{
+				if (trace_read_packet(trace, &delta, &data, &length) != 0)
+				{
+					finished = 1;
+					break;
+				}
+				trace_ns += delta;
+				pending = 1;
+			}
+
+			due = speed > 0 ? start + (uint64_t) (trace_ns / speed) : 0;
+			if (due > now)
+			{
+				// send what is ready now rather than hold it for the next one
+				if (count > 0)
+				{
+					break;
+				}
+
+				pause.tv_sec = (due - now) / 1000000000ull;
+				pause.tv_nsec = (due - now) % 1000000000ull;
+				nanosleep(&pause, NULL);
+				if (!keep_going)
+				{
+					break;
+				}
+				now = monotonic_ns();
+				continue;
+			}
+
+			iovecs[count].iov_base = (void*) data;
+			iovecs[count].iov_len = length;
+			count++;
+			pending = 0;
+		}
+
+		for (int offset = 0; offset < count && keep_going; offset += sent)
+		{
+			sent = send_batch(gen, &messages[offset], count - offset);
+			if (sent == -1)
+			{
+				if (errno != EINTR && errno != ENOBUFS && errno != EAGAIN)
+				{
+					fprintf(stderr, "Sendmmsg err#: %d\n", errno);
+					keep_going = 0;
+				}
+				sent = 0;
+			}
+			COUNTER_ADD(gen->sent, sent);
+		}
+	}
+}
+
+/**
+ * Gives a generator its own way to the router: a UDP socket, or with
+ * shm:<path> a shared memory ring of its own, since each ring has a single
+ * producer.
+ */
+void open_transport(Generator* gen)
+{
+	if (shm_path == NULL)
+	{
+		gen->socketfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		return;
+	}
+
+	gen->ring = malloc(sizeof(ShmRing));
+	if (gen->ring == NULL || shm_ring_connect(gen->ring, shm_path) != 0)
+	{
+		fprintf(stderr, "Unable to connect to router at %s, errno: %d\n", shm_path, errno);
+		exit(-1);
+	}
+}
+
+void close_transport(Generator* gen)
+{
+	if (gen->ring != NULL)
+	{
+		shm_ring_close(gen->ring);
+		free(gen->ring);
+		gen->ring = NULL;
+		return;
+	}
+
+	close(gen->socketfd);
+}
+
+/**
+ * sendmmsg over whichever transport the generator has. A full ring waits
+ * for the router to catch up instead of dropping, so shared memory never
+ * loses packets the way an overflowing socket buffer does.
+ *
+ * Returns the number sent, or -1 with errno set.
+ */
+int send_batch(Generator* gen, struct mmsghdr* messages, int count)
+{
+	int written = 0;
+
+	if (gen->ring == NULL)
+	{
+		return sendmmsg(gen->socketfd, messages, count, 0);
+	}
+
+	while (written < count && keep_going)
+	{
+		if (shm_ring_write(gen->ring, messages[written].msg_hdr.msg_iov, messages[written].msg_hdr.msg_iovlen) == 0)
+		{
+			written++;
+			continue;
+		}
+
+		// hand over what fits before waiting on the rest
+		if (errno != EAGAIN || written > 0)
+		{
+			break;
+		}
+
+		if (shm_ring_wait_space(gen->ring, 100) != 0)
+		{
+			return -1;
+		}
+	}
+
+	if (written == 0 && errno == EMSGSIZE)
+	{
+		return -1;
+	}
+
+	shm_ring_publish(gen->ring);
+	return written;
+}
+
+/**
+ * Writes the parts of a load mode header that never change.
+ */
+void render_header_template(char* header)
+{
+	memset(header, ' ', HEADER_LENGTH);
+	memcpy(&header[HEADER_SRC_OFFSET - 2], ", ", 2);
+	memcpy(&header[HEADER_DEST_OFFSET - 2], ", ", 2);
+	memcpy(&header[HEADER_TTL_OFFSET - 2], ", ", 2);
+	memcpy(&header[HEADER_LENGTH - 2], ", ", 2);
+}
+
+/**
+ * Fills the id, address and TTL slots of a rendered header.
+ */
+void patch_header(char* header, unsigned int id, const char* src, const char* dest, int ttl)
+{
+	int src_length = strlen(src);
+	int dest_length = strlen(dest);
+
+	patch_number(&header[HEADER_ID_OFFSET], HEADER_ID_WIDTH, id);
+
+	memcpy(&header[HEADER_SRC_OFFSET], src, src_length);
+	memset(&header[HEADER_SRC_OFFSET + src_length], ' ', HEADER_ADDRESS_WIDTH - src_length);
+
+	memcpy(&header[HEADER_DEST_OFFSET], dest, dest_length);
+	memset(&header[HEADER_DEST_OFFSET + dest_length], ' ', HEADER_ADDRESS_WIDTH - dest_length);
+
+	patch_number(&header[HEADER_TTL_OFFSET], HEADER_TTL_WIDTH, ttl);
+}
+
+/**
+ * Writes value as zero padded decimal into exactly width characters.
+ */
+void patch_number(char* field, int width, uint64_t value)
+{
+	for (int i = width - 1; i >= 0; i--)
+	{
+		field[i] = '0' + value % 10;
+		value /= 10;
+	}
+}
+
 /**
  * Outputs updated statistics to file.
  */
 void update_statistics()
 {
+	Stats total = {0, 0, 0, 0, 0, 0, 0};
+	unsigned long packets_sent = 0;
+
+	for (int i = 0; i < generator_count; i++)
+	{
+		Stats* stats = &generators[i].stats;
+		total.a_to_b += COUNTER_READ(stats->a_to_b);
+		total.a_to_c += COUNTER_READ(stats->a_to_c);
+		total.b_to_a += COUNTER_READ(stats->b_to_a);
+		total.b_to_c += COUNTER_READ(stats->b_to_c);
+		total.c_to_a += COUNTER_READ(stats->c_to_a);
+		total.c_to_b += COUNTER_READ(stats->c_to_b);
+		total.invalid += COUNTER_READ(stats->invalid);
+		packets_sent += COUNTER_READ(generators[i].sent);
+	}
+
 	// Ugly over width violation, but no nicer way to do this
 	fprintf(stats_file,
 		"NetA to NetB: %d\nNetA to NetC: %d\nNetB to NetA: %d\nNetB to NetC: %d\nNetC to NetA: %d\nNetC to NetB: %d\nInvalid Destination: %d\n",
-		STATS.a_to_b,
-		STATS.a_to_c,
-		STATS.b_to_a,
-		STATS.b_to_c,
-		STATS.c_to_a,
-		STATS.c_to_b,
-		STATS.invalid
+		total.a_to_b,
+		total.a_to_c,
+		total.b_to_a,
+		total.b_to_c,
+		total.c_to_a,
+		total.c_to_b,
+		total.invalid
 	);
+
+	if (load_start_ns != 0)
+	{
+		double elapsed = (monotonic_ns() - load_start_ns) / 1e9;
+		fprintf(
+			stats_file,
+			"Packets sent: %lu\nAchieved rate: %.0f packets/sec\n",
+			packets_sent,
+			elapsed > 0 ? packets_sent / elapsed : 0
+		);
+	}
 	rewind(stats_file);
 	printf("Updating generation statistics.\n");
 }
@@ -149,81 +793,102 @@ void update_statistics()
 /**
  * Generates a new packet and places it in the specified buffer.
  */
-void generate_packet(char* raw_packet)
+void generate_packet(Generator* gen, char* raw_packet)
 {
-	int src, dest, ttl, payload;
+	char src[16], dest[16];
+	int ttl, payload;
 
-	ttl = rand_limit_floor(1, MAX_TTL);
-	src = rand_limit(MAX_ROUTE_INDEX);
-	dest = rand_limit(MAX_ROUTE_INDEX);
-	payload = rand_limit(MAX_ROUTE_INDEX);
-
-	// ensure src != dest for addresses and we arent sending from an invalid
-	// src address
-	while (src == dest || src == MAX_ROUTE_INDEX)
-	{
-		src = rand_limit(MAX_ROUTE_INDEX);
-	}
-
-	// offload updating our global stats struct
-	increment_stats(src, dest);
+	choose_packet(gen, src, dest, &ttl, &payload);
 
 	sprintf(
 		raw_packet,
-		"%d, %s, %s, %d, %s",
-		packet_id_counter,
-		ROUTERS[src],
-		ROUTERS[dest],
+		"%u, %s, %s, %d, %s",
+		next_packet_id(gen),
+		src,
+		dest,
 		ttl,
 		PAYLOADS[payload]
 	);
+}
+
+/**
+ * Picks a random source, destination, TTL and payload for the next packet,
+ * writing the addresses into src and dest. Packets between the ROUTERS
+ * networks are recorded in the stats, profile traffic only in the sent count.
+ */
+void choose_packet(Generator* gen, char* src, char* dest, int* ttl, int* payload)
+{
+	int src_index, dest_index;
 
-	// increment id counter
-	packet_id_counter++;
+	*ttl = rand_limit_floor(gen, 1, MAX_TTL);
+	*payload = rand_limit(gen, MAX_ROUTE_INDEX);
+
+	if (profile != NULL)
+	{
+		format_ipv4(profile_address(profile, gen->rng), src);
+		format_ipv4(profile_destination(profile, &gen->profile_state, gen->rng), dest);
+		return;
+	}
+
+	src_index = rand_limit(gen, MAX_ROUTE_INDEX);
+	dest_index = rand_limit(gen, MAX_ROUTE_INDEX);
+
+	// ensure src != dest for addresses and we arent sending from an invalid
+	// src address
+	while (src_index == dest_index || src_index == MAX_ROUTE_INDEX)
+	{
+		src_index = rand_limit(gen, MAX_ROUTE_INDEX);
+	}
+
+	strcpy(src, ROUTERS[src_index]);
+	strcpy(dest, ROUTERS[dest_index]);
+
+	// offload updating this generator's stats struct
+	increment_stats(&gen->stats, src_index, dest_index);
 }
 
 /**
  * This handles updating our stats. Because we are manually setting very
  * specific cases, there is a lot of gross case checking here.
  */
-void increment_stats(int src, int dest)
+void increment_stats(Stats* stats, int src, int dest)
 {
 	// handle invalid case first
 	if (dest == MAX_ROUTE_INDEX) {
-		STATS.invalid = STATS.invalid + 1;
+		COUNTER_ADD(stats->invalid, 1);
 	}
 	// we should never have src == dest based on how packets are generated
 	else if (src == 0)
 	{
 		if (dest == 1)
 		{
-			STATS.a_to_b = STATS.a_to_b + 1;
+			COUNTER_ADD(stats->a_to_b, 1);
 		}
 		else
 		{
-			STATS.a_to_c = STATS.a_to_c + 1;
+			COUNTER_ADD(stats->a_to_c, 1);
 		}
 	}
 	else if(src == 1)
 	{
 		if (dest == 0)
 		{
-			STATS.b_to_a = STATS.b_to_a + 1;
+			COUNTER_ADD(stats->b_to_a, 1);
 		}
 		else
 		{
-			STATS.b_to_c = STATS.b_to_c + 1;
+			COUNTER_ADD(stats->b_to_c, 1);
 		}
 	}
 	else if (src == 2)
 	{
 		if (dest == 0)
 		{
-			STATS.c_to_a = STATS.c_to_a + 1;
+			COUNTER_ADD(stats->c_to_a, 1);
 		}
 		else
 		{
-			STATS.c_to_b = STATS.c_to_b + 1;
+			COUNTER_ADD(stats->c_to_b, 1);
 		}
 	}
 }
@@ -231,30 +896,51 @@ void increment_stats(int src, int dest)
 /**
  * Returns a random int between floor and limit inclusive.
  */
-int rand_limit_floor(int floor, int limit)
+int rand_limit_floor(Generator* gen, int floor, int limit)
 {
-	return floor + rand_limit(limit - floor);
+	return floor + rand_limit(gen, limit - floor);
 }
 
 /**
  * Return a random number between 0 and limit inclusive.
  */
-int rand_limit(int limit)
+int rand_limit(Generator* gen, int limit)
 {
+	return (int) xoshiro_below(gen->rng, limit + 1);
+}
 
-	int divisor = RAND_MAX / ( limit + 1);
-	int retval;
+/**
+ * Resets a generator and hands it the index'th of count equal slices of the
+ * positive packet id space.
+ */
+void generator_init(Generator* gen, int index, int count, uint64_t seed)
+{
+	memset(gen, 0, sizeof(Generator));
+	xoshiro_seed(gen->rng, seed + index);
+	gen->id_span = INT_MAX / count;
+	gen->first_id = index * gen->id_span;
+	gen->next_id = gen->first_id;
+	gen->socketfd = -1;
+}
+
+/**
+ * Returns the generator's next packet id, wrapping within its own slice.
+ */
+unsigned int next_packet_id(Generator* gen)
+{
+	unsigned int id = gen->next_id++;
 
-	do {
-		retval = rand() / divisor;
-	} while (retval > limit);
+	if (gen->next_id - gen->first_id >= gen->id_span)
+	{
+		gen->next_id = gen->first_id;
+	}
 
-	return retval;
+	return id;
 }
 
 void signal_handler(int signal)
 {
-	update_statistics();
+	(void) signal;
 	printf("Terminating...");
 	keep_going = 0;
 }
@@ -0,0 +1,273 @@
+/**
+ * Table driven traffic profiles: destinations inside the prefixes of a
+ * routing table, spread uniformly, Zipf skewed or concentrated on a slowly
+ * churning hot set.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "profile.h"
+#include "router.h"
+#include "xoshiro.h"
+
+#define PROFILE_DEFAULT_FLOWS 65536
+
+static void profile_parse_spec(Profile* profile, const char* spec);
+static void profile_build_zipf(Profile* profile, uint32_t* rng);
+
+/**
+ * Reads the prefixes out of a table in the router's format, loaded the way
+ * the router loads it, and prepares the distribution described by spec:
+ *
+ *   uniform
+ *   zipf[:<exponent>[:<flows>]]
+ *   hot[:<set size>[:<hot fraction>[:<churn every n packets>]]]
+ *
+ * Destinations are IPv4 only, so IPv6 routes are left out.
+ */
+Profile* profile_load(const char* table_path, const char* spec, uint32_t* rng)
+{
+	Profile* profile = malloc(sizeof(Profile));
+	RouterTable* table = build_router_table((char*) table_path);
+	int skipped = 0;
+
+	if (table == NULL)
+	{
+		fprintf(stderr, "Can't read invalid table file path %s\n", table_path);
+		exit(-1);
+	}
+
+	profile->prefixes = malloc((table->size > 0 ? table->size : 1) * sizeof(ProfilePrefix));
+	profile->size = 0;
+	for (int i = 0; i < table->size; i++)
+	{
+		Router* route = table->routes[i];
+
+		// a route the table rejected has a prefix length of -1
+		if (route->version != 4 || route->prefix_length < 0 || route->prefix_length > 32)
+		{
+			skipped++;
+			continue;
+		}
+
+		profile->prefixes[profile->size].network = route->network;
+		profile->prefixes[profile->size].host_mask = ~route->mask;
+		profile->size++;
+	}
+	RouterTable_free(table);
+
+	if (skipped > 0)
+	{
+		fprintf(stderr, "Leaving %d IPv6 or invalid routes out of the traffic profile.\n", skipped);
+	}
+	if (profile->size == 0)
+	{
+		fprintf(stderr, "No usable prefixes in table: %s.\n", table_path);
+		exit(-1);
+	}
+
+	profile_parse_spec(profile, spec);
+	if (profile->distribution == PROFILE_ZIPF)
+	{
+		profile_build_zipf(profile, rng);
+	}
+
+	return profile;
+}
+
+/**
+ * Gives a generator its own hot set to churn.
+ */
+void profile_state_init(Profile* profile, ProfileState* state, uint32_t* rng)
+{
+	state->packets = 0;
+	state->hot = NULL;
+
+	if (profile->distribution == PROFILE_HOT)
+	{
+		state->hot = malloc(profile->hot_size * sizeof(uint32_t));
+		for (int i = 0; i < profile->hot_size; i++)
+		{
+			state->hot[i] = profile_address(profile, rng);
+		}
+	}
+}
+
+/**
+ * Draws the next destination address, host byte order.
+ */
+uint32_t profile_destination(Profile* profile, ProfileState* state, uint32_t* rng)
+{
+	double draw;
+	int low, high;
+
+	switch (profile->distribution)
+	{
+		case PROFILE_ZIPF:
+			// first flow whose cumulative weight covers the draw
+			draw = xoshiro_double(rng);
+			low = 0;
+			high = profile->flow_count - 1;
+			while (low < high)
+			{
+				int middle = (low + high) / 2;
+				if (profile->zipf_cdf[middle] < draw)
+				{
+					low = middle + 1;
+				}
+				else
+				{
+					high = middle;
+				}
+			}
+			return profile->flows[low];
+
+		case PROFILE_HOT:
+			state->packets++;
+			if (profile->churn_interval > 0 && state->packets % profile->churn_interval == 0)
+			{
+				state->hot[xoshiro_below(rng, profile->hot_size)] = profile_address(profile, rng);
+			}
+
+			if (xoshiro_double(rng) < profile->hot_fraction)
+			{
+				return state->hot[xoshiro_below(rng, profile->hot_size)];
+			}
+			return profile_address(profile, rng);
+
+		default:
+			return profile_address(profile, rng);
+	}
+}
+
+/**
+ * A random address inside a random prefix. Every prefix is equally likely
+ * whatever its size, otherwise a single short prefix would soak up nearly
+ * all of the traffic.
+ */
+uint32_t profile_address(Profile* profile, uint32_t* rng)
+{
+	ProfilePrefix* prefix = &profile->prefixes[xoshiro_below(rng, profile->size)];
+
+	return prefix->network | (xoshiro_next(rng) & prefix->host_mask);
+}
+
+/**
+ * Writes address in dotted quad form without going through printf.
+ *
+ * Returns the length written, out needs room for 16 bytes.
+ */
+int format_ipv4(uint32_t address, char* out)
+{
+	int length = 0;
+
+	for (int shift = 24; shift >= 0; shift -= 8)
+	{
+		unsigned int byte = (address >> shift) & 0xff;
+
+		if (byte >= 100)
+		{
+			out[length++] = '0' + byte / 100;
+		}
+		if (byte >= 10)
+		{
+			out[length++] = '0' + byte / 10 % 10;
+		}
+		out[length++] = '0' + byte % 10;
+		out[length++] = shift > 0 ? '.' : '\0';
+	}
+
+	return length - 1;
+}
+
+/**
+ * Fills in the distribution described by spec, exiting on anything that
+ * doesn't parse in full or is out of range.
+ */
+static void profile_parse_spec(Profile* profile, const char* spec)
+{
+	int end = 0;
+
+	profile->zipf_exponent = 1.0;
+	profile->flow_count = PROFILE_DEFAULT_FLOWS;
+	profile->flows = NULL;
+	profile->zipf_cdf = NULL;
+	profile->hot_size = 64;
+	profile->hot_fraction = 0.9;
+	profile->churn_interval = 1000;
+
+	// end only reaches past the last field that parsed, so anything after it is junk
+	if (strncmp(spec, "zipf", 4) == 0)
+	{
+		profile->distribution = PROFILE_ZIPF;
+		sscanf(spec, "zipf%n:%lf%n:%d%n", &end, &profile->zipf_exponent, &end, &profile->flow_count, &end);
+	}
+	else if (strncmp(spec, "hot", 3) == 0)
+	{
+		profile->distribution = PROFILE_HOT;
+		sscanf(
+			spec,
+			"hot%n:%d%n:%lf%n:%d%n",
+			&end,
+			&profile->hot_size,
+			&end,
+			&profile->hot_fraction,
+			&end,
+			&profile->churn_interval,
+			&end
+		);
+	}
+	else if (strcmp(spec, "uniform") == 0)
+	{
+		profile->distribution = PROFILE_UNIFORM;
+		end = strlen(spec);
+	}
+	else
+	{
+		fprintf(stderr, "Unknown traffic distribution: %s.\n", spec);
+		exit(-1);
+	}
+
+	if (
+		spec[end] != 0 || !(profile->hot_fraction >= 0 && profile->hot_fraction <= 1) ||
+		profile->churn_interval < 0
+	)
+	{
+		fprintf(stderr, "Invalid traffic distribution: %s.\n", spec);
+		exit(-1);
+	}
+
+	if (profile->flow_count < 1 || profile->hot_size < 1)
+	{
+		fprintf(stderr, "Traffic distribution needs at least one flow: %s.\n", spec);
+		exit(-1);
+	}
+}
+
+/**
+ * Picks the flow universe and its cumulative Zipf weights, flow k getting a
+ * share proportional to 1 / (k + 1)^exponent.
+ */
+static void profile_build_zipf(Profile* profile, uint32_t* rng)
+{
+	double total = 0;
+
+	profile->flows = malloc(profile->flow_count * sizeof(uint32_t));
+	profile->zipf_cdf = malloc(profile->flow_count * sizeof(double));
+
+	for (int i = 0; i < profile->flow_count; i++)
+	{
+		profile->flows[i] = profile_address(profile, rng);
+		total += 1.0 / pow(i + 1, profile->zipf_exponent);
+		profile->zipf_cdf[i] = total;
+	}
+
+	for (int i = 0; i < profile->flow_count; i++)
+	{
+		profile->zipf_cdf[i] /= total;
+	}
+	profile->zipf_cdf[profile->flow_count - 1] = 1.0;
+}
@@ -0,0 +1,44 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+
+#define PROFILE_UNIFORM 0
+#define PROFILE_ZIPF 1
+#define PROFILE_HOT 2
+
+typedef struct {
+	uint32_t network;
+	uint32_t host_mask;
+} ProfilePrefix;
+
+/*
+ * Destinations drawn from the prefixes of a routing table. Everything in
+ * here is read only once loaded, so generator threads can share it.
+ */
+typedef struct {
+	ProfilePrefix* prefixes;
+	int size;
+	int distribution;
+	double zipf_exponent;
+	int flow_count;
+	uint32_t* flows;
+	double* zipf_cdf;
+	int hot_size;
+	double hot_fraction;
+	int churn_interval;
+} Profile;
+
+/* The parts of a profile that move as a generator runs */
+typedef struct {
+	uint32_t* hot;
+	unsigned long packets;
+} ProfileState;
+
+Profile* profile_load(const char* table_path, const char* spec, uint32_t* rng);
+void profile_state_init(Profile* profile, ProfileState* state, uint32_t* rng);
+uint32_t profile_destination(Profile* profile, ProfileState* state, uint32_t* rng);
+uint32_t profile_address(Profile* profile, uint32_t* rng);
+int format_ipv4(uint32_t address, char* out);
+
+#endif
@@ -0,0 +1,264 @@
+/**
+ * Vectorized longest prefix matching for small routing tables.
+ *
+ * Every destination in a batch is checked against all routes with SSE2 or
+ * AVX2 compares, whichever the CPU supports, falling back to a scalar loop.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "route_match.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define ROUTE_MATCH_X86
+#endif
+
+/* pad to a full AVX2 register of routes */
+#define ROUTE_MATCH_LANES 8
+
+static void lookup_batch_scalar(
+	const uint32_t* networks,
+	const uint32_t* masks,
+	int padded_size,
+	const uint32_t* destinations,
+	int* matches,
+	int count
+);
+#ifdef ROUTE_MATCH_X86
+static void lookup_batch_sse2(
+	const uint32_t* networks,
+	const uint32_t* masks,
+	int padded_size,
+	const uint32_t* destinations,
+	int* matches,
+	int count
+);
+static void lookup_batch_avx2(
+	const uint32_t* networks,
+	const uint32_t* masks,
+	int padded_size,
+	const uint32_t* destinations,
+	int* matches,
+	int count
+);
+#endif
+
+/**
+ * Allocates an empty matcher and picks the widest lookup the CPU can run.
+ */
+RouteMatcher* RouteMatcher_new()
+{
+	RouteMatcher* matcher = malloc(sizeof(RouteMatcher));
+	void* networks;
+	void* masks;
+	size_t bytes = ROUTE_MATCH_MAX_ROUTES * sizeof(uint32_t);
+
+	if (posix_memalign(&networks, 32, bytes) != 0 ||
+		posix_memalign(&masks, 32, bytes) != 0
+	) {
+		fprintf(stderr, "Unable to allocate route matcher.\n");
+		exit(-1);
+	}
+
+	matcher->networks = networks;
+	matcher->masks = masks;
+	matcher->routes = malloc(ROUTE_MATCH_MAX_ROUTES * sizeof(int32_t));
+	matcher->size = 0;
+	matcher->padded_size = 0;
+	matcher->generation = 0;
+	matcher->engine = "scalar";
+	matcher->lookup_batch = lookup_batch_scalar;
+
+#ifdef ROUTE_MATCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		matcher->engine = "avx2";
+		matcher->lookup_batch = lookup_batch_avx2;
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		matcher->engine = "sse2";
+		matcher->lookup_batch = lookup_batch_sse2;
+	}
+#endif
+
+	return matcher;
+}
+
+void RouteMatcher_free(RouteMatcher* matcher)
+{
+	free(matcher->networks);
+	free(matcher->masks);
+	free(matcher->routes);
+	free(matcher);
+}
+
+/**
+ * Loads the given routes, longest prefix first. Routes with equal prefix
+ * lengths keep their table order so ties resolve the same as a linear scan.
+ *
+ * Returns 0 on success, -1 if the table is too large for the matcher.
+ */
+int route_matcher_load(
+	RouteMatcher* matcher,
+	int size,
+	const uint32_t* networks,
+	const uint32_t* masks,
+	const int* prefix_lengths
+) {
+	int slot = 0;
+
+	if (size > ROUTE_MATCH_MAX_ROUTES)
+	{
+		matcher->size = 0;
+		matcher->padded_size = 0;
+		return -1;
+	}
+
+	// a counting sort on prefix length is stable and never more than 33 passes
+	for (int length = 32; length >= 0; length--)
+	{
+		for (int i = 0; i < size; i++)
+		{
+			if (prefix_lengths[i] == length)
+			{
+				matcher->networks[slot] = networks[i];
+				matcher->masks[slot] = masks[i];
+				matcher->routes[slot] = i;
+				slot++;
+			}
+		}
+	}
+
+	matcher->size = slot;
+	matcher->padded_size = slot;
+
+	// padding lanes can never match: nothing masked by 0 equals 1
+	while (matcher->padded_size % ROUTE_MATCH_LANES != 0)
+	{
+		matcher->networks[matcher->padded_size] = 1;
+		matcher->masks[matcher->padded_size] = 0;
+		matcher->padded_size++;
+	}
+
+	return 0;
+}
+
+/**
+ * Resolves each destination to the table index of its longest matching
+ * route, or -1 if none match.
+ */
+void route_matcher_lookup_batch(
+	RouteMatcher* matcher,
+	const uint32_t* destinations,
+	int* routes,
+	int count
+) {
+	matcher->lookup_batch(
+		matcher->networks,
+		matcher->masks,
+		matcher->padded_size,
+		destinations,
+		routes,
+		count
+	);
+
+	// translate sorted positions back into table indexes
+	for (int i = 0; i < count; i++)
+	{
+		if (routes[i] != -1)
+		{
+			routes[i] = matcher->routes[routes[i]];
+		}
+	}
+}
+
+static void lookup_batch_scalar(
+	const uint32_t* networks,
+	const uint32_t* masks,
+	int padded_size,
+	const uint32_t* destinations,
+	int* matches,
+	int count
+) {
+	for (int i = 0; i < count; i++)
+	{
+		matches[i] = -1;
+		for (int r = 0; r < padded_size; r++)
+		{
+			if ((destinations[i] & masks[r]) == networks[r])
+			{
+				matches[i] = r;
+				break;
+			}
+		}
+	}
+}
+
+#ifdef ROUTE_MATCH_X86
+__attribute__((target("sse2")))
+static void lookup_batch_sse2(
+	const uint32_t* networks,
+	const uint32_t* masks,
+	int padded_size,
+	const uint32_t* destinations,
+	int* matches,
+	int count
+) {
+	for (int i = 0; i < count; i++)
+	{
+		__m128i destination = _mm_set1_epi32((int) destinations[i]);
+
+		matches[i] = -1;
+		for (int r = 0; r < padded_size; r += 4)
+		{
+			__m128i mask = _mm_load_si128((const __m128i*) &masks[r]);
+			__m128i network = _mm_load_si128((const __m128i*) &networks[r]);
+			__m128i hit = _mm_cmpeq_epi32(_mm_and_si128(destination, mask), network);
+			int lanes = _mm_movemask_ps(_mm_castsi128_ps(hit));
+
+			if (lanes != 0)
+			{
+				matches[i] = r + __builtin_ctz(lanes);
+				break;
+			}
+		}
+	}
+}
+
+__attribute__((target("avx2")))
+static void lookup_batch_avx2(
+	const uint32_t* networks,
+	const uint32_t* masks,
+	int padded_size,
+	const uint32_t* destinations,
+	int* matches,
+	int count
+) {
+	for (int i = 0; i < count; i++)
+	{
+		__m256i destination = _mm256_set1_epi32((int) destinations[i]);
+
+		matches[i] = -1;
+		for (int r = 0; r < padded_size; r += 8)
+		{
+			__m256i mask = _mm256_load_si256((const __m256i*) &masks[r]);
+			__m256i network = _mm256_load_si256((const __m256i*) &networks[r]);
+			__m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(destination, mask), network);
+			int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+
+			if (lanes != 0)
+			{
+				matches[i] = r + __builtin_ctz(lanes);
+				break;
+			}
+		}
+	}
+}
+#endif
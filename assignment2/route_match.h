@@ -0,0 +1,48 @@
+#ifndef ROUTE_MATCH_H_
+#define ROUTE_MATCH_H_
+
+#include <stdint.h>
+
+/* Past this many routes a linear scan stops being competitive */
+#define ROUTE_MATCH_MAX_ROUTES 64
+
+/*
+ * Prefixes sorted longest first and laid out in parallel aligned arrays so
+ * a vector compare can test several routes per instruction. The first route
+ * to match is then the longest prefix.
+ */
+typedef struct {
+	uint32_t* networks;
+	uint32_t* masks;
+	int32_t* routes;
+	int size;
+	int padded_size;
+	unsigned int generation;
+	const char* engine;
+	void (*lookup_batch)(
+		const uint32_t* networks,
+		const uint32_t* masks,
+		int padded_size,
+		const uint32_t* destinations,
+		int* matches,
+		int count
+	);
+} RouteMatcher;
+
+RouteMatcher* RouteMatcher_new();
+void RouteMatcher_free(RouteMatcher* matcher);
+int route_matcher_load(
+	RouteMatcher* matcher,
+	int size,
+	const uint32_t* networks,
+	const uint32_t* masks,
+	const int* prefix_lengths
+);
+void route_matcher_lookup_batch(
+	RouteMatcher* matcher,
+	const uint32_t* destinations,
+	int* routes,
+	int count
+);
+
+#endif
@@ -0,0 +1,642 @@
+/**
+ * Routing table parsing and lookup, plus the packet parser, shared by the
+ * router and its tests.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "router.h"
+
+static void add_next_hops(RouterTable* table, Router* route, const char* next_hops);
+
+/**
+ * Attempts to find the destination router for the given packet from the provided
+ * table, copying the match into router.
+ * Returns 0 on a match or -1 if no matches were found.
+ */
+int find_destination_router(Router* router, RouterTable* table, Packet* packet)
+{
+	uint8_t destination[16];
+	int route = -1;
+
+	if (!is_ipv6_string(packet->dest))
+	{
+		route = lookup_route(table, parse_ipv4_string(packet->dest));
+	}
+	else if (parse_ipv6_string(packet->dest, destination) == 0)
+	{
+		route = lookup_route6(table, destination);
+	}
+
+	if (route == -1)
+	{
+		return -1;
+	}
+
+	*router = *table->routes[route];
+	return 0;
+}
+
+/**
+ * Longest prefix match of destination against the table, using the masks
+ * precomputed when the routes were loaded. Ties go to the earlier route.
+ *
+ * Returns the index of the matching route, or -1 if none match.
+ */
+int lookup_route(RouterTable* table, uint32_t destination)
+{
+	int match = -1;
+
+	for(int i = 0; i < table->size; i++)
+	{
+		Router* candidate = table->routes[i];
+
+		if ((destination & candidate->mask) == candidate->network &&
+			(match == -1 || candidate->prefix_length > table->routes[match]->prefix_length)
+		) {
+			match = i;
+		}
+	}
+
+	return match;
+}
+
+/**
+ * The IPv6 counterpart of lookup_route, comparing whole bytes of the prefix
+ * and then the bits left over.
+ *
+ * Returns the index of the matching route, or -1 if none match.
+ */
+int lookup_route6(RouterTable* table, const uint8_t* destination)
+{
+	int match = -1;
+
+	for(int i = 0; i < table->size; i++)
+	{
+		Router* candidate = table->routes[i];
+		int bytes = candidate->prefix_length / 8;
+		int bits = candidate->prefix_length % 8;
+
+		if (candidate->version != 6 || candidate->prefix_length < 0 ||
+			(match != -1 && candidate->prefix_length <= table->routes[match]->prefix_length) ||
+			memcmp(destination, candidate->network6, bytes) != 0
+		) {
+			continue;
+		}
+
+		if (bits == 0 || ((destination[bytes] ^ candidate->network6[bytes]) & (0xff << (8 - bits)) & 0xff) == 0)
+		{
+			match = i;
+		}
+	}
+
+	return match;
+}
+
+/**
+ * Parses out a route table struct from the provided table file path.
+ * Returns the table, or NULL if the path isn't a regular file or can't be
+ * read in full.
+ */
+RouterTable* build_router_table(char* table_path)
+{
+	RouterTable* table;
+	FILE* table_file;
+	struct stat info;
+	int failed;
+
+	// a directory or a FIFO would never give a whole table, or never return
+	if (stat(table_path, &info) != 0 || !S_ISREG(info.st_mode))
+	{
+		return NULL;
+	}
+
+	table_file = fopen(table_path, "r");
+	if (table_file == NULL)
+	{
+		return NULL;
+	}
+
+	// parse line by line through the file
+	table = RouterTable_new();
+	while (!feof(table_file) && !ferror(table_file))
+	{
+		char address[ADDRESS_LENGTH];
+		int prefix_length;
+		char next_hop[NEXT_HOPS_LENGTH];
+
+		if (fscanf(table_file, "%45s %d %255s", address, &prefix_length, next_hop) != 3)
+		{
+			continue;
+		}
+		add_new_router(table, address, prefix_length, next_hop);
+	}
+
+	failed = ferror(table_file);
+	fclose(table_file);
+	if (failed)
+	{
+		RouterTable_free(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+/**
+ * Allocates and initializes a new RouteTable.
+ */
+RouterTable* RouterTable_new()
+{
+	RouterTable* table = malloc(sizeof(RouterTable));
+	table->size = 0;
+	table->max_size = 20;
+	table->generation = 0;
+	table->routes = malloc(table->max_size * sizeof(Router*));
+	table->next_hop_count = 0;
+	table->next_hop_max = 8;
+	table->next_hops = malloc(table->next_hop_max * sizeof(char*));
+	intern_next_hop(table, "0");
+	return table;
+}
+
+/**
+ * Frees a table along with every route and interned next hop in it.
+ */
+void RouterTable_free(RouterTable* table)
+{
+	for(int i = 0; i < table->size; i++)
+	{
+		free(table->routes[i]->address);
+		free(table->routes[i]->next_hop);
+		free(table->routes[i]->next_hop_ids);
+		free(table->routes[i]->next_hop_keys);
+		free(table->routes[i]);
+	}
+	for(int i = 0; i < table->next_hop_count; i++)
+	{
+		free(table->next_hops[i]);
+	}
+	free(table->routes);
+	free(table->next_hops);
+	free(table);
+}
+
+/**
+ * Handles parsing, and preparing an incoming packet for:
+ * <packet ID>, <source IP>, <destination IP>, <TTL>, <payload>
+ *
+ * If the packet can't be properly parsed or the TTL is too low, discards
+ * packet and returns NULL.
+ */
+int build_packet(Packet* packet, char* raw_packet)
+{
+	int id, TTL;
+	char src[ADDRESS_LENGTH], dest[ADDRESS_LENGTH];
+	char* payload = "";
+
+	// super ghetto parser, csv lists suck in c
+	char selector[] = ", ";
+	char* token = strtok(raw_packet, selector);
+	int counter = 0;
+	while (token && counter < 5)
+	{
+		// nasty switch statement is probably easier to grok than a bunch of
+		// ifs marhshalling data into vars
+		switch (counter)
+		{
+			case 0:
+				id = atoi(token);
+				break;
+			case 1:
+				snprintf(src, sizeof(src), "%s", token);
+				break;
+			case 2:
+				snprintf(dest, sizeof(dest), "%s", token);
+				break;
+			case 3:
+				TTL = atoi(token);
+				break;
+			case 4:
+				// handle a custom payload length
+				payload = malloc(strlen(token) + 1);
+				strcpy(payload, token);
+				break;
+		}
+
+		counter++;
+		token = strtok(NULL, selector);
+	}
+
+	// If we didn't parse the five expected packet segments
+	if (counter < 4)
+	{
+		fprintf(stderr, "Malformed packet provided for %s", raw_packet);
+		return -1;
+	}
+
+	int result = 0;
+	*packet = Packet_new(id, src, dest, TTL, payload);
+	if (packet->TTL <= 0)
+	{
+		free(packet->src);
+		free(packet->dest);
+		free(packet->payload);
+		result = -1;
+	}
+
+	if (counter == 5)
+	{
+		free(payload);
+	}
+
+	return result;
+
+}
+
+/**
+ * Constructor for creating a new packet. Will automatically decrement TTL.
+ */
+Packet Packet_new(int id, char* src, char* dest, int TTL, char* payload)
+{
+	Packet packet;
+
+	// allocate and initialize values
+	packet.id = id;
+	packet.src = malloc(strlen(src) + 1);
+	strcpy(packet.src, src);
+	packet.dest = malloc(strlen(dest) + 1);
+	strcpy(packet.dest, dest);
+
+	// automatically decrement TTL right off the bat
+	packet.TTL = TTL - 1;
+	packet.payload = malloc(strlen(payload) + 1);
+
+	strcpy(packet.payload, payload);
+	return packet;
+}
+
+/**
+ * Marshal route segments into a route struct with format:
+ *
+ * 0 - <network‐address>
+ * 1 - <net‐prefix‐length>
+ * 2 - <nexthop>[,<nexthop>...]
+ *
+ * Several next hops make an equal cost multipath route, and the first one
+ * stands for the route wherever only one is wanted.
+ */
+void add_new_router(RouterTable* table, char* address, int prefix_length, char* next_hop)
+{
+	// marshal data into Route
+	Router* new_route = malloc(sizeof(Router));
+	new_route->address = malloc(strlen(address) + 1);
+	strcpy(new_route->address, address);
+	new_route->prefix_length = prefix_length;
+	new_route->next_hop = malloc(strlen(next_hop) + 1);
+	strcpy(new_route->next_hop, next_hop);
+	add_next_hops(table, new_route, next_hop);
+	new_route->next_hop_id = new_route->next_hop_ids[0];
+
+	// precompute the subnet so lookups never have to parse strings
+	if (is_ipv6_string(address))
+	{
+		new_route->version = 6;
+
+		// a network of 1 under an empty mask never matches an IPv4 address
+		new_route->mask = 0;
+		new_route->network = 1;
+		if (parse_ipv6_string(address, new_route->network6) != 0 || prefix_length < 0 || prefix_length > 128)
+		{
+			fprintf(stderr, "Invalid IPv6 route: %s/%d\n", address, prefix_length);
+			prefix_length = -1;
+			new_route->prefix_length = -1;
+		}
+
+		for (int i = 0; i < 16; i++)
+		{
+			int bits = prefix_length - i * 8;
+			new_route->network6[i] &= bits >= 8 ? 0xff : bits <= 0 ? 0 : (0xff << (8 - bits)) & 0xff;
+		}
+	}
+	else
+	{
+		new_route->version = 4;
+		memset(new_route->network6, 0, sizeof(new_route->network6));
+		if (prefix_length < 0 || prefix_length > 32)
+		{
+			// the same never matching network an IPv6 route gets
+			fprintf(stderr, "Invalid IPv4 route: %s/%d\n", address, prefix_length);
+			new_route->prefix_length = -1;
+			new_route->mask = 0;
+			new_route->network = 1;
+		}
+		else
+		{
+			new_route->mask = prefix_mask(prefix_length);
+			new_route->network = parse_ipv4_string(address) & new_route->mask;
+		}
+	}
+
+	// Grow our RouteTable array if at max length
+	if (table->size == table->max_size)
+	{
+		table->max_size *= 2;
+		table->routes = realloc(table->routes, table->max_size * sizeof(Router*));
+	}
+
+	// add route to the array
+	table->routes[table->size] = new_route;
+	table->size = table->size + 1;
+
+	// anything cached against the old table is now suspect
+	table->generation++;
+}
+
+/**
+ * Interns every next hop in a comma separated list, skipping empty names
+ * and repeats, and keys each one for rendezvous hashing by its name, so a
+ * next hop scores flows the same way whatever id a reload gives it.
+ */
+static void add_next_hops(RouterTable* table, Router* route, const char* next_hops)
+{
+	char list[NEXT_HOPS_LENGTH];
+	char* saved;
+	int paths = 1;
+
+	for (const char* c = next_hops; *c != 0; c++)
+	{
+		paths += *c == ',';
+	}
+	route->next_hop_ids = malloc(paths * sizeof(int));
+	route->next_hop_keys = malloc(paths * sizeof(uint64_t));
+	route->path_count = 0;
+
+	snprintf(list, sizeof(list), "%s", next_hops);
+	for (char* name = strtok_r(list, ",", &saved); name != NULL; name = strtok_r(NULL, ",", &saved))
+	{
+		int id = intern_next_hop(table, name);
+		int repeat = 0;
+
+		for (int i = 0; i < route->path_count; i++)
+		{
+			repeat |= route->next_hop_ids[i] == id;
+		}
+		if (!repeat)
+		{
+			route->next_hop_ids[route->path_count] = id;
+			route->next_hop_keys[route->path_count] = flow_hash(name, "");
+			route->path_count++;
+		}
+	}
+
+	// a list of nothing but commas still needs somewhere to go
+	if (route->path_count == 0)
+	{
+		route->next_hop_ids[0] = intern_next_hop(table, next_hops);
+		route->next_hop_keys[0] = flow_hash(next_hops, "");
+		route->path_count = 1;
+	}
+}
+
+/**
+ * Hashes a flow's source and destination addresses with FNV-1a, so every
+ * packet between the same two addresses takes the same path.
+ */
+uint64_t flow_hash(const char* source, const char* destination)
+{
+	uint64_t hash = 14695981039346656037ull;
+
+	for (const char* c = source; *c != 0; c++)
+	{
+		hash = (hash ^ (uint8_t) *c) * 1099511628211ull;
+	}
+
+	// keep "1.2.3.4" to "5.6.7.8" apart from "1.2.3.45" to ".6.7.8"
+	hash = (hash ^ ',') * 1099511628211ull;
+	for (const char* c = destination; *c != 0; c++)
+	{
+		hash = (hash ^ (uint8_t) *c) * 1099511628211ull;
+	}
+
+	return hash;
+}
+
+/**
+ * Picks one of a route's next hops for a flow by rendezvous hashing. Every
+ * next hop scores the flow and the highest score wins, so each gets an
+ * even share of flows. Adding a next hop only takes over the flows it now
+ * wins, about 1 in n, and removing one only moves the flows it had.
+ *
+ * Returns the id of the chosen next hop.
+ */
+int select_next_hop(const Router* router, uint64_t flow)
+{
+	uint64_t best_score = 0;
+	int best = 0;
+
+	for (int i = 0; i < router->path_count; i++)
+	{
+		// the murmur3 finalizer, so nearby keys still score independently
+		uint64_t score = flow ^ router->next_hop_keys[i];
+		score = (score ^ (score >> 33)) * 0xff51afd7ed558ccdull;
+		score = (score ^ (score >> 33)) * 0xc4ceb9fe1a85ec53ull;
+		score ^= score >> 33;
+
+		if (i == 0 || score > best_score)
+		{
+			best_score = score;
+			best = i;
+		}
+	}
+
+	return router->next_hop_ids[best];
+}
+
+/**
+ * Gives each distinct next hop name a small id, in order of first use, so
+ * packets can be counted per next hop without comparing strings.
+ *
+ * Returns the id of next_hop, adding it if it's new.
+ */
+int intern_next_hop(RouterTable* table, const char* next_hop)
+{
+	int id = find_next_hop(table, next_hop);
+
+	if (id != -1)
+	{
+		return id;
+	}
+
+	if (table->next_hop_count == table->next_hop_max)
+	{
+		table->next_hop_max *= 2;
+		table->next_hops = realloc(table->next_hops, table->next_hop_max * sizeof(char*));
+	}
+
+	table->next_hops[table->next_hop_count] = malloc(strlen(next_hop) + 1);
+	strcpy(table->next_hops[table->next_hop_count], next_hop);
+	return table->next_hop_count++;
+}
+
+/**
+ * Returns the id of an interned next hop, or -1 if the table has no route
+ * through it.
+ */
+int find_next_hop(RouterTable* table, const char* next_hop)
+{
+	for (int i = 0; i < table->next_hop_count; i++)
+	{
+		if (strcmp(table->next_hops[i], next_hop) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Checks if an ip address is in the same subnet as the defined prefix.
+ *
+ * Returns 0 if same, -1 if not.
+ */
+int compare_subnet(int prefix_length, char* candidate, char* destination)
+{
+	// build our mask
+	uint32_t net_mask = prefix_mask(prefix_length);
+
+	uint32_t destination_ip = parse_ipv4_string(destination);
+
+	// gets the candidates subnet using the candidate with the mask
+	uint32_t candidate_ip = parse_ipv4_string(candidate);
+	uint32_t subnet = candidate_ip & net_mask;
+
+	uint32_t masked_destination = destination_ip & net_mask;
+	if (masked_destination == subnet)
+	{
+		return 0;
+	}
+	
+	return -1;
+}
+
+/**
+ * Builds the netmask for a prefix length, a /0 matches everything.
+ */
+uint32_t prefix_mask(int prefix_length)
+{
+	if (prefix_length <= 0)
+	{
+		return 0;
+	}
+
+	// shift right to unset lower bits, then shift back to get correct value
+	uint32_t shift_amnt = 32 - prefix_length;
+	return (UINT_MAX >> shift_amnt) << shift_amnt;
+}
+
+/**
+ * Adopted from:
+ * http://stackoverflow.com/questions/10283703/conversion-of-ip-address-to-integer
+ *
+ * Which is a helper to convert IPv4 strings into unsigned ints for mask
+ * comparison.
+ */
+uint32_t parse_ipv4_string(char* ipAddress)
+{
+	uint32_t ipbytes[4];
+	sscanf(ipAddress, "%u.%u.%u.%u", &ipbytes[3], &ipbytes[2], &ipbytes[1], &ipbytes[0]);
+	return ipbytes[0] | ipbytes[1] << 8 | ipbytes[2] << 16 | ipbytes[3] << 24;
+}
+
+/**
+ * Parses a textual IPv6 address into its 16 network order bytes.
+ *
+ * Returns 0 on success, -1 if it isn't a valid address.
+ */
+int parse_ipv6_string(const char* address, uint8_t* out)
+{
+	return inet_pton(AF_INET6, address, out) == 1 ? 0 : -1;
+}
+
+/**
+ * Only IPv6 addresses have colons, which is all we need to tell them apart.
+ */
+int is_ipv6_string(const char* address)
+{
+	return strchr(address, ':') != NULL;
+}
+
+/**
+ * Parses an IPv4 or IPv6 prefix, "<address>/<length>", into the network's
+ * bytes in network order, its version and its length. Without a length
+ * the address has to match exactly.
+ *
+ * Returns 0 on success, -1 if it isn't a valid prefix.
+ */
+int parse_prefix(const char* text, uint8_t* network, int* version, int* prefix_length)
+{
+	char address[64];
+	const char* slash = strchr(text, '/');
+	size_t length = slash != NULL ? (size_t) (slash - text) : strlen(text);
+	char* end;
+
+	if (length >= sizeof(address))
+	{
+		return -1;
+	}
+	memcpy(address, text, length);
+	address[length] = 0;
+
+	if (inet_pton(AF_INET, address, network) == 1)
+	{
+		*version = 4;
+	}
+	else if (inet_pton(AF_INET6, address, network) == 1)
+	{
+		*version = 6;
+	}
+	else
+	{
+		return -1;
+	}
+
+	*prefix_length = *version == 4 ? 32 : 128;
+	if (slash != NULL)
+	{
+		long parsed = strtol(slash + 1, &end, 10);
+
+		if (*end != 0 || end == slash + 1 || parsed < 0 || parsed > *prefix_length)
+		{
+			return -1;
+		}
+		*prefix_length = parsed;
+	}
+
+	return 0;
+}
+
+/**
+ * Returns whether the first prefix_length bits of address, in network
+ * order, are the network's.
+ */
+int prefix_matches(const uint8_t* network, int prefix_length, const uint8_t* address)
+{
+	int bytes = prefix_length / 8;
+	int bits = prefix_length % 8;
+
+	if (memcmp(network, address, bytes) != 0)
+	{
+		return 0;
+	}
+
+	return bits == 0 || ((network[bytes] ^ address[bytes]) >> (8 - bits)) == 0;
+}
@@ -0,0 +1,297 @@
+/**
+ * Longest prefix matching for tables of any size and either address family.
+ *
+ * Keys are network byte order addresses, one byte per trie level. Building
+ * expands every prefix into the slots it covers at its deepest level and
+ * pushes the best route seen so far into the levels below, so a lookup just
+ * follows children until it lands on a leaf and never backtracks.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "route_trie.h"
+
+/* The prefixes being loaded, indexed by position in the caller's arrays */
+typedef struct {
+	const uint8_t* networks;
+	const int* prefix_lengths;
+	const int* routes;
+	int key_bytes;
+} TrieInput;
+
+static void build_node(
+	RouteTrie* trie,
+	const TrieInput* input,
+	const int* subset,
+	int count,
+	int depth,
+	int32_t inherited,
+	uint32_t index
+);
+static uint32_t reserve_nodes(RouteTrie* trie, int count);
+static void append_leaf(RouteTrie* trie, int32_t route);
+static int rank(const uint64_t* bits, const uint8_t* before, unsigned int slot);
+
+RouteTrie* RouteTrie_new(int key_bytes)
+{
+	RouteTrie* trie = malloc(sizeof(RouteTrie));
+
+	trie->nodes = NULL;
+	trie->node_count = 0;
+	trie->node_capacity = 0;
+	trie->leaves = NULL;
+	trie->leaf_count = 0;
+	trie->leaf_capacity = 0;
+	trie->key_bytes = key_bytes;
+	trie->generation = 0;
+
+	// an empty trie still answers lookups, with no match
+	route_trie_load(trie, 0, NULL, NULL, NULL);
+	return trie;
+}
+
+void RouteTrie_free(RouteTrie* trie)
+{
+	free(trie->nodes);
+	free(trie->leaves);
+	free(trie);
+}
+
+/**
+ * Replaces the contents of the trie. Networks are size keys of key_bytes
+ * each, already masked to their prefix length. Prefixes should come in
+ * table order, so that a duplicate resolves to the earlier route the same
+ * way a linear scan would.
+ */
+void route_trie_load(
+	RouteTrie* trie,
+	int size,
+	const uint8_t* networks,
+	const int* prefix_lengths,
+	const int* routes
+) {
+	TrieInput input = {networks, prefix_lengths, routes, trie->key_bytes};
+	int* subset = malloc((size + 1) * sizeof(int));
+	int count = 0;
+
+	for (int i = 0; i < size; i++)
+	{
+		if (prefix_lengths[i] >= 0 && prefix_lengths[i] <= trie->key_bytes * 8)
+		{
+			subset[count++] = i;
+		}
+	}
+
+	trie->node_count = 0;
+	trie->leaf_count = 0;
+	build_node(trie, &input, subset, count, 0, -1, reserve_nodes(trie, 1));
+	free(subset);
+}
+
+/**
+ * Finds the longest prefix matching key, which has to be key_bytes long.
+ *
+ * Returns the route it was loaded with, or -1 if nothing matches.
+ */
+int route_trie_lookup(const RouteTrie* trie, const uint8_t* key)
+{
+	const RouteTrieNode* node = trie->nodes;
+
+	for (int depth = 0; ; depth++)
+	{
+		unsigned int slot = key[depth];
+
+		if ((node->children[slot >> 6] >> (slot & 63)) & 1)
+		{
+			node = &trie->nodes[node->child_base + rank(node->children, node->child_before, slot)];
+			continue;
+		}
+
+		return trie->leaves[node->leaf_base + rank(node->leaves, node->leaf_before, slot)];
+	}
+}
+
+/**
+ * Fills in the node at index for the prefixes in subset, all of which are
+ * longer than depth bytes and fall under this node. inherited is the best
+ * route from the levels above.
+ */
+static void build_node(
+	RouteTrie* trie,
+	const TrieInput* input,
+	const int* subset,
+	int count,
+	int depth,
+	int32_t inherited,
+	uint32_t index
+) {
+	int32_t values[ROUTE_TRIE_SLOTS];
+	int lengths[ROUTE_TRIE_SLOTS];
+	int starts[ROUTE_TRIE_SLOTS + 1];
+	uint64_t children[4] = {0, 0, 0, 0};
+	uint64_t leaves[4] = {0, 0, 0, 0};
+	int bits = depth * 8;
+	int child_count = 0;
+	int deeper = 0;
+	int* child_subset;
+	uint32_t child_base, leaf_base;
+	int32_t previous = 0;
+
+	for (int s = 0; s < ROUTE_TRIE_SLOTS; s++)
+	{
+		values[s] = inherited;
+		lengths[s] = -1;
+		starts[s] = 0;
+	}
+	starts[ROUTE_TRIE_SLOTS] = 0;
+
+	// expand prefixes ending at this level, counting the ones that go deeper
+	for (int i = 0; i < count; i++)
+	{
+		int prefix = subset[i];
+		int length = input->prefix_lengths[prefix];
+		unsigned int byte = input->networks[prefix * input->key_bytes + depth];
+
+		if (length <= bits + ROUTE_TRIE_STRIDE)
+		{
+			unsigned int span = 1u << (bits + ROUTE_TRIE_STRIDE - length);
+			unsigned int first = byte & ~(span - 1);
+
+			for (unsigned int s = first; s < first + span; s++)
+			{
+				// strictly longer only, so the earlier of two equal prefixes stays
+				if (length > lengths[s])
+				{
+					values[s] = input->routes[prefix];
+					lengths[s] = length;
+				}
+			}
+		}
+		else
+		{
+			starts[byte + 1]++;
+			deeper++;
+		}
+	}
+
+	for (int s = 0; s < ROUTE_TRIE_SLOTS; s++)
+	{
+		if (starts[s + 1] > 0)
+		{
+			children[s >> 6] |= 1ull << (s & 63);
+			child_count++;
+		}
+		starts[s + 1] += starts[s];
+	}
+
+	// bucket the deeper prefixes by slot, keeping their table order
+	child_subset = malloc((deeper + 1) * sizeof(int));
+	for (int i = 0; i < count; i++)
+	{
+		int prefix = subset[i];
+
+		if (input->prefix_lengths[prefix] > bits + ROUTE_TRIE_STRIDE)
+		{
+			child_subset[starts[input->networks[prefix * input->key_bytes + depth]]++] = prefix;
+		}
+	}
+
+	// a leaf is only stored where it differs from the one before, child
+	// slots just continue the current run
+	leaf_base = trie->leaf_count;
+	for (int s = 0; s < ROUTE_TRIE_SLOTS; s++)
+	{
+		int32_t value = ((children[s >> 6] >> (s & 63)) & 1) ? previous : values[s];
+
+		if (s == 0 || value != previous)
+		{
+			leaves[s >> 6] |= 1ull << (s & 63);
+			append_leaf(trie, value);
+			previous = value;
+		}
+	}
+
+	child_base = reserve_nodes(trie, child_count);
+
+	RouteTrieNode* node = &trie->nodes[index];
+	memcpy(node->children, children, sizeof(children));
+	memcpy(node->leaves, leaves, sizeof(leaves));
+	node->child_base = child_base;
+	node->leaf_base = leaf_base;
+	for (int w = 0; w < 4; w++)
+	{
+		node->child_before[w] = w == 0 ? 0 : node->child_before[w - 1] + __builtin_popcountll(children[w - 1]);
+		node->leaf_before[w] = w == 0 ? 0 : node->leaf_before[w - 1] + __builtin_popcountll(leaves[w - 1]);
+	}
+
+	// starts now holds where each slot's bucket ends
+	for (int s = 0, child = 0, begin = 0; s < ROUTE_TRIE_SLOTS; s++)
+	{
+		if ((children[s >> 6] >> (s & 63)) & 1)
+		{
+			build_node(trie, input, &child_subset[begin], starts[s] - begin, depth + 1, values[s], child_base + child);
+			child++;
+		}
+		begin = starts[s];
+	}
+
+	free(child_subset);
+}
+
+/**
+ * Appends count zeroed nodes and returns the index of the first.
+ */
+static uint32_t reserve_nodes(RouteTrie* trie, int count)
+{
+	uint32_t first = trie->node_count;
+
+	if (trie->node_count + count > trie->node_capacity)
+	{
+		while (trie->node_count + count > trie->node_capacity)
+		{
+			trie->node_capacity = trie->node_capacity == 0 ? 64 : trie->node_capacity * 2;
+		}
+
+		trie->nodes = realloc(trie->nodes, trie->node_capacity * sizeof(RouteTrieNode));
+		if (trie->nodes == NULL)
+		{
+			fprintf(stderr, "Unable to allocate route trie.\n");
+			exit(-1);
+		}
+	}
+
+	memset(&trie->nodes[first], 0, count * sizeof(RouteTrieNode));
+	trie->node_count += count;
+	return first;
+}
+
+static void append_leaf(RouteTrie* trie, int32_t route)
+{
+	if (trie->leaf_count == trie->leaf_capacity)
+	{
+		trie->leaf_capacity = trie->leaf_capacity == 0 ? 256 : trie->leaf_capacity * 2;
+		trie->leaves = realloc(trie->leaves, trie->leaf_capacity * sizeof(int32_t));
+		if (trie->leaves == NULL)
+		{
+			fprintf(stderr, "Unable to allocate route trie.\n");
+			exit(-1);
+		}
+	}
+
+	trie->leaves[trie->leaf_count++] = route;
+}
+
+/**
+ * Counts the set bits at or below slot, less one: the position of slot's
+ * entry among the ones packed for the node.
+ */
+static int rank(const uint64_t* bits, const uint8_t* before, unsigned int slot)
+{
+	uint64_t below = (2ull << (slot & 63)) - 1;
+
+	return before[slot >> 6] + __builtin_popcountll(bits[slot >> 6] & below) - 1;
+}
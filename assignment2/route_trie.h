@@ -0,0 +1,52 @@
+#ifndef ROUTE_TRIE_H_
+#define ROUTE_TRIE_H_
+
+#include <stdint.h>
+
+/* Bytes of key consumed per level, so an IPv6 lookup is at most 16 steps */
+#define ROUTE_TRIE_STRIDE 8
+#define ROUTE_TRIE_SLOTS (1 << ROUTE_TRIE_STRIDE)
+
+/*
+ * One level of the trie. Each of the 256 slots is either a child node or a
+ * leaf holding the longest matching route, with prefixes pushed down to the
+ * leaves when the trie is built. Children and runs of equal leaves are
+ * packed into shared arrays and found by counting bits, which keeps a node
+ * to a couple of cache lines however sparse it is.
+ */
+typedef struct {
+	uint64_t children[4];
+	uint64_t leaves[4];
+	uint32_t child_base;
+	uint32_t leaf_base;
+	uint8_t child_before[4];
+	uint8_t leaf_before[4];
+} RouteTrieNode;
+
+/*
+ * A read only multibit trie over keys of up to 16 bytes, rebuilt whenever
+ * the table it was loaded from changes.
+ */
+typedef struct {
+	RouteTrieNode* nodes;
+	uint32_t node_count;
+	uint32_t node_capacity;
+	int32_t* leaves;
+	uint32_t leaf_count;
+	uint32_t leaf_capacity;
+	int key_bytes;
+	unsigned int generation;
+} RouteTrie;
+
+RouteTrie* RouteTrie_new(int key_bytes);
+void RouteTrie_free(RouteTrie* trie);
+void route_trie_load(
+	RouteTrie* trie,
+	int size,
+	const uint8_t* networks,
+	const int* prefix_lengths,
+	const int* routes
+);
+int route_trie_lookup(const RouteTrie* trie, const uint8_t* key);
+
+#endif
@@ -1,9 +1,12 @@
 /**
  * A very simple packet router.
  */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -14,396 +17,1985 @@
 #include <unistd.h>
 #include <signal.h>
 #include <limits.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+
+#include "router.h"
+#include "flow_cache.h"
+#include "route_match.h"
+#include "route_trie.h"
+#include "histogram.h"
+#include "token_bucket.h"
+#include "io_ring.h"
+#include "capture.h"
+#include "count_min.h"
+#include "egress.h"
+#include "shm_ring.h"
+#include "mirror.h"
+#include "acl.h"
 
 #define MAX_BUFFER 65535
+#define ROUTER_BATCH 32
+#define ROUTER_MAX_PORTS 16
+/* Ports plus shared memory producers, each producer gets its own receiver */
+#define ROUTER_MAX_RECEIVERS 64
+/* Batches taken from one socket before the others get a turn */
+#define ROUTER_DRAIN_BATCHES 16
+/* Control connections served at once, and how long one may sit idle */
+#define ROUTER_MAX_CONTROL 8
+#define CONTROL_IDLE_NS 1000000000ull
+#define CONTROL_COMMAND_LENGTH 512
+
+/* epoll data is the kind of event in the top byte and an index below it */
+#define EVENT_RECEIVER 0
+#define EVENT_CONTROL 1
+#define EVENT_SHM_LISTEN 2
+#define EVENT_SHM_HANGUP 3
+#define EVENT_CONTROL_CLIENT 4
+#define EVENT(kind, index) ((uint32_t) (kind) << 24 | (uint32_t) (index))
 #define IP 2130706433 /* 127.0.0.1 */
 
 /* Struct Definitions */
 typedef struct {
-    char* address;
-    int prefix_length;
-    char* next_hop;
-} Router;
+    int expired;
+    int unroutable;
+    int received;
+} Stats;
 
+/* Packets and bytes sent one way, kept per route and per next hop */
 typedef struct {
-    Router** routes;
-    int size;
-    int max_size;
-} RouterTable;
+    uint64_t packets;
+    uint64_t bytes;
+} Traffic;
 
+/* Everything a single receive loop owns, nothing in here is shared */
 typedef struct {
-    int id;
-    char* src;
-    char* dest;
-    int TTL;
-    char* payload;
-} Packet;
-
+    FlowCache* cache;
+    RouteMatcher* matcher;
+    RouteTrie* trie4;
+    RouteTrie* trie6;
+    Histogram latency;
+    Histogram classify_latency;
+    Histogram parse_latency;
+    Histogram filter_latency;
+    Histogram lookup_latency;
+    Histogram forward_latency;
+    Traffic* route_traffic;
+    int route_capacity;
+    Traffic* next_hop_traffic;
+    int next_hop_capacity;
+    unsigned int traffic_generation;
+    CountMin* top_destinations;
+    Egress* egress;
+    EgressQueue** egress_queues;
+    Histogram egress_wait;
+    Mirror* mirror;
+    Acl* acl;
+    int live;
+} Worker;
+
+typedef enum {
+    RECEIVE_RECVFROM,
+    RECEIVE_RECVMMSG,
+    RECEIVE_IO_URING,
+    RECEIVE_SHM
+} ReceiveBackend;
+
+/* How datagrams come off the socket, and whatever state that needs */
 typedef struct {
-    int expired;
-    int unroutable;
-    int direct;
-    int router_b;
-    int router_c;
-} Stats;
+    ReceiveBackend backend;
+    int socketfd;
+    char name[64];
+    int closed;
+    unsigned long received;
+    struct mmsghdr messages[ROUTER_BATCH];
+    struct iovec iovecs[ROUTER_BATCH];
+    char controls[ROUTER_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    IoRing ring;
+    ShmRing shm;
+} Receiver;
+
+/*
+ * A control connection, first reading its command and then writing the
+ * reply, without ever blocking the loop. fd is -1 for a free slot.
+ */
+typedef struct {
+    int fd;
+    char command[CONTROL_COMMAND_LENGTH];
+    size_t command_length;
+    char* reply;
+    size_t reply_length;
+    size_t sent;
+    uint64_t deadline;
+} ControlClient;
+
+/* Function Definitions */
+void route_batch(RouterTable* table, Worker* worker, char** streams, const uint64_t* received_at, int count);
+void resolve_routes(RouterTable* table, Worker* worker, uint32_t* destinations, int* routes, int count);
+int deliver_packet(RouterTable* table, Worker* worker, Packet* packet, int route, int next_hop, int length, int class, uint64_t now_ns);
+int filter_packet(Acl* acl, Packet* packet, int version, uint32_t destination, const uint8_t* destination6, uint64_t now_ns);
+int classify_packet(Egress* egress, Packet* packet, int version, uint32_t destination, const uint8_t* destination6, int length);
+void transmit_packet(void* context, EgressQueue* queue, EgressPacket* packet, uint64_t now_ns);
+void run_egress(Worker* worker);
+void mirror_packet(Worker* worker, int reason, int version, uint32_t destination, const uint8_t* destination6, int next_hop, const char* data, int length);
+void output_mirror(FILE* out);
+void output_acl(FILE* out);
+void output_egress(FILE* out);
+void sync_traffic(Worker* worker, RouterTable* table);
+void output_traffic(FILE* out, RouterTable* table);
+void count_top_destination(CountMin* sketch, int version, uint32_t destination, const uint8_t* destination6);
+void sync_route_matcher(RouteMatcher* matcher, RouterTable* table);
+void sync_route_trie(RouteTrie* trie, RouterTable* table, int version);
+uint64_t packet_send_time(Packet* packet);
+uint64_t realtime_ns();
+uint64_t message_timestamp(struct msghdr* message);
+void output_histogram(FILE* out, const char* name, Histogram* histogram);
+void receiver_open(Receiver* receiver, int socketfd, ReceiveBackend backend);
+int receiver_fd(Receiver* receiver);
+int drain_receiver(Receiver* receiver);
+int receive_batch(Receiver* receiver, char** streams, uint64_t* received_at);
+void receiver_release(Receiver* receiver);
+void route_capture(RouterTable* table, const char* capture_path);
+void output_statistics();
+void write_statistics(FILE* out);
+int build_socket(int port);
+int build_control_socket(const char* path);
+void accept_producer(int epollfd, int listener);
+void close_producer(int epollfd, int index);
+void accept_control(int epollfd, int controlfd);
+void read_control(int epollfd, int index);
+void write_control(int epollfd, int index);
+void close_control(int epollfd, int index);
+uint64_t expire_control(int epollfd, uint64_t now_ns);
+void run_command(ControlClient* client);
+int reload_table(const char* table_path);
+int set_server_address(RouterTable* table);
+void signal_handler(int signal);
+
+/* Global Stats Struct */
+Stats stats;
+static volatile sig_atomic_t keep_running = 1;
+FILE* stats_file;
+Worker worker;
+Receiver* receivers;
+int receiver_count;
+RouterTable* routing_table;
+char* routing_table_path;
+char* table_reload_path;
+char* control_socket_path;
+ControlClient control_clients[ROUTER_MAX_CONTROL];
+int table_reloads;
+char* shm_paths[ROUTER_MAX_PORTS];
+int shm_listeners[ROUTER_MAX_PORTS];
+int shm_count;
+int stats_counter;
+
+static const char* backend_names[] = {"recvfrom", "recvmmsg", "io_uring", "shm"};
+
+/* Receive buffers for a full batch, too large for the stack */
+static char raw_packets[ROUTER_BATCH][MAX_BUFFER];
+/* The start of each packet in a batch as it arrived, before parsing cuts it up */
+static char mirror_copies[ROUTER_BATCH][MIRROR_SNAPLEN];
+
+int main(int argc, char *argv[])
+{
+	ReceiveBackend backend = RECEIVE_RECVMMSG;
+	struct epoll_event events[ROUTER_MAX_RECEIVERS];
+	struct epoll_event event;
+	int ports[ROUTER_MAX_PORTS];
+	char* capture_path = NULL;
+	char* mirror_path = NULL;
+	char* acl_path = NULL;
+	int top_size = 0;
+	int port_count = 0;
+	int epollfd, controlfd, ready, option;
+
+	// queue options are applied as they're parsed, before any queue exists
+	worker.egress = Egress_new(EGRESS_DEFAULT_DEPTH);
+	while ((option = getopt(argc, argv, "A:B:C:F:M:N:P:Q:R:S:m:")) != -1)
+	{
+		if (option == 'Q' && atoi(optarg) > 0)
+		{
+			worker.egress->depth = atoi(optarg);
+		}
+		else if (option == 'P' && egress_add_rule(worker.egress, optarg) == 0)
+		{
+			continue;
+		}
+		else if (option == 'R' && egress_add_shape(worker.egress, optarg) == 0)
+		{
+			continue;
+		}
+		else if (option == 'S' && egress_set_scheduler(worker.egress, optarg) == 0)
+		{
+			continue;
+		}
+		else if (option == 'M' || option == 'm')
+		{
+			// the mirror's ring is a few megabytes, only pay for it if asked
+			if (worker.mirror == NULL)
+			{
+				worker.mirror = Mirror_new(MIRROR_DEFAULT_SLOTS);
+			}
+			if (option == 'M')
+			{
+				mirror_path = optarg;
+			}
+			else if (mirror_add_filter(worker.mirror, optarg) != 0)
+			{
+				argc = 0;
+				break;
+			}
+		}
+		else if (option == 'A')
+		{
+			acl_path = optarg;
+		}
+		else if (option == 'C')
+		{
+			control_socket_path = optarg;
+		}
+		else if (option == 'F')
+		{
+			capture_path = optarg;
+		}
+		else if (option == 'N')
+		{
+			top_size = atoi(optarg);
+		}
+		else if (option == 'B' && strcmp(optarg, "recvfrom") == 0)
+		{
+			backend = RECEIVE_RECVFROM;
+		}
+		else if (option == 'B' && strcmp(optarg, "recvmmsg") == 0)
+		{
+			backend = RECEIVE_RECVMMSG;
+		}
+		else if (option == 'B' && strcmp(optarg, "io_uring") == 0)
+		{
+			backend = RECEIVE_IO_URING;
+		}
+		else
+		{
+			argc = 0;
+			break;
+		}
+	}
+
+	// an offline run reads from a file instead of listening on a port
+	if (argc - optind != (capture_path == NULL ? 3 : 2) || (worker.mirror != NULL && mirror_path == NULL))
+	{
+		printf("Bad Args, should be [-A <acl path>] [-B recvfrom|recvmmsg|io_uring] [-C <control socket path>] [-N <top destinations>] [<queue options>] [<mirror options>] <listening-port or shm:<socket path>>[,...] <routing-table-path> <statistics-file-path>\n"
+			"or -F <pcap, trace or packet lines file> [-A <acl path>] [-N <top destinations>] [<queue options>] [<mirror options>] <routing-table-path> <statistics-file-path>\n"
+			"queue options: [-Q <depth per class>] [-S strict|weighted[:<w0>,<w1>,...]] [-P <class>:src=|dest=<prefix>|ttl|len=|<=|>=<n>]... [-R <next hop or *>:<packets/sec>[:<burst>]]...\n"
+			"mirror options: -M <pcap path> [-m dest=<prefix>|hop=<next hop>|drop[=expired|unroutable|queue|filtered]]...\n"
+			"acl rules, one per line: permit|deny|limit <packets/sec>[:<burst>] [src <prefix>] [dest <prefix>] [ttl <n>[-<m>]]\n");
+		exit(-1);
+	}
+
+	// each comma separated port is its own ingress interface, shm:<path>
+	// takes producers over shared memory instead of UDP
+	if (capture_path == NULL)
+	{
+		for (char* port = strtok(argv[optind++], ","); port != NULL; port = strtok(NULL, ","))
+		{
+			if (port_count + shm_count == ROUTER_MAX_PORTS)
+			{
+				fprintf(stderr, "At most %d ports can be listened on.\n", ROUTER_MAX_PORTS);
+				exit(-1);
+			}
+
+			if (strncmp(port, "shm:", 4) == 0)
+			{
+				shm_paths[shm_count++] = &port[4];
+			}
+			else
+			{
+				ports[port_count++] = atoi(port);
+			}
+		}
+	}
+	routing_table_path = argv[optind];
+	char* stats_file_path = argv[optind + 1];
+
+	// parse out routes into Route array pointer from RT_A.txt
+	RouterTable* table = build_router_table(routing_table_path);
+	if (table == NULL)
+	{
+		fprintf(stderr, "Can't read invalid table file path %s\n", routing_table_path);
+		exit(-1);
+	}
+	routing_table = table;
+
+	// initialize the statistics struct
+	stats = (Stats) {0, 0, 0};
+
+	// destination -> route cache, sized to stay resident in L1/L2
+	worker.cache = FlowCache_new(FLOW_CACHE_DEFAULT_SETS);
+	worker.matcher = RouteMatcher_new();
+	worker.trie4 = RouteTrie_new(4);
+	worker.trie6 = RouteTrie_new(16);
+	worker.route_traffic = NULL;
+	worker.route_capacity = 0;
+	worker.next_hop_traffic = NULL;
+	worker.next_hop_capacity = 0;
+	worker.traffic_generation = 0;
+	worker.egress_queues = NULL;
+	worker.acl = acl_path != NULL ? Acl_new(acl_path) : NULL;
+	sync_traffic(&worker, table);
+	if (worker.mirror != NULL && mirror_start(worker.mirror, mirror_path) != 0)
+	{
+		fprintf(stderr, "Unable to open mirror file %s, errno: %d\n", mirror_path, errno);
+		exit(-1);
+	}
+
+	// heavy hitters are optional, they cost a few hashes per packet
+	worker.top_destinations = top_size > 0 ? CountMin_new(12, top_size) : NULL;
+	histogram_reset(&worker.latency);
+	histogram_reset(&worker.classify_latency);
+	histogram_reset(&worker.parse_latency);
+	histogram_reset(&worker.filter_latency);
+	histogram_reset(&worker.lookup_latency);
+	histogram_reset(&worker.forward_latency);
+	histogram_reset(&worker.egress_wait);
+
+	stats_file = fopen(stats_file_path, "w");
+	if (stats_file == NULL)
+	{
+		fprintf(stderr, "Error opening stats file.\n");
+		exit(-1);
+	}
+
+	if (capture_path != NULL)
+	{
+		route_capture(table, capture_path);
+		fclose(stats_file);
+		if (worker.mirror != NULL)
+		{
+			Mirror_free(worker.mirror);
+		}
+		return 0;
+	}
+	worker.live = 1;
+
+    signal(SIGINT, signal_handler);
+
+	// every ingress socket and the control socket report into one epoll set
+	epollfd = epoll_create1(0);
+	if (epollfd == -1)
+	{
+		fprintf(stderr, "Unable to create epoll instance, errno: %d\n", errno);
+		exit(errno);
+	}
+
+	receivers = calloc(ROUTER_MAX_RECEIVERS, sizeof(Receiver));
+	receiver_count = port_count;
+	for (int i = 0; i < port_count; i++)
+	{
+		int socketfd = build_socket(ports[i]);
+
+		fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+		receiver_open(&receivers[i], socketfd, backend);
+		snprintf(receivers[i].name, sizeof(receivers[i].name), "%d", ports[i]);
+
+		event.events = EPOLLIN;
+		event.data.u32 = EVENT(EVENT_RECEIVER, i);
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, receiver_fd(&receivers[i]), &event);
+	}
+
+	// shared memory producers get a receiver each as they connect
+	for (int i = 0; i < shm_count; i++)
+	{
+		shm_listeners[i] = shm_ring_listen(shm_paths[i]);
+		if (shm_listeners[i] == -1)
+		{
+			fprintf(stderr, "Error listening for shared memory producers on %s, errno: %d\n", shm_paths[i], errno);
+			exit(errno);
+		}
+
+		event.events = EPOLLIN;
+		event.data.u32 = EVENT(EVENT_SHM_LISTEN, i);
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, shm_listeners[i], &event);
+	}
+
+	controlfd = -1;
+	if (control_socket_path != NULL)
+	{
+		controlfd = build_control_socket(control_socket_path);
+		for (int i = 0; i < ROUTER_MAX_CONTROL; i++)
+		{
+			control_clients[i].fd = -1;
+		}
+		event.events = EPOLLIN;
+		event.data.u32 = EVENT(EVENT_CONTROL, 0);
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, controlfd, &event);
+	}
+
+	// listen infinitely for incoming packets
+	stats_counter = 0;
+	while (keep_running)
+	{
+		// wake up in time for the next shaped packet or idle control
+		// connection, or never if there's neither
+		uint64_t now = monotonic_ns();
+		uint64_t wait = egress_wait_ns(worker.egress, now);
+		uint64_t idle = expire_control(epollfd, now);
+		int timeout = -1;
+
+		if (idle < wait)
+		{
+			wait = idle;
+		}
+
+		if (wait != UINT64_MAX)
+		{
+			// a very low rate can put the next packet further off than an int of milliseconds
+			wait = (wait + 999999) / 1000000;
+			timeout = wait > INT_MAX ? INT_MAX : (int) wait;
+		}
+
+		ready = epoll_wait(epollfd, events, ROUTER_MAX_RECEIVERS, timeout);
+		if (ready == -1 && errno != EINTR)
+		{
+			fprintf(stderr, "epoll err#: %d\n", errno);
+		}
+		run_egress(&worker);
+
+		for (int i = 0; i < ready; i++)
+		{
+			uint32_t index = events[i].data.u32 & 0xffffff;
+
+			switch (events[i].data.u32 >> 24)
+			{
+				case EVENT_RECEIVER:
+					drain_receiver(&receivers[index]);
+					break;
+				case EVENT_CONTROL:
+					accept_control(epollfd, controlfd);
+					break;
+				case EVENT_CONTROL_CLIENT:
+					if (events[i].events & EPOLLOUT)
+					{
+						write_control(epollfd, index);
+					}
+					else
+					{
+						read_control(epollfd, index);
+					}
+					break;
+				case EVENT_SHM_LISTEN:
+					accept_producer(epollfd, index);
+					break;
+				case EVENT_SHM_HANGUP:
+					close_producer(epollfd, index);
+					break;
+			}
+		}
+	}
+
+	// the writer has everything mirrored so far in the file once this returns
+	if (worker.mirror != NULL)
+	{
+		mirror_stop(worker.mirror);
+	}
+	output_statistics();
+	fseek(stats_file, 0, SEEK_END);
+	output_traffic(stats_file, routing_table);
+	fflush(stats_file);
+	printf("Terminating...");
+
+	// now tear everything back down
+	for (int i = 0; i < receiver_count; i++)
+	{
+		if (receivers[i].backend == RECEIVE_SHM)
+		{
+			if (!receivers[i].closed)
+			{
+				shm_ring_close(&receivers[i].shm);
+			}
+			continue;
+		}
+		if (receivers[i].backend == RECEIVE_IO_URING)
+		{
+			io_ring_close(&receivers[i].ring);
+		}
+		close(receivers[i].socketfd);
+	}
+	for (int i = 0; i < shm_count; i++)
+	{
+		close(shm_listeners[i]);
+		unlink(shm_paths[i]);
+	}
+	if (controlfd != -1)
+	{
+		for (int i = 0; i < ROUTER_MAX_CONTROL; i++)
+		{
+			close_control(epollfd, i);
+		}
+		close(controlfd);
+		unlink(control_socket_path);
+	}
+	close(epollfd);
+	fclose(stats_file);
+	FlowCache_free(worker.cache);
+	RouteMatcher_free(worker.matcher);
+	RouteTrie_free(worker.trie4);
+	RouteTrie_free(worker.trie6);
+	Egress_free(worker.egress);
+	free(worker.egress_queues);
+	if (worker.top_destinations != NULL)
+	{
+		CountMin_free(worker.top_destinations);
+	}
+	if (worker.mirror != NULL)
+	{
+		Mirror_free(worker.mirror);
+	}
+	if (worker.acl != NULL)
+	{
+		Acl_free(worker.acl);
+	}
+
+	RouterTable_free(routing_table);
+}
+
+/**
+ * Parses, resolves and delivers up to ROUTER_BATCH raw packets. Lookups are
+ * done for the whole batch at once so cache misses can share one pass of the
+ * vectorized matcher.
+ */
+void route_batch(RouterTable* table, Worker* worker, char** streams, const uint64_t* received_at, int count)
+{
+	Packet packets[ROUTER_BATCH];
+	int parsed[ROUTER_BATCH];
+	int routes[ROUTER_BATCH];
+	int versions[ROUTER_BATCH];
+	int lengths[ROUTER_BATCH];
+	uint32_t destinations[ROUTER_BATCH];
+	uint8_t destinations6[ROUTER_BATCH][16];
+	uint32_t miss_destinations[ROUTER_BATCH];
+	int miss_routes[ROUTER_BATCH];
+	int miss_slots[ROUTER_BATCH];
+	uint64_t sent_at[ROUTER_BATCH];
+	uint64_t started, parsed_at, filtered_at, looked_up, forwarded, classified;
+	int misses = 0;
+	int valid = 0;
+
+	started = monotonic_ns();
+	flow_cache_sync(worker->cache, table->generation);
+	sync_traffic(worker, table);
+	stats.received = stats.received + count;
+
+	// parse stage
+	for (int i = 0; i < count; i++)
+	{
+		lengths[i] = strlen(streams[i]);
+		if (worker->mirror != NULL)
+		{
+			memcpy(mirror_copies[i], streams[i], lengths[i] < MIRROR_SNAPLEN ? lengths[i] : MIRROR_SNAPLEN);
+		}
+		parsed[i] = build_packet(&packets[i], streams[i]) == 0;
+		sent_at[i] = 0;
+		if (!parsed[i])
+		{
+			stats.expired = stats.expired + 1;
+			if (worker->mirror != NULL)
+			{
+				mirror_packet(worker, MIRROR_EXPIRED, 0, 0, NULL, -1, mirror_copies[i], lengths[i]);
+			}
+			continue;
+		}
+
+		sent_at[i] = packet_send_time(&packets[i]);
+		versions[i] = 4;
+		if (is_ipv6_string(packets[i].dest))
+		{
+			// a malformed IPv6 address can't match anything
+			versions[i] = parse_ipv6_string(packets[i].dest, destinations6[i]) == 0 ? 6 : 0;
+		}
+		else
+		{
+			destinations[i] = parse_ipv4_string(packets[i].dest);
+		}
+		valid++;
+	}
+	parsed_at = monotonic_ns();
+
+	// filter stage, what the ACL drops never reaches the lookup
+	filtered_at = parsed_at;
+	if (worker->acl != NULL)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (parsed[i] && !filter_packet(worker->acl, &packets[i], versions[i], destinations[i], destinations6[i], parsed_at))
+			{
+				if (worker->mirror != NULL)
+				{
+					mirror_packet(worker, MIRROR_FILTERED, versions[i], destinations[i], destinations6[i], -1, mirror_copies[i], lengths[i]);
+				}
+				free(packets[i].src);
+				free(packets[i].dest);
+				free(packets[i].payload);
+				parsed[i] = 0;
+				sent_at[i] = 0;
+				valid--;
+			}
+		}
+		filtered_at = monotonic_ns();
+	}
+
+	// lookup stage, only fall back to the full table search on a cache miss.
+	// IPv6 goes straight to its trie, the flow cache is keyed on IPv4
+	sync_route_trie(worker->trie6, table, 6);
+	for (int i = 0; i < count; i++)
+	{
+		if (!parsed[i])
+		{
+			continue;
+		}
+
+		if (versions[i] != 4)
+		{
+			routes[i] = versions[i] == 6 ? route_trie_lookup(worker->trie6, destinations6[i]) : -1;
+		}
+		else if (flow_cache_lookup(worker->cache, destinations[i], &routes[i]) != 0)
+		{
+			miss_destinations[misses] = destinations[i];
+			miss_slots[misses] = i;
+			misses++;
+		}
+	}
+
+	if (misses > 0)
+	{
+		resolve_routes(table, worker, miss_destinations, miss_routes, misses);
+		for (int m = 0; m < misses; m++)
+		{
+			routes[miss_slots[m]] = miss_routes[m];
+			flow_cache_insert(worker->cache, miss_destinations[m], miss_routes[m]);
+		}
+	}
+	looked_up = monotonic_ns();
+	classified = received_at != NULL ? realtime_ns() : 0;
+
+	// forward stage
+	for (int i = 0; i < count; i++)
+	{
+		if (parsed[i])
+		{
+			int class = EGRESS_CLASSES - 1;
+			int next_hop = -1;
+			int reason;
+
+			if (worker->top_destinations != NULL)
+			{
+				count_top_destination(worker->top_destinations, versions[i], destinations[i], destinations6[i]);
+			}
+			if (worker->egress->rule_count > 0)
+			{
+				class = classify_packet(worker->egress, &packets[i], versions[i], destinations[i], destinations6[i], lengths[i]);
+			}
+			// only multipath routes pay for hashing the flow
+			if (routes[i] != -1)
+			{
+				Router* route = table->routes[routes[i]];
+
+				next_hop = route->path_count > 1 ? select_next_hop(route, flow_hash(packets[i].src, packets[i].dest)) : route->next_hop_id;
+			}
+
+			reason = deliver_packet(table, worker, &packets[i], routes[i], next_hop, lengths[i], class, looked_up);
+			if (worker->mirror != NULL)
+			{
+				mirror_packet(worker, reason, versions[i], destinations[i], destinations6[i], next_hop, mirror_copies[i], lengths[i]);
+			}
+		}
+	}
+	forwarded = monotonic_ns();
+
+	// stages are timed per batch and charged evenly to its packets
+	histogram_record_n(&worker->parse_latency, (parsed_at - started) / count, count);
+	if (worker->acl != NULL)
+	{
+		histogram_record_n(&worker->filter_latency, (filtered_at - parsed_at) / count, count);
+	}
+	if (valid > 0)
+	{
+		histogram_record_n(&worker->lookup_latency, (looked_up - filtered_at) / valid, valid);
+		histogram_record_n(&worker->forward_latency, (forwarded - looked_up) / valid, valid);
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		// kernel receive timestamps are CLOCK_REALTIME
+		if (received_at != NULL && received_at[i] != 0 && received_at[i] <= classified)
+		{
+			histogram_record(&worker->classify_latency, classified - received_at[i]);
+		}
+
+		if (worker->live && sent_at[i] != 0 && sent_at[i] <= forwarded)
+		{
+			histogram_record(&worker->latency, forwarded - sent_at[i]);
+		}
+	}
+
+	run_egress(worker);
+}
+
+/**
+ * pktgen -L replaces the payload with "t=<CLOCK_MONOTONIC ns>" as the
+ * packet is sent, which makes its end to end latency measurable here.
+ *
+ * Returns the send time, or 0 if the packet wasn't stamped.
+ */
+uint64_t packet_send_time(Packet* packet)
+{
+	if (packet->payload[0] != 't' || packet->payload[1] != '=')
+	{
+		return 0;
+	}
+
+	return strtoull(&packet->payload[2], NULL, 10);
+}
 
+/**
+ * Looks up a batch of IPv4 destinations, using the vectorized matcher when
+ * the table is small enough for it and the trie otherwise.
+ */
+void resolve_routes(RouterTable* table, Worker* worker, uint32_t* destinations, int* routes, int count)
+{
+	if (table->size <= ROUTE_MATCH_MAX_ROUTES)
+	{
+		sync_route_matcher(worker->matcher, table);
+		route_matcher_lookup_batch(worker->matcher, destinations, routes, count);
+		return;
+	}
+
+	sync_route_trie(worker->trie4, table, 4);
+	for (int i = 0; i < count; i++)
+	{
+		uint8_t key[4] = {
+			destinations[i] >> 24, destinations[i] >> 16, destinations[i] >> 8, destinations[i]
+		};
+		routes[i] = route_trie_lookup(worker->trie4, key);
+	}
+}
+
+/**
+ * Reloads the matcher's prefix arrays if the table has changed under it.
+ */
+void sync_route_matcher(RouteMatcher* matcher, RouterTable* table)
+{
+	uint32_t networks[ROUTE_MATCH_MAX_ROUTES];
+	uint32_t masks[ROUTE_MATCH_MAX_ROUTES];
+	int prefix_lengths[ROUTE_MATCH_MAX_ROUTES];
+
+	if (matcher->generation == table->generation)
+	{
+		return;
+	}
+
+	for (int i = 0; i < table->size; i++)
+	{
+		networks[i] = table->routes[i]->network;
+		masks[i] = table->routes[i]->mask;
+		prefix_lengths[i] = table->routes[i]->prefix_length;
+	}
+
+	route_matcher_load(matcher, table->size, networks, masks, prefix_lengths);
+	matcher->generation = table->generation;
+}
+
+/**
+ * Rebuilds a trie from one family's routes if the table has changed since
+ * it was last loaded.
+ */
+void sync_route_trie(RouteTrie* trie, RouterTable* table, int version)
+{
+	int key_bytes = version == 6 ? 16 : 4;
+	uint8_t* networks;
+	int* prefix_lengths;
+	int* routes;
+	int size = 0;
+
+	if (trie->generation == table->generation)
+	{
+		return;
+	}
+
+	networks = malloc((table->size + 1) * key_bytes);
+	prefix_lengths = malloc((table->size + 1) * sizeof(int));
+	routes = malloc((table->size + 1) * sizeof(int));
+
+	for (int i = 0; i < table->size; i++)
+	{
+		Router* router = table->routes[i];
+		uint8_t* network = &networks[size * key_bytes];
+
+		if (router->version != version)
+		{
+			continue;
+		}
+
+		if (version == 6)
+		{
+			memcpy(network, router->network6, key_bytes);
+		}
+		else
+		{
+			network[0] = router->network >> 24;
+			network[1] = router->network >> 16;
+			network[2] = router->network >> 8;
+			network[3] = router->network;
+		}
+		prefix_lengths[size] = router->prefix_length;
+		routes[size] = i;
+		size++;
+	}
+
+	route_trie_load(trie, size, networks, prefix_lengths, routes);
+	trie->generation = table->generation;
+
+	free(networks);
+	free(prefix_lengths);
+	free(routes);
+}
+
+/**
+ * Grows the traffic counters to cover every route and next hop in the
+ * table. Existing counts are kept, only reload_table starts them over.
+ */
+void sync_traffic(Worker* worker, RouterTable* table)
+{
+	if (worker->traffic_generation == table->generation && worker->route_traffic != NULL)
+	{
+		return;
+	}
+
+	if (table->size > worker->route_capacity)
+	{
+		worker->route_traffic = realloc(worker->route_traffic, table->size * sizeof(Traffic));
+		memset(&worker->route_traffic[worker->route_capacity], 0, (table->size - worker->route_capacity) * sizeof(Traffic));
+		worker->route_capacity = table->size;
+	}
+
+	if (table->next_hop_count > worker->next_hop_capacity)
+	{
+		worker->next_hop_traffic = realloc(worker->next_hop_traffic, table->next_hop_count * sizeof(Traffic));
+		memset(&worker->next_hop_traffic[worker->next_hop_capacity], 0, (table->next_hop_count - worker->next_hop_capacity) * sizeof(Traffic));
+		worker->next_hop_capacity = table->next_hop_count;
+	}
+
+	// queues are found by name, so a next hop keeps its queue across reloads
+	worker->egress_queues = realloc(worker->egress_queues, table->next_hop_count * sizeof(EgressQueue*));
+	for (int i = 0; i < table->next_hop_count; i++)
+	{
+		worker->egress_queues[i] = egress_queue(worker->egress, table->next_hops[i]);
+	}
+
+	if (worker->mirror != NULL)
+	{
+		mirror_select_hops(worker->mirror, table->next_hops, table->next_hop_count);
+	}
+
+	worker->traffic_generation = table->generation;
+}
+
+/**
+ * Counts a packet against its destination in the heavy hitter sketch, IPv4
+ * addresses going in as their 4 network order bytes.
+ */
+void count_top_destination(CountMin* sketch, int version, uint32_t destination, const uint8_t* destination6)
+{
+	uint8_t key[16] = {0};
+
+	if (version == 6)
+	{
+		count_min_add(sketch, destination6, 6, 1);
+		return;
+	}
+
+	if (version == 4)
+	{
+		key[0] = destination >> 24;
+		key[1] = destination >> 16;
+		key[2] = destination >> 8;
+		key[3] = destination;
+		count_min_add(sketch, key, 4, 1);
+	}
+}
+
+/**
+ * Writes the counters for every route that carried traffic. This walks the
+ * whole table, so it only happens when the router finishes rather than with
+ * every statistics update.
+ */
+void output_traffic(FILE* out, RouterTable* table)
+{
+	for (int i = 0; i < table->size && i < worker.route_capacity; i++)
+	{
+		Router* router = table->routes[i];
+
+		if (worker.route_traffic[i].packets == 0)
+		{
+			continue;
+		}
+
+		fprintf(
+			out,
+			"route %s/%d via %s: %llu packets %llu bytes\n",
+			router->address,
+			router->prefix_length,
+			router->next_hop,
+			(unsigned long long) worker.route_traffic[i].packets,
+			(unsigned long long) worker.route_traffic[i].bytes
+		);
+	}
+}
+
+/**
+ * Accounts for a resolved packet, queues it for the next hop picked for its
+ * flow in the given class and releases its fields.
+ *
+ * Returns what became of it, MIRROR_FORWARDED if it was queued.
+ */
+int deliver_packet(RouterTable* table, Worker* worker, Packet* packet, int route, int next_hop, int length, int class, uint64_t now_ns)
+{
+	EgressPacket queued;
+	Router* router;
+	int reason = MIRROR_FORWARDED;
+
+	if (route == -1)
+	{
+		stats.unroutable = stats.unroutable + 1;
+		reason = MIRROR_UNROUTABLE;
+	}
+	else
+	{
+		// dense counters indexed by route and next hop id, no strings involved
+		router = table->routes[route];
+		worker->route_traffic[route].packets++;
+		worker->route_traffic[route].bytes += length;
+		worker->next_hop_traffic[next_hop].packets++;
+		worker->next_hop_traffic[next_hop].bytes += length;
+
+		// a full queue drops the packet, it never holds up the receive loop
+		queued.id = packet->id;
+		queued.length = length;
+		queued.enqueued_ns = now_ns;
+		strncpy(queued.address, router->address, sizeof(queued.address) - 1);
+		queued.address[sizeof(queued.address) - 1] = 0;
+		if (egress_enqueue(worker->egress_queues[next_hop], class, &queued) != 0)
+		{
+			reason = MIRROR_QUEUE_FULL;
+		}
+	}
+
+	// finally free the created packet
+	free(packet->src);
+	free(packet->dest);
+	free(packet->payload);
+	return reason;
+}
+
+/**
+ * Runs a packet past the ACL, its addresses widened to 16 bytes with IPv4
+ * mapped into IPv6. An address that doesn't parse is left as ::, which only
+ * rules without that field match.
+ *
+ * Returns 1 if the packet goes on to routing, 0 if it's dropped.
+ */
+int filter_packet(Acl* acl, Packet* packet, int version, uint32_t destination, const uint8_t* destination6, uint64_t now_ns)
+{
+	uint8_t source[16] = {0};
+	uint8_t key[16] = {0};
+
+	if (is_ipv6_string(packet->src))
+	{
+		parse_ipv6_string(packet->src, source);
+	}
+	else
+	{
+		uint32_t address = parse_ipv4_string(packet->src);
+
+		source[10] = source[11] = 0xff;
+		source[12] = address >> 24;
+		source[13] = address >> 16;
+		source[14] = address >> 8;
+		source[15] = address;
+	}
+
+	if (version == 6)
+	{
+		memcpy(key, destination6, sizeof(key));
+	}
+	else if (version == 4)
+	{
+		key[10] = key[11] = 0xff;
+		key[12] = destination >> 24;
+		key[13] = destination >> 16;
+		key[14] = destination >> 8;
+		key[15] = destination;
+	}
+
+	// rules see the TTL the packet arrived with, before this hop took one
+	return acl_filter(acl, source, key, packet->TTL + 1, now_ns);
+}
+
+/**
+ * Builds the addresses egress rules match on, the source only if some rule
+ * looks at it, and picks the packet's class.
+ */
+int classify_packet(Egress* egress, Packet* packet, int version, uint32_t destination, const uint8_t* destination6, int length)
+{
+	uint8_t source[16] = {0};
+	uint8_t key[16] = {0};
+	int source_version = 0;
+
+	if (egress->source_rules > 0)
+	{
+		if (is_ipv6_string(packet->src))
+		{
+			source_version = parse_ipv6_string(packet->src, source) == 0 ? 6 : 0;
+		}
+		else
+		{
+			uint32_t address = parse_ipv4_string(packet->src);
+
+			source[0] = address >> 24;
+			source[1] = address >> 16;
+			source[2] = address >> 8;
+			source[3] = address;
+			source_version = 4;
+		}
+	}
+
+	if (version == 6)
+	{
+		memcpy(key, destination6, sizeof(key));
+	}
+	else
+	{
+		key[0] = destination >> 24;
+		key[1] = destination >> 16;
+		key[2] = destination >> 8;
+		key[3] = destination;
+	}
+
+	// the same TTL the ACL saw, the one the packet arrived with
+	return egress_classify(egress, version, source_version == version ? source : NULL, key, packet->TTL + 1, length);
+}
+
+/**
+ * Sends one packet on its way out of a next hop queue. Only direct delivery
+ * has anywhere to go, the other next hops are just counted.
+ */
+void transmit_packet(void* context, EgressQueue* queue, EgressPacket* packet, uint64_t now_ns)
+{
+	Worker* worker = context;
+
+	if (now_ns >= packet->enqueued_ns)
+	{
+		histogram_record(&worker->egress_wait, now_ns - packet->enqueued_ns);
+	}
+
+	if (queue == worker->egress_queues[NEXT_HOP_DIRECT])
+	{
+		printf(
+			"Delivering direct: packet ID=%d, dest=%s\n",
+			packet->id,
+			packet->address
+		);
+	}
+}
+
+void run_egress(Worker* worker)
+{
+	egress_run(worker->egress, monotonic_ns(), transmit_packet, worker);
+}
+
+/**
+ * Hands a packet to the mirror if its filters pick it, using the copy taken
+ * before parsing. IPv4 destinations go to the filters as network order bytes.
+ */
+void mirror_packet(Worker* worker, int reason, int version, uint32_t destination, const uint8_t* destination6, int next_hop, const char* data, int length)
+{
+	uint8_t key[16] = {0};
+
+	if (version == 6)
+	{
+		memcpy(key, destination6, sizeof(key));
+	}
+	else if (version == 4)
+	{
+		key[0] = destination >> 24;
+		key[1] = destination >> 16;
+		key[2] = destination >> 8;
+		key[3] = destination;
+	}
+
+	if (mirror_wants(worker->mirror, reason, version, key, next_hop))
+	{
+		mirror_record(worker->mirror, reason, data, length, realtime_ns());
+	}
+}
+
+/**
+ * Writes the ACL totals and the counters of every rule that has matched
+ * anything, which with thousands of rules is usually a few of them.
+ */
+void output_acl(FILE* out)
+{
+	Acl* acl = worker.acl;
+
+	fprintf(
+		out,
+		"acl rules: %d\nacl permitted: %llu\nacl denied: %llu\nacl rate limited: %llu\nacl unmatched: %llu\n",
+		acl->rule_count,
+		(unsigned long long) acl->permitted,
+		(unsigned long long) acl->denied,
+		(unsigned long long) acl->limited,
+		(unsigned long long) acl->unmatched
+	);
+	for (int i = 0; i < acl->rule_count; i++)
+	{
+		if (acl->rules[i].hits > 0)
+		{
+			fprintf(
+				out,
+				"acl rule %d hits: %llu dropped: %llu (%s)\n",
+				i + 1,
+				(unsigned long long) acl->rules[i].hits,
+				(unsigned long long) acl->rules[i].dropped,
+				acl->rules[i].text
+			);
+		}
+	}
+}
+
+/**
+ * Writes how many packets were mirrored for each reason and how far the
+ * writer has got with them.
+ */
+void output_mirror(FILE* out)
+{
+	Mirror* mirror = worker.mirror;
+
+	for (int r = 0; r < MIRROR_REASONS; r++)
+	{
+		fprintf(out, "mirror %s packets: %llu\n", mirror_reason_name(r), (unsigned long long) mirror->mirrored[r]);
+	}
+	fprintf(
+		out,
+		"mirror lost: %llu\nmirror bytes written: %llu\nmirror writes: %llu\n",
+		(unsigned long long) mirror->lost,
+		(unsigned long long) __atomic_load_n(&mirror->written, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&mirror->writes, __ATOMIC_RELAXED)
+	);
+}
+
+/**
+ * Writes the counters for every next hop queue, including ones whose next
+ * hop has since been reloaded away.
+ */
+void output_egress(FILE* out)
+{
+	Egress* egress = worker.egress;
+
+	fprintf(out, "egress scheduler: %s\n", egress->scheduler == EGRESS_STRICT ? "strict" : "weighted");
+	for (int i = 0; i < egress->queue_count; i++)
+	{
+		EgressQueue* queue = egress->queues[i];
+
+		fprintf(
+			out,
+			"egress %s sent: %llu\negress %s dropped: %llu\negress %s throttled: %llu\negress %s depth: %u\negress %s peak depth: %u\n",
+			queue->name, (unsigned long long) queue->sent,
+			queue->name, (unsigned long long) egress_dropped(queue),
+			queue->name, (unsigned long long) queue->throttled,
+			queue->name, egress_depth(queue),
+			queue->name, queue->peak_depth
+		);
+	}
+}
+
+/**
+ * Updates the statistics file based upon the state of the global statistics
+ * struct.
+ */
+void output_statistics()
+{
+	write_statistics(stats_file);
+
+	// rewind pointer to the start of the file
+	rewind(stats_file);
+	printf("Router stats updated.\n");
+}
+
+/**
+ * Writes every statistic to out, the stats file or a control connection.
+ */
+void write_statistics(FILE* out)
+{
+	int router_b = find_next_hop(routing_table, "RouterB");
+	int router_c = find_next_hop(routing_table, "RouterC");
+
+	// the original summary, now read from the per next hop counters
+	fprintf(
+		out,
+		"expired packets: %d\nunroutable packets: %d\ndelivered direct: %llu\nrouter B: %llu\nrouter C: %llu\n",
+		stats.expired,
+		stats.unroutable,
+		(unsigned long long) worker.next_hop_traffic[NEXT_HOP_DIRECT].packets,
+		(unsigned long long) (router_b == -1 ? 0 : worker.next_hop_traffic[router_b].packets),
+		(unsigned long long) (router_c == -1 ? 0 : worker.next_hop_traffic[router_c].packets)
+	);
+	for (int i = 0; i < routing_table->next_hop_count; i++)
+	{
+		fprintf(
+			out,
+			"next hop %s packets: %llu\nnext hop %s bytes: %llu\n",
+			routing_table->next_hops[i], (unsigned long long) worker.next_hop_traffic[i].packets,
+			routing_table->next_hops[i], (unsigned long long) worker.next_hop_traffic[i].bytes
+		);
+	}
+
+	if (worker.top_destinations != NULL)
+	{
+		char address[ADDRESS_LENGTH];
+
+		count_min_sort(worker.top_destinations);
+		for (int i = 0; i < worker.top_destinations->top_count; i++)
+		{
+			CountMinEntry* entry = &worker.top_destinations->top[i];
+			inet_ntop(entry->version == 6 ? AF_INET6 : AF_INET, entry->address, address, sizeof(address));
+			fprintf(out, "top destination %d: %s %llu\n", i + 1, address, (unsigned long long) entry->count);
+		}
+	}
+	fprintf(
+		out,
+		"flow cache hits: %lu\nflow cache misses: %lu\nflow cache evictions: %lu\nflow cache invalidations: %lu\n",
+		worker.cache->hits, worker.cache->misses, worker.cache->evictions, worker.cache->invalidations
+	);
+	fprintf(out, "route matcher: %s\n", worker.matcher->engine);
+	fprintf(
+		out,
+		"route trie ipv4 nodes: %u\nroute trie ipv6 nodes: %u\n",
+		worker.trie4->node_count, worker.trie6->node_count
+	);
+	fprintf(out, "table reloads: %d\n", table_reloads);
+	output_egress(out);
+	if (worker.mirror != NULL)
+	{
+		output_mirror(out);
+	}
+	if (worker.acl != NULL)
+	{
+		output_acl(out);
+	}
+	for (int i = 0; i < receiver_count; i++)
+	{
+		fprintf(
+			out,
+			"port %s backend: %s\nport %s packets received: %lu\n",
+			receivers[i].name, backend_names[receivers[i].backend],
+			receivers[i].name, receivers[i].received
+		);
+		if (receivers[i].backend == RECEIVE_IO_URING)
+		{
+			fprintf(
+				out,
+				"port %s io_uring rearms: %lu\nport %s io_uring truncated: %lu\n",
+				receivers[i].name, receivers[i].ring.rearms,
+				receivers[i].name, receivers[i].ring.truncated
+			);
+		}
+		if (receivers[i].backend == RECEIVE_SHM)
+		{
+			fprintf(out, "port %s shm sleeps: %lu\n", receivers[i].name, receivers[i].shm.sleeps);
+		}
+	}
+
+	// what each packet cost, as measured by the kernel
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+	fprintf(
+		out,
+		"packets received: %d\ncpu seconds: %.6f\ncpu ns per packet: %.1f\n",
+		stats.received,
+		cpu_seconds,
+		stats.received > 0 ? cpu_seconds * 1e9 / stats.received : 0
+	);
+
+	output_histogram(out, "latency", &worker.latency);
+	output_histogram(out, "receive to classify", &worker.classify_latency);
+	output_histogram(out, "parse stage", &worker.parse_latency);
+	if (worker.acl != NULL)
+	{
+		output_histogram(out, "filter stage", &worker.filter_latency);
+	}
+	output_histogram(out, "lookup stage", &worker.lookup_latency);
+	output_histogram(out, "forward stage", &worker.forward_latency);
+	output_histogram(out, "egress wait", &worker.egress_wait);
+}
+
+/**
+ * Routes every packet in a capture file as fast as it can be read, with
+ * statistics written once at the end. The kernel isn't involved, so this
+ * measures parsing and lookup alone.
+ */
+void route_capture(RouterTable* table, const char* capture_path)
+{
+	CaptureReader* reader = capture_open(capture_path);
+	char* streams[ROUTER_BATCH];
+	const char* data;
+	size_t length;
+	uint64_t started, elapsed;
+	int count;
+
+	for (int i = 0; i < ROUTER_BATCH; i++)
+	{
+		streams[i] = raw_packets[i];
+	}
+
+	started = monotonic_ns();
+	do
+	{
+		// parsing tokenizes in place, so copy out of the read only mapping
+		for (count = 0; count < ROUTER_BATCH && capture_next(reader, &data, &length) == 0; count++)
+		{
+			if (length > MAX_BUFFER - 1)
+			{
+				length = MAX_BUFFER - 1;
+			}
+			memcpy(raw_packets[count], data, length);
+			raw_packets[count][length] = 0;
+		}
 
-/* Function Definitions */
-RouterTable* RouterTable_new();
-RouterTable* build_router_table(char* table_path);
-void add_new_router(RouterTable* table, char address[16], int prefix_length, char next_hop[8]);
-int build_packet(Packet* packet, char* raw_packet);
-Packet Packet_new(int id, char* src, char* dest, int TTL, char* payload);
-void route_packet(FILE* stats_file, RouterTable* table, char* stream);
-int find_destination_router(Router* router, RouterTable* table, Packet* packet);
-void output_statistics();
-int build_socket(int port);
-int set_server_address(RouterTable* table);
-void signal_handler(int signal);
-int compare_subnet(int prefix_length, char* candidate, char* destination);
-uint32_t parse_ipv4_string(char* ipAddress);
+		if (count > 0)
+		{
+			route_batch(table, &worker, streams, NULL, count);
+		}
+	} while (count == ROUTER_BATCH);
+	elapsed = monotonic_ns() - started;
+	if (worker.mirror != NULL)
+	{
+		mirror_stop(worker.mirror);
+	}
 
-/* Global Stats Struct */
-Stats stats;
-static int keep_running = 1;
-FILE* stats_file;
+	// statistics leave the file rewound, add to the end of them
+	output_statistics();
+	fseek(stats_file, 0, SEEK_END);
+	fprintf(
+		stats_file,
+		"capture format: %s\ncapture records skipped: %lu\ncapture seconds: %.6f\ncapture packets per second: %.0f\n",
+		capture_format_name(reader),
+		reader->skipped,
+		elapsed / 1e9,
+		elapsed > 0 ? stats.received * 1e9 / elapsed : 0
+	);
+	output_traffic(stats_file, table);
+	capture_close(reader);
+}
 
-int main(int argc, char *argv[])
+/**
+ * Gets the chosen backend ready to receive. io_uring falls back to recvmmsg
+ * when the kernel doesn't support it.
+ */
+void receiver_open(Receiver* receiver, int socketfd, ReceiveBackend backend)
 {
-	char raw_packet[MAX_BUFFER];
-	struct sockaddr_in inc_socket;
-	int socketfd, counter, port, sock_length = sizeof(inc_socket);
+	receiver->backend = backend;
+	receiver->socketfd = socketfd;
+
+	if (backend == RECEIVE_IO_URING &&
+		io_ring_open(&receiver->ring, socketfd, sizeof(receiver->controls[0])) != 0
+	) {
+		fprintf(stderr, "io_uring unavailable, errno: %d, using recvmmsg\n", errno);
+		receiver->backend = RECEIVE_RECVMMSG;
+	}
 
-	if (argc != 4)
+	// leave room for a terminator after a full sized datagram
+	memset(receiver->messages, 0, sizeof(receiver->messages));
+	for (int i = 0; i < ROUTER_BATCH; i++)
 	{
-		printf("Bad Args, should be <listening-port> <routing-table-path> <statistics-file-path>");
-		exit(-1);
+		receiver->iovecs[i].iov_base = raw_packets[i];
+		receiver->iovecs[i].iov_len = MAX_BUFFER - 1;
+		receiver->messages[i].msg_hdr.msg_iov = &receiver->iovecs[i];
+		receiver->messages[i].msg_hdr.msg_iovlen = 1;
 	}
+}
 
-	port = atoi(argv[1]);
-	char* table_file_path = argv[2];
-	char* stats_file_path = argv[3];
+/**
+ * Returns up to ROUTER_BATCH waiting datagrams as terminated strings, with
+ * their kernel receive times. Streams stay valid until receiver_release.
+ *
+ * Returns the number received, or -1 with errno set, EAGAIN once the
+ * socket is empty.
+ */
+int receive_batch(Receiver* receiver, char** streams, uint64_t* received_at)
+{
+	IoRingPacket packets[ROUTER_BATCH];
+	struct msghdr control;
+	int received;
 
-	// parse out routes into Route array pointer from RT_A.txt
-	RouterTable* table = build_router_table(table_file_path);
+	switch (receiver->backend)
+	{
+		case RECEIVE_RECVFROM:
+			received = recvfrom(receiver->socketfd, raw_packets[0], MAX_BUFFER - 1, 0, NULL, NULL);
+			if (received < 0)
+			{
+				return -1;
+			}
 
-	// initialize the statistics struct
-	stats = (Stats) {0, 0, 0, 0, 0};
+			// plain recvfrom has nowhere to put a timestamp
+			raw_packets[0][received] = 0;
+			streams[0] = raw_packets[0];
+			received_at[0] = 0;
+			return 1;
 
-	stats_file = fopen(stats_file_path, "w");
-	if (stats_file == NULL)
-	{
-		fprintf(stderr, "Error opening stats file.\n");
-		exit(-1);
-	}
+		case RECEIVE_RECVMMSG:
+			for (int i = 0; i < ROUTER_BATCH; i++)
+			{
+				receiver->messages[i].msg_hdr.msg_control = receiver->controls[i];
+				receiver->messages[i].msg_hdr.msg_controllen = sizeof(receiver->controls[i]);
+			}
 
-	socketfd = build_socket(port);
+			received = recvmmsg(receiver->socketfd, receiver->messages, ROUTER_BATCH, MSG_WAITFORONE, NULL);
+			for (int i = 0; i < received; i++)
+			{
+				raw_packets[i][receiver->messages[i].msg_len] = 0;
+				streams[i] = raw_packets[i];
+				received_at[i] = message_timestamp(&receiver->messages[i].msg_hdr);
+			}
+			return received;
 
-    signal(SIGINT, signal_handler);
+		case RECEIVE_IO_URING:
+			received = io_ring_receive(&receiver->ring, packets, ROUTER_BATCH, 0);
+			memset(&control, 0, sizeof(control));
+			for (int i = 0; i < received; i++)
+			{
+				// datagrams are parsed in place inside the provided buffers
+				packets[i].data[packets[i].length] = 0;
+				streams[i] = packets[i].data;
+				control.msg_control = packets[i].control;
+				control.msg_controllen = packets[i].control_length;
+				received_at[i] = message_timestamp(&control);
+			}
+			return received;
 
-	// listen infinitely for incoming packets
-	counter = 0;
-	while (keep_running)
-	{
-		bzero(raw_packet, MAX_BUFFER);
-
-		// Waits until we receive something
-		if (recvfrom(
-				socketfd,
-				raw_packet,
-				MAX_BUFFER,
-				0,
-				(struct sockaddr*) &inc_socket,
-				&sock_length
-			) != -1
-		) {
-			// route and increment counter
-			route_packet(stats_file, table, raw_packet);
-			counter++;
-		
-			// see if it's time to output statistcs
-			if (counter == 20)
+		case RECEIVE_SHM:
+			// datagrams are parsed in place in the shared slots, and no
+			// kernel ever saw them to stamp them
+			received = shm_ring_take(&receiver->shm, streams, ROUTER_BATCH);
+			for (int i = 0; i < received; i++)
 			{
-				counter = 0;
-				output_statistics();
+				received_at[i] = 0;
 			}
-		}
-		else
-		{
-			fprintf(stderr, "Recvfrom err#: %d\n", errno);
-		}
+			return received;
 	}
 
-	// now tear everything back down
-	close(socketfd);
-	fclose(stats_file);
+	return -1;
+}
 
-	for(int i = 0; i < table->size; i++)
+/**
+ * The descriptor that becomes readable when the receiver has packets, which
+ * for io_uring is the ring and for shared memory its data eventfd.
+ */
+int receiver_fd(Receiver* receiver)
+{
+	if (receiver->backend == RECEIVE_SHM)
 	{
-		free(table->routes[i]);
+		return receiver->shm.data_fd;
 	}
 
-	free(table);
+	return receiver->backend == RECEIVE_IO_URING ? receiver->ring.fd : receiver->socketfd;
 }
 
-void route_packet(FILE* stats_file, RouterTable* table, char* stream)
+/**
+ * Routes batches from a ready receiver until it runs dry, or until it has
+ * had its share and the other sockets should get a turn. epoll is level
+ * triggered, so anything left over is picked up on the next pass.
+ *
+ * Returns the number of packets routed.
+ */
+int drain_receiver(Receiver* receiver)
 {
-	Packet* packet = malloc(sizeof(Packet));
-	Router* router = malloc(sizeof(Router));
-	char* next_hop;
+	char* streams[ROUTER_BATCH];
+	uint64_t received_at[ROUTER_BATCH];
+	int routed = 0;
+	int received;
 
-	if (build_packet(packet, stream) != 0)
+	// a hangup earlier in the same epoll batch may already have unmapped its ring
+	if (receiver->closed)
 	{
-		stats.expired = stats.expired + 1;
-		free(packet);
-		return;
+		return 0;
 	}
 
-	if (find_destination_router(router, table, packet) == -1)
-	{
-		stats.unroutable = stats.unroutable + 1;
-	}
-	else
+	for (int batch = 0; batch < ROUTER_DRAIN_BATCHES; batch++)
 	{
-		if (strcmp(router->next_hop, "0") == 0)
-		{
-			stats.direct = stats.direct + 1;
-			printf(
-				"Delivering direct: packet ID=%d, dest=%s\n",
-				packet->id,
-				router->address
-			);
-		}
-		else
+		received = receive_batch(receiver, streams, received_at);
+		if (received <= 0)
 		{
-			// increment counters and free packet allocations
-			next_hop = router->next_hop;
-			if (strcmp(next_hop, "RouterB") == 0)
-			{
-				stats.router_b = stats.router_b + 1;
-			}
-			else if (strcmp(next_hop, "RouterC") == 0)
+			if (received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
 			{
-				stats.router_c = stats.router_c + 1;
+				fprintf(stderr, "Receive err#: %d on port %s\n", errno, receiver->name);
 			}
+			return routed;
+		}
+
+		// route and increment counter
+		route_batch(routing_table, &worker, streams, received_at, received);
+		receiver_release(receiver);
+		receiver->received += received;
+		routed += received;
+		stats_counter += received;
+
+		// see if it's time to output statistcs
+		if (stats_counter >= 20)
+		{
+			stats_counter = 0;
+			output_statistics();
 		}
+	}
+
+	return routed;
+}
 
-		// finally free the created packet
-		free(packet);
-		free(router);
+/**
+ * Lets the backend reuse the buffers behind the last batch.
+ */
+void receiver_release(Receiver* receiver)
+{
+	if (receiver->backend == RECEIVE_IO_URING)
+	{
+		io_ring_release(&receiver->ring);
+	}
+	else if (receiver->backend == RECEIVE_SHM)
+	{
+		shm_ring_release(&receiver->shm);
 	}
 }
 
 /**
- * Attempts to find the destination router for the given packet from the provided
- * table.
- * Returns a Router pointe or NULL if no matches were found.
+ * Writes the sample count and percentiles of a latency histogram. Stage
+ * histograms are written by the worker alone and read here without locking.
  */
-int find_destination_router(Router* router, RouterTable* table, Packet* packet)
+void output_histogram(FILE* out, const char* name, Histogram* histogram)
 {
-	int prefix_length;
+	Histogram snapshot;
 
-	for(int i = 0; i < table->size; i++)
-	{
-		Router* candidate = table->routes[i];
+	histogram_snapshot(&snapshot, histogram);
+	fprintf(
+		out,
+		"%s samples: %lu\n%s p50 ns: %llu\n%s p90 ns: %llu\n%s p99 ns: %llu\n%s p99.9 ns: %llu\n%s max ns: %llu\n",
+		name, snapshot.total,
+		name, (unsigned long long) histogram_percentile(&snapshot, 50),
+		name, (unsigned long long) histogram_percentile(&snapshot, 90),
+		name, (unsigned long long) histogram_percentile(&snapshot, 99),
+		name, (unsigned long long) histogram_percentile(&snapshot, 99.9),
+		name, (unsigned long long) histogram_percentile(&snapshot, 100)
+	);
+}
+
+/**
+ * Pulls the kernel's SO_TIMESTAMPNS receive time out of a message.
+ *
+ * Returns it in CLOCK_REALTIME ns, or 0 if the message didn't carry one.
+ */
+uint64_t message_timestamp(struct msghdr* message)
+{
+	struct cmsghdr* control;
+	struct timespec stamp;
 
-		// see if router and destination are in the same subnet
-		if ((compare_subnet(
-			candidate->prefix_length,
-			candidate->address,
-			packet->dest) == 0
-			)  &&
-			strcmp(candidate->address, packet->dest) == 0
-		) {
-			*router = *candidate;
-			return 0;
+	for (control = CMSG_FIRSTHDR(message); control != NULL; control = CMSG_NXTHDR(message, control))
+	{
+		if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			memcpy(&stamp, CMSG_DATA(control), sizeof(stamp));
+			return (uint64_t) stamp.tv_sec * 1000000000ull + stamp.tv_nsec;
 		}
 	}
 
-	return -1;
+	return 0;
+}
+
+uint64_t realtime_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
 /**
- * Parses out a route table struct from the provided table file path.
+ * Listens for control connections on a Unix socket at path, replacing any
+ * stale socket left behind by an earlier run.
  */
-RouterTable* build_router_table(char* table_path)
+int build_control_socket(const char* path)
 {
-	char* token = NULL;
-	RouterTable* table = RouterTable_new();
-	FILE* table_file = fopen(table_path, "r");
+	struct sockaddr_un address;
+	int controlfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
-	if (table_file == NULL)
+	if (controlfd == -1 || strlen(path) >= sizeof(address.sun_path))
 	{
-		perror("Can't read invalid table file path\n");
+		fprintf(stderr, "Unable to create control socket: %s\n", path);
 		exit(-1);
 	}
 
-	// parse line by line through the file
-	while (!feof(table_file))
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+
+	if (bind(controlfd, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(controlfd, 8) == -1)
+	{
+		fprintf(stderr, "Error binding control socket %s, errno: %d\n", path, errno);
+		exit(errno);
+	}
+
+	return controlfd;
+}
+
+/**
+ * Gives a newly connected shared memory producer its own ring and receiver.
+ * Receivers are never reused, so once ROUTER_MAX_RECEIVERS have been handed
+ * out further producers are turned away.
+ */
+void accept_producer(int epollfd, int listener)
+{
+	struct epoll_event event;
+	Receiver* receiver;
+	int index = receiver_count;
+
+	if (receiver_count == ROUTER_MAX_RECEIVERS)
 	{
-		char address[16];
-		int prefix_length;
-		char next_hop[8];
+		int rejected = accept(shm_listeners[listener], NULL, NULL);
 
-		if (fscanf(table_file, "%s %d %s", address, &prefix_length, next_hop) != 3)
+		fprintf(stderr, "Turning away shared memory producer, all %d receivers are taken.\n", ROUTER_MAX_RECEIVERS);
+		if (rejected != -1)
 		{
-			continue;
+			close(rejected);
+		}
+		return;
+	}
+
+	receiver = &receivers[index];
+	memset(receiver, 0, sizeof(Receiver));
+	if (shm_ring_accept(&receiver->shm, shm_listeners[listener]) != 0)
+	{
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			fprintf(stderr, "Unable to set up shared memory ring, errno: %d\n", errno);
 		}
-		add_new_router(table, address, prefix_length, next_hop);
+		return;
 	}
 
-	fclose(table_file);
+	receiver->backend = RECEIVE_SHM;
+	receiver->socketfd = -1;
+	snprintf(receiver->name, sizeof(receiver->name), "shm:%s#%d", shm_paths[listener], index);
+	receiver_count++;
 
-	return table;
+	event.events = EPOLLIN;
+	event.data.u32 = EVENT(EVENT_RECEIVER, index);
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, receiver->shm.data_fd, &event);
+
+	// the producer never writes to the socket, so readable means it's gone
+	event.events = EPOLLIN | EPOLLRDHUP;
+	event.data.u32 = EVENT(EVENT_SHM_HANGUP, index);
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, receiver->shm.socketfd, &event);
 }
 
 /**
- * Allocates and initializes a new RouteTable.
+ * Routes whatever a departed producer left in its ring, then unmaps it. The
+ * receiver stays in place so its counters still show up in the stats.
  */
-RouterTable* RouterTable_new()
+void close_producer(int epollfd, int index)
 {
-	RouterTable* table = malloc(sizeof(RouterTable));
-	table->size = 0;
-	table->max_size = 20;
-	table->routes = malloc(table->max_size * sizeof(Router*));
-	return table;
+	Receiver* receiver = &receivers[index];
+
+	if (receiver->closed)
+	{
+		return;
+	}
+
+	while (drain_receiver(receiver) > 0)
+	{
+	}
+
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, receiver->shm.data_fd, NULL);
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, receiver->shm.socketfd, NULL);
+	shm_ring_close(&receiver->shm);
+	receiver->closed = 1;
 }
 
 /**
- * Handles parsing, and preparing an incoming packet for:
- * <packet ID>, <source IP>, <destination IP>, <TTL>, <payload>
- *
- * If the packet can't be properly parsed or the TTL is too low, discards
- * packet and returns NULL.
+ * Takes every waiting control connection. Each gets CONTROL_IDLE_NS to
+ * send its command, and again for every part of the reply it reads; once
+ * ROUTER_MAX_CONTROL are open further ones are turned away.
  */
-int build_packet(Packet* packet, char* raw_packet)
+void accept_control(int epollfd, int controlfd)
 {
-	int id, TTL;
-	char src[16], dest[16];
-	char* payload;
+	struct epoll_event event;
+	int clientfd;
 
-	// super ghetto parser, csv lists suck in c
-	char selector[] = ", ";
-	char* token = strtok(raw_packet, selector);
-	int counter = 0;
-	while (token && counter < 5)
+	while ((clientfd = accept4(controlfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
 	{
-		// nasty switch statement is probably easier to grok than a bunch of
-		// ifs marhshalling data into vars
-		switch (counter)
+		int index = 0;
+
+		while (index < ROUTER_MAX_CONTROL && control_clients[index].fd != -1)
 		{
-			case 0:
-				id = atoi(token);
-				break;
-			case 1:
-				strcpy(src, token);
-				break;
-			case 2:
-				strcpy(dest, token);
-				break;
-			case 3:
-				TTL = atoi(token);
-				break;
-			case 4:
-				// handle a custom payload length
-				payload = malloc(strlen(token) + 1);
-				strcpy(payload, token);
-				break;
+			index++;
 		}
+		if (index == ROUTER_MAX_CONTROL)
+		{
+			close(clientfd);
+			continue;
+		}
+
+		memset(&control_clients[index], 0, sizeof(ControlClient));
+		control_clients[index].fd = clientfd;
+		control_clients[index].deadline = monotonic_ns() + CONTROL_IDLE_NS;
 
-		counter++;
-		token = strtok(NULL, selector);
+		event.events = EPOLLIN;
+		event.data.u32 = EVENT(EVENT_CONTROL_CLIENT, index);
+		epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, &event);
 	}
+}
 
-	// If we didn't parse the five expected packet segments
-	if (counter < 4)
+/**
+ * Reads what's arrived of a control connection's command. Once the whole
+ * line is in, or the client has stopped sending, the reply is rendered and
+ * the connection switches to writing it.
+ */
+void read_control(int epollfd, int index)
+{
+	ControlClient* client = &control_clients[index];
+	struct epoll_event event;
+	ssize_t length;
+
+	length = recv(
+		client->fd,
+		&client->command[client->command_length],
+		sizeof(client->command) - 1 - client->command_length,
+		0
+	);
+	if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
 	{
-		fprintf(stderr, "Malformed packet provided for %s", raw_packet);
-		return -1;
+		return;
+	}
+	if (length == -1 || (length == 0 && client->command_length == 0))
+	{
+		close_control(epollfd, index);
+		return;
 	}
 
-	int result = 0;
-	*packet = Packet_new(id, src, dest, TTL, payload);
-	if (packet->TTL <= 0)
+	client->command_length += length;
+	client->command[client->command_length] = 0;
+	if (length > 0 && strchr(client->command, '\n') == NULL && client->command_length < sizeof(client->command) - 1)
 	{
-		result = -1;
+		return;
 	}
 
-	if (counter == 5)
+	run_command(client);
+	if (client->reply == NULL)
 	{
-		free(payload);
+		close_control(epollfd, index);
+		return;
 	}
 
-	return result;
+	client->deadline = monotonic_ns() + CONTROL_IDLE_NS;
+	event.events = EPOLLOUT;
+	event.data.u32 = EVENT(EVENT_CONTROL_CLIENT, index);
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, client->fd, &event);
+	write_control(epollfd, index);
+}
+
+/**
+ * Writes as much of a control connection's reply as the socket will take,
+ * hanging up once it's all gone.
+ */
+void write_control(int epollfd, int index)
+{
+	ControlClient* client = &control_clients[index];
+	ssize_t length;
+
+	while (client->sent < client->reply_length)
+	{
+		length = send(client->fd, &client->reply[client->sent], client->reply_length - client->sent, MSG_NOSIGNAL);
+		if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return;
+		}
+		if (length == -1 && errno != EINTR)
+		{
+			break;
+		}
+		if (length > 0)
+		{
+			client->sent += length;
+			client->deadline = monotonic_ns() + CONTROL_IDLE_NS;
+		}
+	}
 
+	close_control(epollfd, index);
 }
 
 /**
- * Constructor for creating a new packet. Will automatically decrement TTL.
+ * Hangs up a control connection and frees its slot, if it's in use.
  */
-Packet Packet_new(int id, char* src, char* dest, int TTL, char* payload)
+void close_control(int epollfd, int index)
 {
-	Packet packet;
+	ControlClient* client = &control_clients[index];
+
+	if (client->fd == -1)
+	{
+		return;
+	}
+
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client->reply);
+	client->reply = NULL;
+	client->fd = -1;
+}
 
-	// allocate and initialize values
-	packet.id = id;
-	packet.src = malloc(strlen(src) + 1);
-	strcpy(packet.src, src);
-	packet.dest = malloc(strlen(dest) + 1);
-	strcpy(packet.dest, dest);
+/**
+ * Hangs up every control connection that has gone quiet, whether it never
+ * finished its command or stopped reading the reply.
+ *
+ * Returns the nanoseconds until the next one would, or UINT64_MAX if none
+ * are open.
+ */
+uint64_t expire_control(int epollfd, uint64_t now_ns)
+{
+	uint64_t wait = UINT64_MAX;
 
-	// automatically decrement TTL right off the bat
-	packet.TTL = TTL - 1;
-	packet.payload = malloc(strlen(payload) + 1);
+	for (int i = 0; i < ROUTER_MAX_CONTROL; i++)
+	{
+		if (control_clients[i].fd == -1)
+		{
+			continue;
+		}
+		if (control_clients[i].deadline <= now_ns)
+		{
+			close_control(epollfd, i);
+		}
+		else if (control_clients[i].deadline - now_ns < wait)
+		{
+			wait = control_clients[i].deadline - now_ns;
+		}
+	}
 
-	strcpy(packet.payload, payload);
-	return packet;
+	return wait;
 }
 
 /**
- * Marshal route segments into a route struct with format:
+ * Runs a control connection's command, rendering the whole reply into
+ * memory so it can be written out at whatever pace the client reads.
+ * Commands are
+ *
+ *   stats            every statistic, as in the stats file
+ *   routes           traffic for each route that has carried any
+ *   reload [path]    reload the routing table, from path if given
  *
- * 0 - <network‐address>
- * 1 - <net‐prefix‐length>
- * 2 - <nexthop>
+ * The reply is left NULL if it can't be rendered.
  */
-void add_new_router(RouterTable* table, char* address, int prefix_length, char* next_hop)
+void run_command(ControlClient* client)
 {
-	// marshal data into Route
-	Router* new_route = malloc(sizeof(Router));
-	new_route->address = malloc(strlen(address) + 1);
-	strcpy(new_route->address, address);
-	new_route->prefix_length = prefix_length;
-	new_route->next_hop = malloc(strlen(next_hop) + 1);
-	strcpy(new_route->next_hop, next_hop);
+	char* command = client->command;
+	FILE* reply = open_memstream(&client->reply, &client->reply_length);
+
+	if (reply == NULL)
+	{
+		client->reply = NULL;
+		return;
+	}
+
+	command[strcspn(command, "\r\n")] = 0;
+
+	if (strcmp(command, "stats") == 0)
+	{
+		write_statistics(reply);
+	}
+	else if (strcmp(command, "routes") == 0)
+	{
+		output_traffic(reply, routing_table);
+	}
+	else if (strncmp(command, "reload", 6) == 0 && (command[6] == 0 || command[6] == ' '))
+	{
+		const char* path = command[6] == ' ' ? &command[7] : routing_table_path;
 
-	// Grow our RouteTable array if at max length
-	if (table->size == table->max_size)
+		if (reload_table(path) == 0)
+		{
+			fprintf(reply, "reloaded %d routes from %s\n", routing_table->size, path);
+		}
+		else
+		{
+			fprintf(reply, "error: unable to read %s\n", path);
+		}
+	}
+	else
 	{
-		table->max_size *= 2;
-		table->routes = realloc(table->routes, table->max_size * sizeof(Router*));
+		fprintf(reply, "error: unknown command, expected stats, routes or reload [path]\n");
 	}
 
-	// add route to the array
-	table->routes[table->size] = new_route;
-	table->size = table->size + 1;
+	if (fclose(reply) != 0)
+	{
+		free(client->reply);
+		client->reply = NULL;
+	}
 }
 
 /**
- * Updates the statistics file based upon the state of the global statistics
- * struct.
+ * Swaps in a freshly loaded routing table. Next hop counters carry over by
+ * name, per route counters start again since the routes themselves may have
+ * changed. The new table gets a later generation than the old one, so every
+ * cache, matcher and trie rebuilds on the next batch.
+ *
+ * Returns 0 on success, -1 if the table file can't be read, leaving the old
+ * table in place.
  */
-void output_statistics()
+int reload_table(const char* table_path)
 {
-	// rewind pointer to the start of the file
-	fprintf(
-		stats_file,
-		"expired packets: %d\nunroutable packets: %d\ndelivered direct: %d\nrouter B: %d\nrouter C: %d\n",
-		stats.expired, stats.unroutable, stats.direct, stats.router_b, stats.router_c
-	);
+	RouterTable* old = routing_table;
+	RouterTable* table;
+	Traffic* next_hop_traffic;
 
-	rewind(stats_file);
-	printf("Router stats updated.\n");
+	table = build_router_table((char*) table_path);
+	if (table == NULL)
+	{
+		return -1;
+	}
+	table->generation = old->generation + 1;
+
+	next_hop_traffic = calloc(table->next_hop_count, sizeof(Traffic));
+	for (int i = 0; i < table->next_hop_count; i++)
+	{
+		int previous = find_next_hop(old, table->next_hops[i]);
+		if (previous != -1 && previous < worker.next_hop_capacity)
+		{
+			next_hop_traffic[i] = worker.next_hop_traffic[previous];
+		}
+	}
+
+	free(worker.next_hop_traffic);
+	worker.next_hop_traffic = next_hop_traffic;
+	worker.next_hop_capacity = table->next_hop_count;
+	memset(worker.route_traffic, 0, worker.route_capacity * sizeof(Traffic));
+
+	if (table_path != routing_table_path)
+	{
+		free(table_reload_path);
+		table_reload_path = strdup(table_path);
+		routing_table_path = table_reload_path;
+	}
+
+	routing_table = table;
+	RouterTable_free(old);
+	table_reloads++;
+	return 0;
 }
 
 /**
@@ -436,56 +2028,22 @@ int build_socket(int port)
 		exit(errno);
 	}
 
-	return socketfd;
-}
-
-void signal_handler(int signal)
-{
-	output_statistics();
-    printf("Terminating...");
-	exit(0);
-}
-
-/**
- * Checks if an ip address is in the same subnet as the defined prefix.
- *
- * Returns 0 if same, -1 if not.
- */
-int compare_subnet(int prefix_length, char* candidate, char* destination)
-{
-	// build our mask
-	uint32_t net_mask = UINT_MAX;
-	uint32_t shift_amnt = 32 - prefix_length;
-
-	// shift right to unset lower bits, then shift back to get correct value
-	net_mask = net_mask >> shift_amnt;
-	net_mask = net_mask << shift_amnt;
-
-	uint32_t destination_ip = parse_ipv4_string(destination);
-
-	// gets the candidates subnet using the candidate with the mask
-	uint32_t candidate_ip = parse_ipv4_string(candidate);
-	uint32_t subnet = candidate_ip & net_mask;
-
-	uint32_t masked_destination = destination_ip & net_mask;
-	if (masked_destination == subnet)
+	// have the kernel stamp each datagram as it arrives
+	int enable = 1;
+	if (setsockopt(socketfd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == -1)
 	{
-		return 0;
+		fprintf(stderr, "Unable to enable receive timestamps, errno: %d\n", errno);
 	}
-	
-	return -1;
+
+	return socketfd;
 }
 
 /**
- * Adopted from:
- * http://stackoverflow.com/questions/10283703/conversion-of-ip-address-to-integer
- *
- * Which is a helper to convert IPv4 strings into unsigned ints for mask
- * comparison.
+ * Only asks the main loop to stop; the capture, statistics and sockets are
+ * wrapped up once it has.
  */
-uint32_t parse_ipv4_string(char* ipAddress)
+void signal_handler(int signal)
 {
-	uint32_t ipbytes[4];
-	sscanf(ipAddress, "%u.%u.%u.%u", &ipbytes[3], &ipbytes[2], &ipbytes[1], &ipbytes[0]);
-	return ipbytes[0] | ipbytes[1] << 8 | ipbytes[2] << 16 | ipbytes[3] << 24;
+	(void) signal;
+	keep_running = 0;
 }
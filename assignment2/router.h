@@ -0,0 +1,71 @@
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <stdint.h>
+
+/* Long enough for any IPv6 address in text */
+#define ADDRESS_LENGTH 46
+
+/* Next hop "0" means deliver directly, it is always interned first */
+#define NEXT_HOP_DIRECT 0
+/* Longest next hop field in a table file, a comma separated list for ECMP */
+#define NEXT_HOPS_LENGTH 256
+
+/* Struct Definitions */
+typedef struct {
+    char* address;
+    int prefix_length;
+    char* next_hop;
+    int next_hop_id;
+    int* next_hop_ids;
+    uint64_t* next_hop_keys;
+    int path_count;
+    int version;
+    uint32_t network;
+    uint32_t mask;
+    uint8_t network6[16];
+} Router;
+
+typedef struct {
+    Router** routes;
+    int size;
+    int max_size;
+    unsigned int generation;
+    char** next_hops;
+    int next_hop_count;
+    int next_hop_max;
+} RouterTable;
+
+typedef struct {
+    int id;
+    char* src;
+    char* dest;
+    int TTL;
+    char* payload;
+} Packet;
+
+/* Routing Table Functions */
+RouterTable* RouterTable_new();
+void RouterTable_free(RouterTable* table);
+RouterTable* build_router_table(char* table_path);
+void add_new_router(RouterTable* table, char* address, int prefix_length, char* next_hop);
+int intern_next_hop(RouterTable* table, const char* next_hop);
+int find_next_hop(RouterTable* table, const char* next_hop);
+uint64_t flow_hash(const char* source, const char* destination);
+int select_next_hop(const Router* router, uint64_t flow);
+int find_destination_router(Router* router, RouterTable* table, Packet* packet);
+int lookup_route(RouterTable* table, uint32_t destination);
+int lookup_route6(RouterTable* table, const uint8_t* destination);
+int compare_subnet(int prefix_length, char* candidate, char* destination);
+uint32_t prefix_mask(int prefix_length);
+uint32_t parse_ipv4_string(char* ipAddress);
+int parse_ipv6_string(const char* address, uint8_t* out);
+int is_ipv6_string(const char* address);
+int parse_prefix(const char* text, uint8_t* network, int* version, int* prefix_length);
+int prefix_matches(const uint8_t* network, int prefix_length, const uint8_t* address);
+
+/* Packet Functions */
+int build_packet(Packet* packet, char* raw_packet);
+Packet Packet_new(int id, char* src, char* dest, int TTL, char* payload);
+
+#endif
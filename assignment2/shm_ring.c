@@ -0,0 +1,441 @@
+/**
+ * Shared memory transport between pktgen and the router, for when loopback
+ * UDP is the bottleneck rather than routing.
+ *
+ * The router listens on a Unix socket. Every producer that connects gets
+ * its own ring: a memfd holding the ring, plus one eventfd to wake the
+ * router when data arrives and one to wake the producer when space frees
+ * up, all passed over the socket with SCM_RIGHTS. The connection stays
+ * open, so either side sees the other go away as a hangup.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "shm_ring.h"
+
+#define SHM_RING_MAGIC 0x52494e47
+
+static int shm_ring_map(ShmRing* ring);
+static char* slot(ShmRing* ring, uint32_t index);
+static void wake(int eventfd);
+
+/**
+ * Listens for producers on a Unix socket at path, replacing any stale
+ * socket left behind by an earlier run.
+ *
+ * Returns the listening socket, or -1 with errno set.
+ */
+int shm_ring_listen(const char* path)
+{
+	struct sockaddr_un address;
+	int listenfd;
+
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenfd == -1)
+	{
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+
+	if (bind(listenfd, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(listenfd, 16) == -1)
+	{
+		close(listenfd);
+		return -1;
+	}
+
+	return listenfd;
+}
+
+/**
+ * Accepts one producer and sets up the consumer side of a fresh ring for
+ * it, handing the producer the memfd and both eventfds.
+ *
+ * Returns 0 on success, -1 with errno set.
+ */
+int shm_ring_accept(ShmRing* ring, int listenfd)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	char hello[] = "ring";
+	struct iovec iov = {hello, sizeof(hello)};
+	struct msghdr message;
+	struct cmsghdr* header;
+	int fds[3];
+
+	memset(ring, 0, sizeof(ShmRing));
+	ring->memfd = ring->data_fd = ring->space_fd = ring->socketfd = -1;
+	ring->socketfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (ring->socketfd == -1)
+	{
+		return -1;
+	}
+
+	ring->size = sizeof(ShmRingHeader) + (size_t) SHM_RING_SLOTS * SHM_RING_SLOT_SIZE;
+	ring->memfd = memfd_create("router-ring", MFD_CLOEXEC);
+	ring->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ring->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->memfd == -1 || ring->data_fd == -1 || ring->space_fd == -1 ||
+		ftruncate(ring->memfd, ring->size) == -1 || shm_ring_map(ring) == -1
+	) {
+		shm_ring_close(ring);
+		return -1;
+	}
+
+	ring->slot_count = ring->header->slot_count = SHM_RING_SLOTS;
+	ring->slot_size = ring->header->slot_size = SHM_RING_SLOT_SIZE;
+	// the consumer starts out asleep on the data eventfd
+	ring->header->consumer_waiting = 1;
+	ring->header->magic = SHM_RING_MAGIC;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(fds));
+	fds[0] = ring->memfd;
+	fds[1] = ring->data_fd;
+	fds[2] = ring->space_fd;
+	memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+	if (sendmsg(ring->socketfd, &message, MSG_NOSIGNAL) == -1)
+	{
+		shm_ring_close(ring);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Connects to a router listening at path and maps the producer side of the
+ * ring it hands back.
+ *
+ * Returns 0 on success, -1 with errno set.
+ */
+int shm_ring_connect(ShmRing* ring, const char* path)
+{
+	char control[CMSG_SPACE(3 * sizeof(int))];
+	char hello[8];
+	struct iovec iov = {hello, sizeof(hello)};
+	struct sockaddr_un address;
+	struct msghdr message;
+	struct cmsghdr* header;
+	struct stat status;
+	int fds[3];
+
+	memset(ring, 0, sizeof(ShmRing));
+	ring->memfd = ring->data_fd = ring->space_fd = ring->socketfd = -1;
+	if (strlen(path) >= sizeof(address.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	ring->socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ring->socketfd == -1 || connect(ring->socketfd, (struct sockaddr*) &address, sizeof(address)) == -1)
+	{
+		shm_ring_close(ring);
+		return -1;
+	}
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	if (recvmsg(ring->socketfd, &message, MSG_CMSG_CLOEXEC) <= 0)
+	{
+		shm_ring_close(ring);
+		return -1;
+	}
+
+	header = CMSG_FIRSTHDR(&message);
+	if (header == NULL || header->cmsg_type != SCM_RIGHTS || header->cmsg_len != CMSG_LEN(sizeof(fds)))
+	{
+		shm_ring_close(ring);
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(header), sizeof(fds));
+	ring->memfd = fds[0];
+	ring->data_fd = fds[1];
+	ring->space_fd = fds[2];
+
+	if (fstat(ring->memfd, &status) == -1)
+	{
+		shm_ring_close(ring);
+		return -1;
+	}
+	ring->size = status.st_size;
+
+	if (ring->size < sizeof(ShmRingHeader) || shm_ring_map(ring) == -1)
+	{
+		shm_ring_close(ring);
+		errno = EPROTO;
+		return -1;
+	}
+
+	// checked once and kept, whatever the header says later
+	ring->slot_count = ring->header->slot_count;
+	ring->slot_size = ring->header->slot_size;
+	if (ring->header->magic != SHM_RING_MAGIC || ring->slot_count == 0 ||
+		(ring->slot_count & (ring->slot_count - 1)) != 0 || ring->slot_size <= sizeof(uint32_t) ||
+		ring->size < sizeof(ShmRingHeader) + (size_t) ring->slot_count * ring->slot_size
+	) {
+		shm_ring_close(ring);
+		errno = EPROTO;
+		return -1;
+	}
+
+	ring->tail = ring->header->tail;
+	ring->cached_head = ring->header->head;
+	return 0;
+}
+
+/**
+ * Producer side. Copies one datagram into the next free slot without
+ * publishing it, so a whole batch becomes visible with one store.
+ *
+ * Returns 0 on success, or -1 with errno EAGAIN if the ring is full or
+ * EMSGSIZE if the datagram can't fit in a slot.
+ */
+int shm_ring_write(ShmRing* ring, const struct iovec* iov, int iovcnt)
+{
+	ShmRingHeader* header = ring->header;
+	uint32_t length = 0;
+	char* data;
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
+	}
+
+	// the consumer terminates datagrams in place, so leave it a byte
+	if (length + sizeof(uint32_t) >= ring->slot_size)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	// only look at the consumer's index when the cached one says full
+	if (ring->tail - ring->cached_head >= ring->slot_count)
+	{
+		ring->cached_head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if (ring->tail - ring->cached_head >= ring->slot_count)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	data = slot(ring, ring->tail);
+	memcpy(data, &length, sizeof(length));
+	data += sizeof(length);
+	for (int i = 0; i < iovcnt; i++)
+	{
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+
+	ring->tail++;
+	return 0;
+}
+
+/**
+ * Makes every written datagram visible, waking the consumer only if it
+ * said it was going to sleep.
+ */
+void shm_ring_publish(ShmRing* ring)
+{
+	ShmRingHeader* header = ring->header;
+
+	// sequentially consistent so the store can't pass the load of the flag
+	__atomic_store_n(&header->tail, ring->tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST) &&
+		__atomic_exchange_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST)
+	) {
+		wake(ring->data_fd);
+	}
+}
+
+/**
+ * Blocks a full producer until the consumer frees a slot, the timeout
+ * passes, or the consumer goes away.
+ *
+ * Returns 0 when it's worth trying again, -1 with errno EPIPE if the
+ * consumer has hung up.
+ */
+int shm_ring_wait_space(ShmRing* ring, int timeout_ms)
+{
+	ShmRingHeader* header = ring->header;
+	struct pollfd fds[2] = {{ring->space_fd, POLLIN, 0}, {ring->socketfd, POLLIN, 0}};
+	uint64_t count;
+
+	shm_ring_publish(ring);
+	__atomic_store_n(&header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+
+	// the consumer may have made room between the write failing and the flag
+	ring->cached_head = __atomic_load_n(&header->head, __ATOMIC_SEQ_CST);
+	if (ring->tail - ring->cached_head < ring->slot_count)
+	{
+		__atomic_store_n(&header->producer_waiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	ring->sleeps++;
+	if (poll(fds, 2, timeout_ms) > 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+	{
+		errno = EPIPE;
+		return -1;
+	}
+
+	if (read(ring->space_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Consumer side. Takes up to max datagrams, terminated in place, which stay
+ * valid until shm_ring_release. An empty ring arms the data eventfd before
+ * returning, so the caller can sleep on it.
+ *
+ * Returns the number taken, or -1 with errno EAGAIN if there were none.
+ */
+int shm_ring_take(ShmRing* ring, char** packets, int max)
+{
+	ShmRingHeader* header = ring->header;
+	uint32_t available = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) - ring->head;
+	uint64_t count;
+	int taken;
+
+	if (available == 0)
+	{
+		// clear any stale wakeup, then say we're going to sleep and look
+		// once more, in case the producer published in between
+		if (read(ring->data_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		{
+			return -1;
+		}
+		__atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		available = __atomic_load_n(&header->tail, __ATOMIC_SEQ_CST) - ring->head;
+		if (available == 0)
+		{
+			ring->sleeps++;
+			errno = EAGAIN;
+			return -1;
+		}
+		__atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_RELAXED);
+	}
+
+	taken = available < (uint32_t) max ? (int) available : max;
+	for (int i = 0; i < taken; i++)
+	{
+		char* data = slot(ring, ring->head + i);
+		uint32_t length;
+
+		memcpy(&length, data, sizeof(length));
+		if (length + sizeof(uint32_t) >= ring->slot_size)
+		{
+			length = 0;
+		}
+		data[sizeof(length) + length] = 0;
+		packets[i] = data + sizeof(length);
+	}
+
+	ring->head += taken;
+	return taken;
+}
+
+/**
+ * Hands the slots behind the last take back to the producer, waking it if
+ * it's waiting for space.
+ */
+void shm_ring_release(ShmRing* ring)
+{
+	ShmRingHeader* header = ring->header;
+
+	__atomic_store_n(&header->head, ring->head, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&header->producer_waiting, __ATOMIC_SEQ_CST) &&
+		__atomic_exchange_n(&header->producer_waiting, 0, __ATOMIC_SEQ_CST)
+	) {
+		wake(ring->space_fd);
+	}
+}
+
+void shm_ring_close(ShmRing* ring)
+{
+	if (ring->header != NULL)
+	{
+		munmap(ring->header, ring->size);
+		ring->header = NULL;
+	}
+
+	int* fds[] = {&ring->memfd, &ring->data_fd, &ring->space_fd, &ring->socketfd};
+	for (int i = 0; i < 4; i++)
+	{
+		if (*fds[i] != -1)
+		{
+			close(*fds[i]);
+			*fds[i] = -1;
+		}
+	}
+}
+
+static int shm_ring_map(ShmRing* ring)
+{
+	void* memory = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+
+	if (memory == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	ring->header = memory;
+	ring->slots = (char*) memory + sizeof(ShmRingHeader);
+	return 0;
+}
+
+static char* slot(ShmRing* ring, uint32_t index)
+{
+	return ring->slots + (size_t) (index & (ring->slot_count - 1)) * ring->slot_size;
+}
+
+static void wake(int eventfd)
+{
+	uint64_t one = 1;
+
+	if (write(eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+	{
+		fprintf(stderr, "Unable to wake shared ring peer, errno: %d\n", errno);
+	}
+}
@@ -0,0 +1,60 @@
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SHM_RING_SLOTS 4096
+/* Bytes per slot, length word included, so a datagram of up to 1019 fits */
+#define SHM_RING_SLOT_SIZE 1024
+
+/*
+ * The start of the shared segment. Each index sits on its own cache line
+ * next to the flag its owner raises before sleeping, so the two sides only
+ * share a line when one of them reads the other's index.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t consumer_waiting;
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t producer_waiting;
+} __attribute__((aligned(64))) ShmRingHeader;
+
+/*
+ * One side of a single producer, single consumer ring of datagrams in a
+ * memfd shared between two processes. Neither side makes a syscall while
+ * the other is keeping up; an eventfd is only written when the other side
+ * has said it is going to sleep.
+ */
+typedef struct {
+	ShmRingHeader* header;
+	char* slots;
+	size_t size;
+	int memfd;
+	int data_fd;
+	int space_fd;
+	int socketfd;
+	/* this side's copy of the geometry, the other side can write the header's */
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t cached_head;
+	unsigned long sleeps;
+} ShmRing;
+
+int shm_ring_listen(const char* path);
+int shm_ring_accept(ShmRing* ring, int listenfd);
+int shm_ring_connect(ShmRing* ring, const char* path);
+int shm_ring_write(ShmRing* ring, const struct iovec* iov, int iovcnt);
+void shm_ring_publish(ShmRing* ring);
+int shm_ring_wait_space(ShmRing* ring, int timeout_ms);
+int shm_ring_take(ShmRing* ring, char** packets, int max);
+void shm_ring_release(ShmRing* ring);
+void shm_ring_close(ShmRing* ring);
+
+#endif
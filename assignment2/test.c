@@ -1,12 +1,44 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "router.h"
+#include "route_trie.h"
+#include "acl.h"
+
+/* A prefix the ACL test writes into a rule, version 0 for a wildcard */
+typedef struct {
+    int version;
+    uint8_t network[16];
+    int prefix_length;
+} TestPrefix;
+
+/* What the ACL test expects a rule to match, checked by a plain linear scan */
+typedef struct {
+    TestPrefix source;
+    TestPrefix destination;
+    int ttl_low;
+    int ttl_high;
+} TestRule;
 
 /* Test Declarations */
 void test_build_router_table();
 void test_receive_packet();
 void test_find_destination_router();
+void test_lookup_route();
+void test_lookup_route6();
+void test_route_trie();
+void test_multipath();
+void test_acl();
+void test_acl_rules(int rule_count, int packet_count);
+void random_prefix(TestPrefix* prefix, uint8_t bases[][16], int base_count);
+void write_prefix(FILE* file, const char* field, const TestPrefix* prefix);
+int test_prefix_matches(const TestPrefix* prefix, const uint8_t* address);
 
 RouterTable* table;
 
@@ -15,16 +47,23 @@ RouterTable* table;
  */
 int main(int argc, char **argv)
 {
+    (void) argc;
+    (void) argv;
+
     test_build_router_table();
     test_receive_packet();
     test_find_destination_router();
+    test_lookup_route();
+    test_lookup_route6();
+    test_route_trie();
+    test_multipath();
+    test_acl();
 
     // now tear everything back down
-	for(int i = 0; i < table->size; i++)
-	{
-		free(table->routes[i]);
-	}
-	free(table);
+	RouterTable_free(table);
+
+	printf("All router tests passed.\n");
+	return 0;
 }
 
 void test_build_router_table()
@@ -39,39 +78,459 @@ void test_build_router_table()
     assert(strcmp(router->address, "192.168.128.0") == 0);
     assert(strcmp(router->next_hop, "0") == 0);
     assert(router->prefix_length == 17);
+    assert(router->mask == 0xffff8000);
+    assert(router->network == parse_ipv4_string("192.168.128.0"));
 
-    free(router);
+    // next hops are interned with direct delivery always first
+    assert(router->next_hop_id == NEXT_HOP_DIRECT);
+    assert(table->next_hop_count == 3);
+    assert(table->routes[0]->next_hop_id == find_next_hop(table, "RouterB"));
+    assert(table->routes[2]->next_hop_id == find_next_hop(table, "RouterC"));
+    assert(find_next_hop(table, "RouterD") == -1);
+
+    // a path that isn't a readable file gives no table rather than exiting or hanging
+    assert(build_router_table("./no_such_table.txt") == NULL);
+    assert(build_router_table(".") == NULL);
 }
 
 void test_receive_packet()
 {
     char raw_packet[] = "215, 192.168.192.4, 192.224.0.7, 64, \"Hello\"";
-    Packet* packet = build_packet(raw_packet);
+    Packet packet;
+    assert(build_packet(&packet, raw_packet) == 0);
 
     // make sure all data got martialled in properly
-    assert(packet->id == 215);
-    assert(strcmp(packet->src, "192.168.192.4") == 0);
-    assert(strcmp(packet->dest, "192.224.0.7") == 0);
-    assert(packet->TTL == 63);
-    assert(strcmp(packet->payload, "\"Hello\"") == 0);
+    assert(packet.id == 215);
+    assert(strcmp(packet.src, "192.168.192.4") == 0);
+    assert(strcmp(packet.dest, "192.224.0.7") == 0);
+    assert(packet.TTL == 63);
+    assert(strcmp(packet.payload, "\"Hello\"") == 0);
 
     // make sure we drop anything with a TTL of 1, decremented to 0
     char raw_packet2[] = "215, 192.168.192.4, 192.224.0.7, 1, \"Hello\"";
-    Packet* packet2 = build_packet(raw_packet2);
-    assert(packet2 == NULL);
+    Packet packet2;
+    assert(build_packet(&packet2, raw_packet2) == -1);
+
+    // the load generator pads its fields, which has to parse the same
+    char raw_packet3[] = "0000000215, 192.168.192.4  , 192.224.0.7    , 064, \"Hello\"";
+    Packet packet3;
+    assert(build_packet(&packet3, raw_packet3) == 0);
+    assert(packet3.id == 215);
+    assert(strcmp(packet3.dest, "192.224.0.7") == 0);
+    assert(packet3.TTL == 63);
 
-    free(packet);
-    free(packet2);
+    free(packet.src);
+    free(packet.dest);
+    free(packet.payload);
+    free(packet3.src);
+    free(packet3.dest);
+    free(packet3.payload);
 }
 
 void test_find_destination_router()
 {
+    Router router;
+
     Packet packet = (Packet) {125, "192.168.128.0", "192.168.192.0", 2, "\"yoooo\""};
-    Router* router = find_destination_router(table, &packet);
-    assert(router != NULL);
-    assert(strcmp(router->next_hop, "RouterB") == 0);
+    assert(find_destination_router(&router, table, &packet) == 0);
+    assert(strcmp(router.next_hop, "RouterB") == 0);
 
     Packet packet2 = (Packet) {6290, "192.168.128.0", "192.168.567.0", 2, "\"Sweeet\""};
-    Router* router2 = find_destination_router(table, &packet2);
-    assert(router2 == NULL);
+    assert(find_destination_router(&router, table, &packet2) == -1);
+}
+
+void test_lookup_route()
+{
+    // the /18 is inside the /17, so the longer prefix has to win
+    assert(lookup_route(table, parse_ipv4_string("192.168.200.1")) == 0);
+    assert(lookup_route(table, parse_ipv4_string("192.168.130.1")) == 1);
+    assert(lookup_route(table, parse_ipv4_string("192.224.255.255")) == 2);
+    assert(lookup_route(table, parse_ipv4_string("168.130.192.1")) == -1);
+    assert(compare_subnet(17, "192.168.128.0", "192.168.255.1") == 0);
+    assert(compare_subnet(18, "192.168.192.0", "192.168.128.1") == -1);
+
+    // an IPv4 prefix length outside 0..32 is rejected and never matches
+    RouterTable* invalid = RouterTable_new();
+    add_new_router(invalid, "10.0.0.0", 40, "RouterB");
+    add_new_router(invalid, "10.0.0.0", -3, "RouterC");
+    assert(invalid->routes[0]->prefix_length == -1 && invalid->routes[1]->prefix_length == -1);
+    assert(lookup_route(invalid, parse_ipv4_string("10.0.0.0")) == -1);
+    RouterTable_free(invalid);
+}
+
+void test_lookup_route6()
+{
+    RouterTable* table6 = RouterTable_new();
+    uint8_t destination[16];
+    Router router;
+
+    add_new_router(table6, "2001:db8::", 32, "RouterB");
+    add_new_router(table6, "2001:db8:aa00::", 40, "RouterC");
+    add_new_router(table6, "2001:db8:aa80::", 41, "0");
+    add_new_router(table6, "10.0.0.0", 8, "RouterB");
+
+    // host bits past the prefix are cleared when the route is added
+    add_new_router(table6, "2001:db8:ffff::1", 36, "RouterC");
+    assert(table6->routes[4]->network6[4] == 0xf0 && table6->routes[4]->network6[15] == 0);
+
+    assert(parse_ipv6_string("2001:db8:aa81::1", destination) == 0);
+    assert(lookup_route6(table6, destination) == 2);
+    assert(parse_ipv6_string("2001:db8:aa01::1", destination) == 0);
+    assert(lookup_route6(table6, destination) == 1);
+    assert(parse_ipv6_string("2001:db8:1::1", destination) == 0);
+    assert(lookup_route6(table6, destination) == 0);
+    assert(parse_ipv6_string("2001:db9::1", destination) == 0);
+    assert(lookup_route6(table6, destination) == -1);
+    assert(parse_ipv6_string("not:an:address::g", destination) == -1);
+
+    // the families never match each other's routes
+    assert(lookup_route(table6, parse_ipv4_string("10.1.2.3")) == 3);
+    assert(lookup_route(table6, parse_ipv4_string("32.1.13.184")) == -1);
+
+    Packet packet = (Packet) {7, "2001:db8::2", "2001:db8:aa80::9", 5, ""};
+    assert(find_destination_router(&router, table6, &packet) == 0);
+    assert(strcmp(router.next_hop, "0") == 0);
+
+    // a full length address survives the packet parser
+    char raw_packet[] = "9, 2001:db8::2, 2001:db8:aaaa:bbbb:cccc:dddd:eeee:ffff, 64, \"Hi\"";
+    Packet packet2;
+    assert(build_packet(&packet2, raw_packet) == 0);
+    assert(strcmp(packet2.dest, "2001:db8:aaaa:bbbb:cccc:dddd:eeee:ffff") == 0);
+    free(packet2.src);
+    free(packet2.dest);
+    free(packet2.payload);
+    RouterTable_free(table6);
+}
+
+void test_route_trie()
+{
+    // random prefixes, checked against the linear scans
+    RouterTable* random = RouterTable_new();
+    RouteTrie* trie4 = RouteTrie_new(4);
+    RouteTrie* trie6 = RouteTrie_new(16);
+    uint8_t networks4[400 * 4], networks6[400 * 16];
+    int lengths4[400], lengths6[400], routes4[400], routes6[400];
+    int size4 = 0, size6 = 0;
+    char address[ADDRESS_LENGTH];
+    uint8_t key[16];
+
+    srand(1);
+    for (int i = 0; i < 800; i++)
+    {
+        uint8_t bytes[16];
+        for (int b = 0; b < 16; b++)
+        {
+            // few distinct values keep prefixes overlapping
+            bytes[b] = (rand() % 4) * 0x40 + (rand() % 2);
+        }
+
+        if (i % 2 == 0)
+        {
+            sprintf(address, "%u.%u.%u.%u", bytes[0], bytes[1], bytes[2], bytes[3]);
+            add_new_router(random, address, rand() % 33, "RouterB");
+        }
+        else
+        {
+            inet_ntop(AF_INET6, bytes, address, sizeof(address));
+            add_new_router(random, address, rand() % 129, "RouterC");
+        }
+
+        Router* route = random->routes[i];
+        if (route->version == 4)
+        {
+            networks4[size4 * 4] = route->network >> 24;
+            networks4[size4 * 4 + 1] = route->network >> 16;
+            networks4[size4 * 4 + 2] = route->network >> 8;
+            networks4[size4 * 4 + 3] = route->network;
+            lengths4[size4] = route->prefix_length;
+            routes4[size4++] = i;
+        }
+        else
+        {
+            memcpy(&networks6[size6 * 16], route->network6, 16);
+            lengths6[size6] = route->prefix_length;
+            routes6[size6++] = i;
+        }
+    }
+
+    route_trie_load(trie4, size4, networks4, lengths4, routes4);
+    route_trie_load(trie6, size6, networks6, lengths6, routes6);
+
+    for (int i = 0; i < 20000; i++)
+    {
+        for (int b = 0; b < 16; b++)
+        {
+            key[b] = (rand() % 4) * 0x40 + (rand() % 2);
+        }
+
+        uint32_t destination = (uint32_t) key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+        assert(route_trie_lookup(trie4, key) == lookup_route(random, destination));
+        assert(route_trie_lookup(trie6, key) == lookup_route6(random, key));
+    }
+
+    RouteTrie_free(trie4);
+    RouteTrie_free(trie6);
+    RouterTable_free(random);
+}
+
+void test_multipath()
+{
+    RouterTable* multipath = RouterTable_new();
+    char source[ADDRESS_LENGTH], destination[ADDRESS_LENGTH];
+    int counts[8] = {0};
+    int moved = 0;
+
+    // repeats and empty names in the list are dropped
+    add_new_router(multipath, "10.0.0.0", 8, "RouterB,RouterC,,RouterD,RouterB");
+    add_new_router(multipath, "10.0.0.0", 8, "RouterB,RouterC,RouterD,RouterE");
+    add_new_router(multipath, "11.0.0.0", 8, "RouterC");
+    Router* three = multipath->routes[0];
+    Router* four = multipath->routes[1];
+    assert(three->path_count == 3 && four->path_count == 4);
+    assert(multipath->routes[2]->path_count == 1);
+    assert(three->next_hop_id == find_next_hop(multipath, "RouterB"));
+    assert(strcmp(three->next_hop, "RouterB,RouterC,,RouterD,RouterB") == 0);
+
+    for (int i = 0; i < 12000; i++)
+    {
+        sprintf(source, "172.16.%d.%d", i / 250, i % 250);
+        sprintf(destination, "10.%d.0.1", i % 7);
+        uint64_t flow = flow_hash(source, destination);
+
+        // the same flow always takes the same path
+        int before = select_next_hop(three, flow);
+        assert(before == select_next_hop(three, flow_hash(source, destination)));
+        counts[before]++;
+
+        // a fourth next hop only takes flows for itself
+        int after = select_next_hop(four, flow);
+        if (after != before)
+        {
+            assert(after == find_next_hop(multipath, "RouterE"));
+            moved++;
+        }
+    }
+
+    // each path gets about a third, and about a quarter move to the new one
+    for (int i = 0; i < 3; i++)
+    {
+        assert(counts[three->next_hop_ids[i]] > 3600 && counts[three->next_hop_ids[i]] < 4400);
+    }
+    assert(moved > 2500 && moved < 3500);
+
+    RouterTable_free(multipath);
+}
+
+void test_acl()
+{
+    // less than a word of rules, a few words, and enough for more than one summary word
+    test_acl_rules(8, 2000);
+    test_acl_rules(150, 5000);
+    test_acl_rules(4500, 2000);
+}
+
+/**
+ * Writes rule_count random rules to a file, loads them, and checks that
+ * acl_classify picks the same rule as a linear first match scan for
+ * packet_count random packets. Rules overlap a lot, as every prefix is
+ * cut from a handful of bases, and packets are drawn from around the same
+ * bases so they land on the edges of those prefixes.
+ */
+void test_acl_rules(int rule_count, int packet_count)
+{
+    uint8_t bases[12][16];
+    char path[] = "/tmp/acl_testXXXXXX";
+    TestRule* rules = calloc(rule_count, sizeof(TestRule));
+    int fd = mkstemp(path);
+    FILE* file = fdopen(fd, "w");
+    Acl* acl;
+    int matched = 0, unmatched = 0;
+
+    assert(rules != NULL && fd != -1 && file != NULL);
+    srand(rule_count);
+
+    // six IPv4 bases in the first 4 bytes and six IPv6 ones in 2000::/3,
+    // away from both the mapped IPv4 addresses and ff00::/8
+    for (int b = 0; b < 12; b++)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            bases[b][i] = rand();
+        }
+        if (b >= 6)
+        {
+            bases[b][0] = 0x20 | (bases[b][0] & 0x1f);
+        }
+    }
+
+    for (int r = 0; r < rule_count; r++)
+    {
+        TestRule* rule = &rules[r];
+
+        // permit, deny and limit in turn
+        fprintf(file, "%s", r % 3 == 0 ? "permit" : r % 3 == 1 ? "deny" : "limit 1000:10");
+        random_prefix(&rule->source, bases, 12);
+        random_prefix(&rule->destination, bases, 12);
+        write_prefix(file, "src", &rule->source);
+        write_prefix(file, "dest", &rule->destination);
+
+        // a rule on the TTL alone never takes in 0 or 255, so some packets match nothing
+        rule->ttl_low = 0;
+        rule->ttl_high = 255;
+        if (rule->source.version == 0 && rule->destination.version == 0)
+        {
+            rule->ttl_low = 1 + rand() % 254;
+            rule->ttl_high = rule->ttl_low + rand() % (255 - rule->ttl_low);
+            fprintf(file, " ttl %d-%d", rule->ttl_low, rule->ttl_high);
+        }
+        else if (rand() % 2)
+        {
+            rule->ttl_low = rand() % 256;
+            rule->ttl_high = rand() % 4 == 0 ? rule->ttl_low : rule->ttl_low + rand() % (256 - rule->ttl_low);
+            if (rule->ttl_low == rule->ttl_high)
+            {
+                fprintf(file, " ttl %d", rule->ttl_low);
+            }
+            else
+            {
+                fprintf(file, " ttl %d-%d", rule->ttl_low, rule->ttl_high);
+            }
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+
+    acl = Acl_new(path);
+    unlink(path);
+    assert(acl->rule_count == rule_count);
+
+    for (int p = 0; p < packet_count; p++)
+    {
+        uint8_t source[16], destination[16];
+        uint8_t* addresses[2] = {source, destination};
+        int version = rand() % 2 ? 4 : 6;
+        int ttl = rand() % 300 - 20;
+        int stray = rand() % 4 == 0;
+        int expected = -1;
+
+        for (int a = 0; a < 2 && stray; a++)
+        {
+            // in ff00::/8, which no prefix but the wildcards covers
+            for (int i = 0; i < 16; i++)
+            {
+                addresses[a][i] = i == 0 ? 0xff : rand();
+            }
+            ttl = rand() % 2 ? -3 : 255 + rand() % 40;
+        }
+
+        for (int a = 0; a < 2 && !stray; a++)
+        {
+            // a base from the packet's family, with some of its low bits flipped
+            uint8_t* base = bases[(version == 4 ? 0 : 6) + rand() % 6];
+            int bits = rand() % (version == 4 ? 33 : 121);
+
+            memset(addresses[a], 0, 16);
+            if (version == 4)
+            {
+                addresses[a][10] = addresses[a][11] = 0xff;
+                memcpy(&addresses[a][12], base, 4);
+            }
+            else
+            {
+                memcpy(addresses[a], base, 16);
+            }
+            for (int i = 0; i < bits && rand() % 4 != 0; i++)
+            {
+                int bit = 127 - rand() % bits;
+                addresses[a][bit / 8] ^= 0x80 >> (bit % 8);
+            }
+        }
+
+        for (int r = 0; r < rule_count && expected == -1; r++)
+        {
+            int clamped = ttl < 0 ? 0 : ttl > 255 ? 255 : ttl;
+
+            if (test_prefix_matches(&rules[r].source, source) &&
+                test_prefix_matches(&rules[r].destination, destination) &&
+                clamped >= rules[r].ttl_low && clamped <= rules[r].ttl_high)
+            {
+                expected = r;
+            }
+        }
+
+        assert(acl_classify(acl, source, destination, ttl) == expected);
+        if (expected == -1)
+        {
+            // the default is to let the packet through
+            assert(acl_filter(acl, source, destination, ttl, 0) == 1);
+            unmatched++;
+        }
+        else if (expected % 3 == 2)
+        {
+            // a limit only lets its burst through at a standstill
+            acl_filter(acl, source, destination, ttl, 0);
+            matched++;
+        }
+        else
+        {
+            assert(acl_filter(acl, source, destination, ttl, 0) == (expected % 3 == 0));
+            matched++;
+        }
+    }
+
+    // both a first match and the default have to have been exercised
+    assert(matched > 0 && unmatched > 0);
+    Acl_free(acl);
+    free(rules);
+}
+
+/**
+ * Picks a wildcard, or a prefix of one of the bases, IPv4 bases being the
+ * first half. An IPv6 prefix is at least a /1, so it can't cover ff00::/8.
+ */
+void random_prefix(TestPrefix* prefix, uint8_t bases[][16], int base_count)
+{
+    int base = rand() % base_count;
+
+    memset(prefix, 0, sizeof(TestPrefix));
+    if (rand() % 3 == 0)
+    {
+        return;
+    }
+
+    prefix->version = base < base_count / 2 ? 4 : 6;
+    prefix->prefix_length = prefix->version == 4 ? rand() % 33 : 1 + rand() % 128;
+    memcpy(prefix->network, bases[base], 16);
+}
+
+void write_prefix(FILE* file, const char* field, const TestPrefix* prefix)
+{
+    char text[INET6_ADDRSTRLEN];
+
+    if (prefix->version != 0)
+    {
+        inet_ntop(prefix->version == 4 ? AF_INET : AF_INET6, prefix->network, text, sizeof(text));
+        fprintf(file, " %s %s/%d", field, text, prefix->prefix_length);
+    }
+}
+
+/**
+ * The reference match, on 16 byte addresses with IPv4 mapped into IPv6.
+ * An IPv4 prefix only covers mapped addresses, an IPv6 one the addresses
+ * it covers as written, so ::/0 takes in IPv4 too.
+ */
+int test_prefix_matches(const TestPrefix* prefix, const uint8_t* address)
+{
+    static const uint8_t mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+    if (prefix->version == 0)
+    {
+        return 1;
+    }
+    else if (prefix->version == 4)
+    {
+        return memcmp(address, mapped, 12) == 0 && prefix_matches(prefix->network, prefix->prefix_length, &address[12]);
+    }
+
+    return prefix_matches(prefix->network, prefix->prefix_length, address);
 }
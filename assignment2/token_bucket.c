@@ -0,0 +1,87 @@
+/**
+ * Token bucket rate limiting, shared by anything that needs to pace itself.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdint.h>
+#include <time.h>
+
+#include "token_bucket.h"
+
+static void token_bucket_refill(TokenBucket* bucket, uint64_t now_ns);
+
+/**
+ * Starts the bucket full so the first burst goes out immediately. A rate of
+ * 0 means unlimited.
+ */
+void token_bucket_init(TokenBucket* bucket, double rate, double burst)
+{
+	bucket->rate = rate;
+	bucket->burst = burst;
+	bucket->tokens = burst;
+	bucket->last_ns = monotonic_ns();
+}
+
+/**
+ * Takes tokens from the bucket if there are enough of them.
+ *
+ * Returns 0 if the tokens were taken, -1 if the caller has to wait.
+ */
+int token_bucket_take(TokenBucket* bucket, double tokens, uint64_t now_ns)
+{
+	if (bucket->rate <= 0)
+	{
+		return 0;
+	}
+
+	token_bucket_refill(bucket, now_ns);
+	if (bucket->tokens < tokens)
+	{
+		return -1;
+	}
+
+	bucket->tokens -= tokens;
+	return 0;
+}
+
+/**
+ * Returns how long until the bucket will hold the requested tokens.
+ */
+uint64_t token_bucket_wait_ns(TokenBucket* bucket, double tokens, uint64_t now_ns)
+{
+	if (bucket->rate <= 0)
+	{
+		return 0;
+	}
+
+	token_bucket_refill(bucket, now_ns);
+	if (bucket->tokens >= tokens)
+	{
+		return 0;
+	}
+
+	return (uint64_t) ((tokens - bucket->tokens) * 1e9 / bucket->rate) + 1;
+}
+
+uint64_t monotonic_ns()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void token_bucket_refill(TokenBucket* bucket, uint64_t now_ns)
+{
+	if (now_ns <= bucket->last_ns)
+	{
+		return;
+	}
+
+	bucket->tokens += (now_ns - bucket->last_ns) * bucket->rate / 1e9;
+	if (bucket->tokens > bucket->burst)
+	{
+		bucket->tokens = bucket->burst;
+	}
+	bucket->last_ns = now_ns;
+}
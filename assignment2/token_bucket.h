@@ -0,0 +1,19 @@
+#ifndef TOKEN_BUCKET_H_
+#define TOKEN_BUCKET_H_
+
+#include <stdint.h>
+
+/* Refills continuously at rate tokens per second, holding at most burst */
+typedef struct {
+	double rate;
+	double burst;
+	double tokens;
+	uint64_t last_ns;
+} TokenBucket;
+
+void token_bucket_init(TokenBucket* bucket, double rate, double burst);
+int token_bucket_take(TokenBucket* bucket, double tokens, uint64_t now_ns);
+uint64_t token_bucket_wait_ns(TokenBucket* bucket, double tokens, uint64_t now_ns);
+uint64_t monotonic_ns();
+
+#endif
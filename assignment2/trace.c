@@ -0,0 +1,186 @@
+/**
+ * Compact packet traces, so a generated run can be replayed byte for byte
+ * and with the same spacing against a different router build.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "trace.h"
+
+/* Writes go out in large sequential chunks rather than per packet */
+#define TRACE_WRITE_BUFFER (1 << 20)
+
+static void write_varint(FILE* file, uint64_t value);
+static int read_varint(TraceReader* reader, uint64_t* value);
+
+/**
+ * Creates a trace file and writes a header with a placeholder count, which
+ * is filled in when the writer is closed.
+ */
+TraceWriter* trace_writer_open(const char* path, uint64_t seed)
+{
+	TraceWriter* writer = malloc(sizeof(TraceWriter));
+	TraceHeader header;
+
+	writer->file = fopen(path, "wb");
+	if (writer->file == NULL)
+	{
+		fprintf(stderr, "Unable to create trace file: %s.\n", path);
+		exit(-1);
+	}
+	setvbuf(writer->file, NULL, _IOFBF, TRACE_WRITE_BUFFER);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.seed = seed;
+	fwrite(&header, sizeof(header), 1, writer->file);
+
+	writer->last_ns = 0;
+	writer->count = 0;
+	return writer;
+}
+
+/**
+ * Appends one datagram, gathered from iov, sent at now_ns.
+ */
+void trace_write_packet(TraceWriter* writer, uint64_t now_ns, const struct iovec* iov, int iovcnt)
+{
+	size_t length = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+	{
+		length += iov[i].iov_len;
+	}
+
+	// the first packet defines time zero
+	write_varint(writer->file, writer->count == 0 ? 0 : now_ns - writer->last_ns);
+	write_varint(writer->file, length);
+	for (int i = 0; i < iovcnt; i++)
+	{
+		fwrite(iov[i].iov_base, 1, iov[i].iov_len, writer->file);
+	}
+
+	writer->last_ns = now_ns;
+	writer->count++;
+}
+
+void trace_writer_close(TraceWriter* writer)
+{
+	fseek(writer->file, offsetof(TraceHeader, count), SEEK_SET);
+	fwrite(&writer->count, sizeof(writer->count), 1, writer->file);
+	fclose(writer->file);
+	free(writer);
+}
+
+/**
+ * Maps a trace file for sequential reading.
+ */
+TraceReader* trace_reader_open(const char* path)
+{
+	TraceReader* reader;
+	TraceHeader header;
+	struct stat info;
+	void* data;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &info) == -1 || info.st_size < (off_t) sizeof(TraceHeader))
+	{
+		fprintf(stderr, "Unable to read trace file: %s.\n", path);
+		exit(-1);
+	}
+
+	data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Unable to map trace file: %s.\n", path);
+		exit(-1);
+	}
+	madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != TRACE_VERSION
+	) {
+		fprintf(stderr, "Not a packet trace: %s.\n", path);
+		exit(-1);
+	}
+
+	reader = malloc(sizeof(TraceReader));
+	reader->data = data;
+	reader->size = info.st_size;
+	reader->offset = sizeof(TraceHeader);
+	reader->seed = header.seed;
+	reader->count = header.count;
+	return reader;
+}
+
+/**
+ * Points data at the next datagram in the mapping, no copy is made.
+ *
+ * Returns 0 on success, -1 at the end of the trace or on a truncated record.
+ */
+int trace_read_packet(TraceReader* reader, uint64_t* delta_ns, const char** data, size_t* length)
+{
+	uint64_t size;
+
+	if (read_varint(reader, delta_ns) != 0 || read_varint(reader, &size) != 0)
+	{
+		return -1;
+	}
+
+	if (size > reader->size - reader->offset)
+	{
+		return -1;
+	}
+
+	*data = (const char*) &reader->data[reader->offset];
+	*length = size;
+	reader->offset += size;
+	return 0;
+}
+
+void trace_reader_close(TraceReader* reader)
+{
+	munmap((void*) reader->data, reader->size);
+	free(reader);
+}
+
+static void write_varint(FILE* file, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		putc((int) (value & 0x7f) | 0x80, file);
+		value >>= 7;
+	}
+	putc((int) value, file);
+}
+
+static int read_varint(TraceReader* reader, uint64_t* value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (reader->offset < reader->size && shift < 64)
+	{
+		unsigned char byte = reader->data[reader->offset++];
+		*value |= (uint64_t) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return 0;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
@@ -0,0 +1,47 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define TRACE_MAGIC "PKTTRACE"
+#define TRACE_VERSION 1
+
+/*
+ * A trace file is this header, in host byte order, followed by one record
+ * per packet: a LEB128 varint of nanoseconds since the previous packet, a
+ * varint byte length, then the raw datagram.
+ */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t seed;
+	uint64_t count;
+} TraceHeader;
+
+typedef struct {
+	FILE* file;
+	uint64_t last_ns;
+	uint64_t count;
+} TraceWriter;
+
+typedef struct {
+	const unsigned char* data;
+	size_t size;
+	size_t offset;
+	uint64_t seed;
+	uint64_t count;
+} TraceReader;
+
+TraceWriter* trace_writer_open(const char* path, uint64_t seed);
+void trace_write_packet(TraceWriter* writer, uint64_t now_ns, const struct iovec* iov, int iovcnt);
+void trace_writer_close(TraceWriter* writer);
+
+TraceReader* trace_reader_open(const char* path);
+int trace_read_packet(TraceReader* reader, uint64_t* delta_ns, const char** data, size_t* length);
+void trace_reader_close(TraceReader* reader);
+
+#endif
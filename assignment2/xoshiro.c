@@ -0,0 +1,62 @@
+/**
+ * A small fast PRNG so every generator thread can own one.
+ */
+#include <stdint.h>
+
+#include "xoshiro.h"
+
+/**
+ * xoshiro128** from http://prng.di.unimi.it/, small and fast enough to give
+ * every thread its own generator instead of sharing the locked rand().
+ */
+uint32_t xoshiro_next(uint32_t* state)
+{
+	uint32_t x = state[1] * 5;
+	uint32_t result = ((x << 7) | (x >> 25)) * 9;
+	uint32_t t = state[1] << 9;
+
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= t;
+	state[3] = (state[3] << 11) | (state[3] >> 21);
+
+	return result;
+}
+
+/**
+ * Expands a 64 bit seed into a full xoshiro state with splitmix64, so nearby
+ * seeds still give unrelated streams.
+ */
+void xoshiro_seed(uint32_t* state, uint64_t seed)
+{
+	for (int i = 0; i < 4; i += 2)
+	{
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		z = z ^ (z >> 31);
+
+		state[i] = (uint32_t) z;
+		state[i + 1] = (uint32_t) (z >> 32);
+	}
+}
+
+
+/**
+ * Returns a number in [0, bound). Scales a 32 bit draw by multiplying rather
+ * than dividing, the bias this leaves is far below anything a run could show.
+ */
+uint32_t xoshiro_below(uint32_t* state, uint32_t bound)
+{
+	return (uint32_t) (((uint64_t) xoshiro_next(state) * bound) >> 32);
+}
+
+/**
+ * Returns a double in [0, 1).
+ */
+double xoshiro_double(uint32_t* state)
+{
+	return xoshiro_next(state) / 4294967296.0;
+}
@@ -0,0 +1,11 @@
+#ifndef XOSHIRO_H_
+#define XOSHIRO_H_
+
+#include <stdint.h>
+
+uint32_t xoshiro_next(uint32_t* state);
+void xoshiro_seed(uint32_t* state, uint64_t seed);
+uint32_t xoshiro_below(uint32_t* state, uint32_t bound);
+double xoshiro_double(uint32_t* state);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef CHECKSUM_H_
+#define CHECKSUM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+void checksum_init(void);
+uint32_t checksum_update(uint32_t crc, const void* data, size_t length);
+
+#endif
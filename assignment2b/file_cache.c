@@ -0,0 +1,417 @@
+/**
+ * The file server's cache of hot files.
+ *
+ * Files up to FILE_CACHE_MAX_FILE are read into memory the first time
+ * they're requested, and later requests are sent straight from there.
+ * An entry is trusted for FILE_CACHE_VALID seconds, so a hot file costs
+ * at most a stat a second. After that the file is checked again, and a
+ * different inode, size or modification time means it's read afresh.
+ *
+ * Bigger files are sent with sendfile, which never sees their contents,
+ * so the cache remembers their checksums instead, once a transfer that
+ * did see them has worked one out.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "checksum.h"
+
+static uint32_t hash_path(const char* path);
+static int insert_entry(FileCache* cache, CacheEntry* entry);
+static void unlink_entry(FileCache* cache, CacheEntry* entry);
+static void release_entry(CacheEntry* entry);
+static void describe_file(CacheEntry* entry, const struct stat* info, time_t now);
+
+/**
+ * Creates an empty cache that holds at most capacity bytes of files.
+ */
+FileCache* FileCache_new(size_t capacity)
+{
+	FileCache* cache = calloc(1, sizeof(FileCache));
+
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+	cache->capacity = capacity;
+	pthread_mutex_init(&cache->lock, NULL);
+
+	return cache;
+}
+
+void FileCache_free(FileCache* cache)
+{
+	while (cache->oldest != NULL)
+	{
+		unlink_entry(cache, cache->oldest);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+/**
+ * Looks up the file at path, checking it's still the one that was read
+ * if the entry hasn't been checked for a while.
+ *
+ * Returns the entry with a reference the caller has to release, or NULL
+ * if the file isn't cached or has changed.
+ */
+CacheEntry* file_cache_get(FileCache* cache, const char* path, time_t now)
+{
+	CacheEntry* entry;
+	struct stat info;
+	int valid;
+
+	pthread_mutex_lock(&cache->lock);
+	for (entry = cache->buckets[hash_path(path)]; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->path, path) == 0)
+		{
+			break;
+		}
+	}
+
+	if (entry == NULL)
+	{
+		cache->misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	entry->references++;
+
+	if (now - entry->validated >= FILE_CACHE_VALID)
+	{
+		/* nobody else can free it now, so the stat can go without the lock */
+		pthread_mutex_unlock(&cache->lock);
+		valid = stat(path, &info) == 0 && file_cache_matches(entry, &info);
+		pthread_mutex_lock(&cache->lock);
+
+		if (!valid)
+		{
+			if (entry->cached)
+			{
+				cache->invalidated++;
+				unlink_entry(cache, entry);
+			}
+			entry->references--;
+			release_entry(entry);
+			cache->misses++;
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+		entry->validated = now;
+	}
+
+	/* move it to the front of the LRU list, if it's still in the cache */
+	if (entry->cached && cache->newest != entry)
+	{
+		entry->newer->older = entry->older;
+		if (entry->older != NULL)
+		{
+			entry->older->newer = entry->newer;
+		}
+		else
+		{
+			cache->oldest = entry->newer;
+		}
+		entry->older = cache->newest;
+		entry->newer = NULL;
+		cache->newest->newer = entry;
+		cache->newest = entry;
+	}
+	/* only the checksum of a big file is known, it's still sent from disk */
+	if (entry->data != NULL)
+	{
+		cache->hits++;
+		cache->bytes_served += entry->size;
+	}
+	else
+	{
+		cache->checksum_hits++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return entry;
+}
+
+/**
+ * Reads an open file into the cache and works out its checksum.
+ *
+ * Returns the new entry with a reference the caller has to release, or
+ * NULL if the file is too big to cache or couldn't be read in full.
+ */
+CacheEntry* file_cache_load(FileCache* cache, const char* path, int fd, const struct stat* info, time_t now)
+{
+	CacheEntry* entry;
+	ssize_t count;
+	off_t offset = 0;
+
+	if (info->st_size > FILE_CACHE_MAX_FILE || (size_t) info->st_size > cache->capacity)
+	{
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(CacheEntry));
+	if (entry == NULL)
+	{
+		return NULL;
+	}
+	entry->path = strdup(path);
+	entry->data = malloc(info->st_size > 0 ? info->st_size : 1);
+	if (entry->path == NULL || entry->data == NULL)
+	{
+		release_entry(entry);
+		return NULL;
+	}
+
+	/* the file is small and regular, so this is a read or two from the page cache */
+	while (offset < info->st_size)
+	{
+		count = pread(fd, &entry->data[offset], info->st_size - offset, offset);
+		if (count == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (count <= 0)
+		{
+			/* it shrank while we read it, don't remember a torn copy */
+			release_entry(entry);
+			return NULL;
+		}
+		offset += count;
+	}
+
+	describe_file(entry, info, now);
+	entry->checksum = checksum_update(0, entry->data, entry->size);
+	entry->cost += entry->size;
+	entry->references = 2;
+	if (insert_entry(cache, entry) != 0)
+	{
+		entry->references = 0;
+		release_entry(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/**
+ * Remembers the checksum of a file too big to cache, worked out while it
+ * was sent. Later requests find it with file_cache_get, and can check it
+ * still applies with file_cache_matches.
+ */
+void file_cache_remember(FileCache* cache, const char* path, const struct stat* info, uint32_t checksum, time_t now)
+{
+	CacheEntry* entry = calloc(1, sizeof(CacheEntry));
+
+	if (entry == NULL || (entry->path = strdup(path)) == NULL)
+	{
+		free(entry);
+		return;
+	}
+
+	describe_file(entry, info, now);
+	entry->checksum = checksum;
+	entry->references = 1;
+	if (insert_entry(cache, entry) != 0)
+	{
+		entry->references = 0;
+		release_entry(entry);
+	}
+}
+
+/**
+ * Returns whether info still describes the file the entry was read from.
+ */
+int file_cache_matches(const CacheEntry* entry, const struct stat* info)
+{
+	return
+		S_ISREG(info->st_mode) &&
+		info->st_dev == entry->device &&
+		info->st_ino == entry->inode &&
+		info->st_size == entry->size &&
+		info->st_mtim.tv_sec == entry->modified.tv_sec &&
+		info->st_mtim.tv_nsec == entry->modified.tv_nsec;
+}
+
+/**
+ * Adds an entry to the cache, evicting the least recently used ones until
+ * it fits. An entry already there for the same path is replaced, it's
+ * older than this one.
+ *
+ * Returns 0, or -1 if the entry costs more than the whole cache holds.
+ */
+static int insert_entry(FileCache* cache, CacheEntry* entry)
+{
+	CacheEntry** slot;
+
+	if (entry->cost > cache->capacity)
+	{
+		return -1;
+	}
+
+	entry->cached = 1;
+	pthread_mutex_lock(&cache->lock);
+	slot = &cache->buckets[hash_path(entry->path)];
+	for (CacheEntry* old = *slot; old != NULL; old = old->next)
+	{
+		if (strcmp(old->path, entry->path) == 0)
+		{
+			unlink_entry(cache, old);
+			break;
+		}
+	}
+
+	while (cache->bytes + entry->cost > cache->capacity && cache->oldest != NULL)
+	{
+		cache->evicted++;
+		unlink_entry(cache, cache->oldest);
+	}
+
+	entry->next = *slot;
+	*slot = entry;
+	entry->older = cache->newest;
+	if (cache->newest != NULL)
+	{
+		cache->newest->newer = entry;
+	}
+	else
+	{
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+	cache->bytes += entry->cost;
+	cache->entries++;
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+/**
+ * Drops a reference taken by file_cache_get or file_cache_load, freeing
+ * the entry if it has left the cache and nobody else is sending it.
+ */
+void file_cache_release(FileCache* cache, CacheEntry* entry)
+{
+	pthread_mutex_lock(&cache->lock);
+	entry->references--;
+	release_entry(entry);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * Logs how well the cache is doing and how much memory it holds.
+ */
+void file_cache_report(FileCache* cache, FILE* log_file)
+{
+	uint64_t lookups;
+
+	pthread_mutex_lock(&cache->lock);
+	lookups = cache->hits + cache->checksum_hits + cache->misses;
+	fprintf(
+		log_file,
+		"Cache %d: %d entries, %.1f of %.1f MB, %llu hits, %llu checksum only, %llu misses, %.1f%% hit ratio, "
+		"%llu invalidated, %llu evicted, %.1f MB served from memory\n",
+		(int) getpid(),
+		cache->entries,
+		cache->bytes / 1e6,
+		cache->capacity / 1e6,
+		(unsigned long long) cache->hits,
+		(unsigned long long) cache->checksum_hits,
+		(unsigned long long) cache->misses,
+		lookups > 0 ? 100.0 * cache->hits / lookups : 0,
+		(unsigned long long) cache->invalidated,
+		(unsigned long long) cache->evicted,
+		cache->bytes_served / 1e6
+	);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * FNV-1a over the path.
+ *
+ * Returns the path's bucket.
+ */
+static uint32_t hash_path(const char* path)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *path; path++)
+	{
+		hash = (hash ^ (uint8_t) *path) * 16777619u;
+	}
+
+	return hash % FILE_CACHE_BUCKETS;
+}
+
+/**
+ * Takes an entry out of the hash table and the LRU list, dropping the
+ * cache's own reference. Called with the lock held.
+ */
+static void unlink_entry(FileCache* cache, CacheEntry* entry)
+{
+	CacheEntry** slot = &cache->buckets[hash_path(entry->path)];
+
+	while (*slot != entry)
+	{
+		slot = &(*slot)->next;
+	}
+	*slot = entry->next;
+
+	if (entry->newer != NULL)
+	{
+		entry->newer->older = entry->older;
+	}
+	else
+	{
+		cache->newest = entry->older;
+	}
+	if (entry->older != NULL)
+	{
+		entry->older->newer = entry->newer;
+	}
+	else
+	{
+		cache->oldest = entry->newer;
+	}
+
+	cache->bytes -= entry->cost;
+	cache->entries--;
+	entry->cached = 0;
+	entry->references--;
+	release_entry(entry);
+}
+
+/**
+ * Frees an entry once it has neither the cache nor a connection using it.
+ */
+static void release_entry(CacheEntry* entry)
+{
+	if (entry->references > 0)
+	{
+		return;
+	}
+	free(entry->path);
+	free(entry->data);
+	free(entry);
+}
+
+/**
+ * Records which version of which file an entry holds, and what the entry
+ * itself costs, before any contents.
+ */
+static void describe_file(CacheEntry* entry, const struct stat* info, time_t now)
+{
+	entry->size = info->st_size;
+	entry->device = info->st_dev;
+	entry->inode = info->st_ino;
+	entry->modified = info->st_mtim;
+	entry->validated = now;
+	entry->cost = sizeof(CacheEntry) + strlen(entry->path) + 1;
+}
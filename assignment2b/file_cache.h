@@ -0,0 +1,71 @@
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FILE_CACHE_DEFAULT_SIZE (64 << 20)
+/* Past this sendfile, which hands TCP the page cache without a copy, is as cheap */
+#define FILE_CACHE_MAX_FILE (32 << 10)
+/* Seconds an entry is trusted before the file is checked for changes again */
+#define FILE_CACHE_VALID 1
+#define FILE_CACHE_BUCKETS 4096
+
+/*
+ * A file's whole contents, read into memory, and what it was read from.
+ * Files too big to keep only have their checksum remembered, and no data.
+ * Connections hold a reference while they send from it, so an entry
+ * evicted or invalidated mid transfer lives until the last one is done.
+ */
+typedef struct CacheEntry {
+	char* path;
+	char* data;
+	off_t size;
+	uint32_t checksum;
+	size_t cost;
+	dev_t device;
+	ino_t inode;
+	struct timespec modified;
+	time_t validated;
+	int references;
+	int cached;
+	struct CacheEntry* next;
+	struct CacheEntry* newer;
+	struct CacheEntry* older;
+} CacheEntry;
+
+/*
+ * Recently requested files, looked up by path in a hash table and evicted
+ * least recently used first once they take more than capacity bytes.
+ * Shared by the threads of a process under a single lock.
+ */
+typedef struct {
+	CacheEntry* buckets[FILE_CACHE_BUCKETS];
+	CacheEntry* newest;
+	CacheEntry* oldest;
+	size_t capacity;
+	size_t bytes;
+	int entries;
+	pthread_mutex_t lock;
+	uint64_t hits;
+	uint64_t checksum_hits;
+	uint64_t misses;
+	uint64_t invalidated;
+	uint64_t evicted;
+	uint64_t bytes_served;
+} FileCache;
+
+FileCache* FileCache_new(size_t capacity);
+void FileCache_free(FileCache* cache);
+CacheEntry* file_cache_get(FileCache* cache, const char* path, time_t now);
+CacheEntry* file_cache_load(FileCache* cache, const char* path, int fd, const struct stat* info, time_t now);
+void file_cache_remember(FileCache* cache, const char* path, const struct stat* info, uint32_t checksum, time_t now);
+int file_cache_matches(const CacheEntry* entry, const struct stat* info);
+void file_cache_release(FileCache* cache, CacheEntry* entry);
+void file_cache_report(FileCache* cache, FILE* log_file);
+
+#endif
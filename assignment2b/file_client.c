@@ -1,40 +1,93 @@
 /**
- * A UDP based random "Packet" streamer.
+ * Fetches files from file_server over its framed protocol, asking for
+ * several at once on one connection and checking each one's checksum.
+ * With -r, a file that's already partly here is resumed, asking only for
+ * the bytes it's missing. While a file is incomplete, "<file>.part" holds
+ * the size the server gave for it, and a file is only resumed if the
+ * server still gives the same size. Without a .part file a local copy is
+ * either finished or someone else's, and is fetched again in full.
  */
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
-#include <resolv.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <time.h>
 
+#include "checksum.h"
+
 #define MAXBUF			1024
+/* Bytes read from the socket at once */
+#define READ_SIZE 65536
+/* Requests sent ahead of the responses, far too few to fill a socket buffer */
+#define WINDOW 16
+/* Added to a file's name for the note kept while it's incomplete */
+#define PART_SUFFIX ".part"
+
+/* What's been read from the server and not used yet */
+typedef struct {
+	int socketfd;
+	char data[READ_SIZE];
+	size_t start;
+	size_t end;
+} Reader;
 
 int build_socket(int port);
+int request_file(int socketfd, const char* file_name, long long offset);
+int read_line(Reader* reader, char* line, size_t size);
+int receive_file(Reader* reader, const char* file_name, long long offset, long long size, uint32_t* crc);
+int fill(Reader* reader);
+long long read_part(const char* file_name);
+void write_part(const char* file_name, long long total);
+void remove_part(const char* file_name);
 
 int main (int argc, char *argv[])
 {
-	int socketfd, port;
+	int socketfd, port, status, option;
 	struct sockaddr_in dest;
-	char buffer[MAXBUF];
-	FILE* save_file;
+	struct stat info;
+	char line[MAXBUF];
+	long long size, total;
+	unsigned int expected;
+	uint32_t crc;
+	Reader* reader;
+	long long* offsets;
+	long long* totals;
+	int requested = 0, received = 0, failed = 0, resume = 0;
 
-	if (argc != 4)
+	while ((option = getopt(argc, argv, "r")) != -1)
+	{
+		if (option == 'r')
+		{
+			resume = 1;
+		}
+		else
+		{
+			argc = 0;
+		}
+	}
+
+	if (argc - optind < 3)
 	{
 		fprintf(
 			stderr,
-			"Invalid, should be: <server-ip> <port> <filename>"
+			"Invalid, should be: [-r] <server-ip> <port> <filename>...\n"
 		);
 		exit(EXIT_FAILURE);
 	}
 
-	char* host = argv[1];
-	port = atoi(argv[2]);
-	char* file_name = argv[3];
+	char* host = argv[optind];
+	port = atoi(argv[optind + 1]);
+	char** file_names = &argv[optind + 2];
+	int file_count = argc - optind - 2;
 
 	/* build our socket */
 	/* socketfd = build_socket(port); */
@@ -57,64 +110,324 @@ int main (int argc, char *argv[])
 		exit(errno);
 	}
 
-	if (write(
-			socketfd,
-			file_name,
-			strlen(file_name) + 1) == -1
-	) {
-		fprintf(stderr, "Error sending file request to client.\n");
-		exit(EXIT_FAILURE);
-	}
-
-	save_file = fopen(file_name, "wb");
-	if (save_file == NULL)
+	reader = calloc(1, sizeof(Reader));
+	offsets = calloc(file_count, sizeof(long long));
+	totals = calloc(file_count, sizeof(long long));
+	if (reader == NULL || offsets == NULL || totals == NULL)
 	{
-		fprintf(stderr, "Error creating save file,\n");
+		fprintf(stderr, "Out of memory.\n");
 		exit(EXIT_FAILURE);
 	}
+	reader->socketfd = socketfd;
+	checksum_init();
 
-	// TODO: finish setting up 
-	time_t last_chunk = time(NULL);
-	for(int res ;;)
+	/*
+	 * Keep a few requests ahead of the responses, so the server always has
+	 * the next one and there's no round trip between files.
+	 */
+	while (received < file_count)
 	{
-		memset(&buffer[0], 0, MAXBUF);
-		res = recv(socketfd, buffer, MAXBUF, MSG_DONTWAIT);
-		if (res == -1)
+		for (; requested < file_count && requested - received < WINDOW; requested++)
 		{
-			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			/* whatever made it to disk last time is kept, and only the rest asked for */
+			totals[requested] = resume ? read_part(file_names[requested]) : -1;
+			if (totals[requested] != -1 && stat(file_names[requested], &info) == 0 && S_ISREG(info.st_mode))
 			{
-				if (time(NULL) > last_chunk + 5)
-				{
-					fprintf(stderr, "File server timed out.\n");
-					break;
-				}
-
-				continue;
+				offsets[requested] = info.st_size;
 			}
-			else
+
+			if (request_file(socketfd, file_names[requested], offsets[requested]) == -1)
 			{
-				fprintf(stderr, "Connection refused. Errno: %d\n", errno);
-				break;
+				fprintf(stderr, "Error sending file request to server.\n");
+				exit(EXIT_FAILURE);
 			}
 		}
-		if(res == 0)
+
+		/* every response says how long it is, so there's no guessing when it ends */
+		if (read_line(reader, line, sizeof(line)) == -1 || sscanf(line, "%d %lld %lld", &status, &size, &total) < 2)
+		{
+			fprintf(stderr, "Connection closed by server.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (status == 416)
 		{
-			break;
+			fprintf(stderr, "%s: longer here than the server's %lld bytes.\n", file_names[received], total);
+			failed++;
+			received++;
+			continue;
 		}
-		else if(res > 0)
+		else if (status != 200 && status != 206)
 		{
-			if (fwrite(buffer, sizeof(char), res, save_file) < res)
+			fprintf(stderr, "%s: server answered %d.\n", file_names[received], status);
+			failed++;
+			received++;
+			continue;
+		}
+		else if (status == 206 && total != totals[received])
+		{
+			/* the file isn't the one the start came from, so the rest doesn't go with it */
+			fprintf(
+				stderr,
+				"%s: is %lld bytes on the server now, not %lld, fetch it again without -r.\n",
+				file_names[received],
+				total,
+				totals[received]
+			);
+			if (receive_file(reader, NULL, 0, size, &crc) == -1 || read_line(reader, line, sizeof(line)) == -1)
 			{
-				fprintf(stderr, "Error streaming save buffer to file. Errno: %d\n", errno);
-				break;
+				fprintf(stderr, "%s: transfer cut short.\n", file_names[received]);
+				exit(EXIT_FAILURE);
 			}
+			remove_part(file_names[received]);
+			failed++;
+			received++;
+			continue;
+		}
+		else if (status == 200)
+		{
+			offsets[received] = 0;
+			write_part(file_names[received], size);
+		}
+
+		if (receive_file(reader, file_names[received], offsets[received], size, &crc) == -1 ||
+			read_line(reader, line, sizeof(line)) == -1 ||
+			sscanf(line, "%x", &expected) != 1)
+		{
+			fprintf(stderr, "%s: transfer cut short.\n", file_names[received]);
+			exit(EXIT_FAILURE);
+		}
 
-			last_chunk = time(NULL);
+		if (crc != expected)
+		{
+			fprintf(stderr, "%s: checksum mismatch, got %08x expected %08x.\n", file_names[received], crc, expected);
+			failed++;
 		}
+		/* a bad copy isn't worth resuming either */
+		remove_part(file_names[received]);
+		received++;
 	}
 
 	// now tear everything back down
 	close(socketfd);
-	fclose(save_file);
-	exit(EXIT_SUCCESS);
+	free(reader);
+	free(offsets);
+	free(totals);
+	exit(failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/**
+ * Sends "GET <file>\n", the request for a single file, or for the part
+ * of it from offset on, "RANGE <offset> 0 <file>\n".
+ *
+ * Returns 0 once it's sent, or -1 if it couldn't be.
+ */
+int request_file(int socketfd, const char* file_name, long long offset)
+{
+	char request[MAXBUF];
+	int length;
+	ssize_t count;
+
+	if (offset > 0)
+	{
+		length = snprintf(request, sizeof(request), "RANGE %lld 0 %s\n", offset, file_name);
+	}
+	else
+	{
+		length = snprintf(request, sizeof(request), "GET %s\n", file_name);
+	}
+	if (length >= (int) sizeof(request) || strchr(file_name, '\n') != NULL)
+	{
+		return -1;
+	}
+
+	for (int sent = 0; sent < length; sent += count)
+	{
+		count = write(socketfd, &request[sent], length - sent);
+		if (count == -1)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Reads up to and including the next newline, which it replaces with a
+ * null.
+ *
+ * Returns 0, or -1 if the connection ended or the line doesn't fit.
+ */
+int read_line(Reader* reader, char* line, size_t size)
+{
+	size_t length = 0;
+
+	while (length < size - 1)
+	{
+		if (reader->start == reader->end && fill(reader) <= 0)
+		{
+			return -1;
+		}
+
+		line[length] = reader->data[reader->start++];
+		if (line[length] == '\n')
+		{
+			line[length] = 0;
+			return 0;
+		}
+		length++;
+	}
+
+	return -1;
+}
+
+/**
+ * Saves the next size bytes in file_name from offset on, working out
+ * their checksum. The space is allocated up front, as the size is known
+ * before any of it, but without growing the file: if the transfer is cut
+ * short, the file's size is still how much of it arrived. A NULL
+ * file_name just reads past them.
+ *
+ * Returns 0, or -1 if the connection ended first or the file couldn't be
+ * written.
+ */
+int receive_file(Reader* reader, const char* file_name, long long offset, long long size, uint32_t* crc)
+{
+	FILE* save_file = NULL;
+	size_t count;
+
+	if (file_name != NULL)
+	{
+		save_file = fopen(file_name, offset > 0 ? "r+b" : "wb");
+	}
+	if (file_name != NULL && (save_file == NULL || fseeko(save_file, offset, SEEK_SET) == -1))
+	{
+		fprintf(stderr, "Error creating save file,\n");
+		if (save_file != NULL)
+		{
+			fclose(save_file);
+		}
+		return -1;
+	}
+	if (save_file != NULL && size > 0)
+	{
+		fallocate(fileno(save_file), FALLOC_FL_KEEP_SIZE, offset, size);
+	}
+
+	*crc = 0;
+	while (size > 0)
+	{
+		if (reader->start == reader->end && fill(reader) <= 0)
+		{
+			if (save_file != NULL)
+			{
+				fclose(save_file);
+			}
+			return -1;
+		}
+
+		count = reader->end - reader->start;
+		if ((long long) count > size)
+		{
+			count = size;
+		}
+		if (save_file != NULL && fwrite(&reader->data[reader->start], sizeof(char), count, save_file) < count)
+		{
+			fprintf(stderr, "Error streaming save buffer to file. Errno: %d\n", errno);
+			fclose(save_file);
+			return -1;
+		}
+
+		*crc = checksum_update(*crc, &reader->data[reader->start], count);
+		reader->start += count;
+		size -= count;
+	}
+
+	if (save_file == NULL)
+	{
+		return 0;
+	}
+	return fclose(save_file) == 0 ? 0 : -1;
+}
+
+/**
+ * Reads whatever the server has sent next into an emptied buffer.
+ *
+ * Returns the number of bytes read, 0 if the server hung up, or -1.
+ */
+int fill(Reader* reader)
+{
+	ssize_t count;
+
+	do
+	{
+		count = read(reader->socketfd, reader->data, READ_SIZE);
+	} while (count == -1 && errno == EINTR);
+
+	reader->start = 0;
+	reader->end = count > 0 ? count : 0;
+	return count;
+}
+
+/**
+ * Finds the size the server gave for file_name when it was first fetched.
+ *
+ * Returns that size, or -1 if the file isn't partly fetched.
+ */
+long long read_part(const char* file_name)
+{
+	char part_name[4096];
+	FILE* part_file;
+	long long total;
+
+	if (snprintf(part_name, sizeof(part_name), "%s" PART_SUFFIX, file_name) >= (int) sizeof(part_name))
+	{
+		return -1;
+	}
+	part_file = fopen(part_name, "r");
+	if (part_file == NULL)
+	{
+		return -1;
+	}
+	if (fscanf(part_file, "%lld", &total) != 1 || total < 0)
+	{
+		total = -1;
+	}
+	fclose(part_file);
+	return total;
+}
+
+/**
+ * Notes that file_name is being fetched and is total bytes long, so an
+ * interrupted transfer can be picked up by a later run.
+ */
+void write_part(const char* file_name, long long total)
+{
+	char part_name[4096];
+	FILE* part_file;
+
+	if (snprintf(part_name, sizeof(part_name), "%s" PART_SUFFIX, file_name) >= (int) sizeof(part_name))
+	{
+		return;
+	}
+	part_file = fopen(part_name, "w");
+	if (part_file != NULL)
+	{
+		fprintf(part_file, "%lld\n", total);
+		fclose(part_file);
+	}
+}
+
+/**
+ * Forgets that file_name was being fetched.
+ */
+void remove_part(const char* file_name)
+{
+	char part_name[4096];
+
+	if (snprintf(part_name, sizeof(part_name), "%s" PART_SUFFIX, file_name) < (int) sizeof(part_name))
+	{
+		unlink(part_name);
+	}
 }
@@ -14,27 +14,143 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Two protocols are served on the same port. The original one is a file
+ * name ending in a null, answered with the file's bytes, a "$" after any
+ * file longer than a chunk, and a hang up.
+ *
+ * The framed one is a line per request, and a client can send the next
+ * ones before the answers come back:
+ *
+ *   GET <file>\n
+ *   RANGE <offset> <length> <file>\n
+ *
+ * Each is answered in order with a header, the file and a trailer:
+ *
+ *   <status> <length>\n<length bytes><crc32 in hex>\n
+ *
+ * The status is 200, or 404 or 400 with no body and no trailer. A range
+ * is length bytes from offset on, or all the rest if length is 0, and is
+ * answered with "206 <length> <file size>\n" and the checksum of just
+ * those bytes. One that starts past the end of the file gets
+ * "416 0 <file size>\n" and no body, so a client that already has part
+ * of a file can ask for what it's missing. The connection stays open for
+ * more requests until the client closes it.
+ */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
 #include <time.h>
 #include <err.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "file_cache.h"
+#include "checksum.h"
+
 #define CHUNK_SIZE 1024
+/* Buffer for files sendfile can't take, large enough to keep syscalls rare */
+#define COPY_SIZE 65536
+/* Bytes one connection may send per wakeup, so a big download can't starve the rest */
+#define SEND_QUANTUM (1 << 20)
+/* Connections taken from the backlog per wakeup, leaving some for the other threads */
+#define ACCEPT_BATCH 8
+#define MAX_EVENTS 64
+#define MAX_THREADS 64
+#define MAX_PROCESSES 64
 /* #define IP "127.0.0.1" */
 
+/* Only wake one of the threads waiting on the listening socket, Linux 4.5 and up */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
+/* Where a connection is in serving its current request */
+typedef enum {
+	CONNECTION_READING,
+	CONNECTION_OPENING,
+	CONNECTION_SENDING,
+	CONNECTION_TERMINATING,
+	CONNECTION_CLOSING
+} ConnectionState;
+
+/*
+ * A client from accept to close. Sockets are non-blocking, so each step
+ * goes as far as it can and the connection waits in epoll for the rest.
+ * Legacy clients get one file, framed ones as many as they ask for.
+ */
+typedef struct {
+	int sd;
+	int fd;
+	ConnectionState state;
+	uint32_t events;
+	struct sockaddr_in client;
+	time_t start_time;
+	/* what the client sent, which may be several pipelined requests */
+	char input[CHUNK_SIZE];
+	size_t input_length;
+	int framed;
+	int requests;
+	char file_name[CHUNK_SIZE];
+	/* the part of the file a RANGE request asked for, a length of 0 being the rest */
+	int ranged;
+	off_t offset;
+	off_t length;
+	off_t total;
+	int status;
+	const char* method;
+	/* the file's contents, if it was small enough to come from the cache */
+	CacheEntry* entry;
+	struct stat info;
+	/* the framed header and trailer, or nothing and the legacy "$" */
+	char head[64];
+	size_t head_length;
+	size_t head_sent;
+	char tail[16];
+	size_t tail_length;
+	size_t tail_sent;
+	/* the length promised in the header, or -1 to send to the end of the file */
+	off_t size;
+	off_t sent;
+	uint32_t checksum;
+	int checksumming;
+	int copying;
+	/* the copy fallback's buffer, only allocated for files sendfile can't take */
+	char* buffer;
+	size_t buffered;
+	size_t flushed;
+	struct timespec started;
+	double cpu_seconds;
+} Connection;
+
+/* One thread of the pool, with its own epoll set and the connections it accepted */
+typedef struct {
+	pthread_t thread;
+	int epoll_fd;
+	int listen_sd;
+	FILE* log_file;
+	FileCache* cache;
+} Worker;
+
 void log_response(
 	FILE* log_file,
 	char* ip,
@@ -43,31 +159,122 @@ void log_response(
 	time_t start,
 	char* result
 );
-static void kidhandler(int signum);
+void log_transfer(
+	FILE* log_file,
+	char* file_name,
+	off_t bytes,
+	const char* method,
+	struct timespec* started,
+	double cpu_seconds
+);
+static int open_listener(int port, int reuse_port, FILE* log_file);
+static void serve(int sd, int thread_count, FILE* log_file);
+static void run_master(int port, int process_count, int thread_count, FILE* log_file);
+static pid_t spawn_process(int port, int thread_count, FILE* log_file);
+static void stophandler(int signum);
+static void reporthandler(int signum);
+static void* worker_run(void* arg);
+static void accept_connections(Worker* worker);
+static void connection_run(Worker* worker, Connection* connection);
+static int read_request(Worker* worker, Connection* connection);
+static int parse_request(Connection* connection, int ended);
+static void open_file(Worker* worker, Connection* connection);
+static off_t select_range(Connection* connection, off_t total);
+static void respond_cached(Worker* worker, Connection* connection);
+static void respond(Connection* connection, int status, off_t size);
+static void compose_tail(Connection* connection);
+static int send_body(Connection* connection);
+static int send_pending(Connection* connection, const char* bytes, size_t length, size_t* done, int flags);
+static int send_cached(Connection* connection);
+static int send_file(Connection* connection);
+static int copy_file(Connection* connection);
+static int finish_response(Worker* worker, Connection* connection);
+static void connection_log(Worker* worker, Connection* connection, char* result);
+static void connection_reset(Worker* worker, Connection* connection);
+static void connection_close(Worker* worker, Connection* connection);
+
+/* Set by -c, sends every file through a buffer to compare against sendfile */
+int force_copy = 0;
+
+/* Set by -m, how many megabytes of small files each process keeps in memory */
+size_t cache_size = FILE_CACHE_DEFAULT_SIZE;
+
+/* Set when the prefork master is told to stop */
+volatile sig_atomic_t stopping = 0;
+
+/* Set by SIGUSR1, asking for the cache counters in the log */
+volatile sig_atomic_t report = 0;
 
 /**
  *
  */
 int main(int argc,	char *argv[])
 {
-	struct sockaddr_in sockname, client;
-	char buffer[CHUNK_SIZE];
 	struct sigaction sa;
-	socklen_t clientlen;
-	int sd, port;
+	struct rlimit limit;
+	int sd, port, option;
+	int thread_count = 0;
+	int process_count = 0;
 	pid_t pid;
 	FILE* log_file;
 
+	/* -c is only there for measuring what sendfile saves */
+	while ((option = getopt(argc, argv, "cm:p:t:")) != -1)
+	{
+		if (option == 'c')
+		{
+			force_copy = 1;
+		}
+		else if (option == 'm' && atoi(optarg) >= 0)
+		{
+			cache_size = (size_t) atoi(optarg) << 20;
+		}
+		else if (option == 'p' && atoi(optarg) > 0)
+		{
+			process_count = atoi(optarg);
+		}
+		else if (option == 't' && atoi(optarg) > 0)
+		{
+			thread_count = atoi(optarg);
+		}
+		else
+		{
+			argc = 0;
+			break;
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
+
 	/* Check arg length */
 	if (argc != 4)
 	{
-		fprintf(stderr, "usage: ./file_server <port> <file-dir> <log_path>\n");
+		fprintf(stderr, "usage: ./file_server [-c] [-m cache-mb] [-p processes] [-t threads] <port> <file-dir> <log_path>\n");
 		exit(-1);
 	}
 
+	/* a thread per CPU, or when preforking a process per CPU with a thread each */
+	if (thread_count == 0)
+	{
+		thread_count = process_count > 0 ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (thread_count < 1)
+	{
+		thread_count = 1;
+	}
+	else if (thread_count > MAX_THREADS)
+	{
+		thread_count = MAX_THREADS;
+	}
+	if (process_count > MAX_PROCESSES)
+	{
+		process_count = MAX_PROCESSES;
+	}
+
 	/* assuming we've passed all checks, assign port */
 	port = atoi(argv[1]);
 	puts(argv[3]);
+	checksum_init();
 
 	/* Start deamonization by forking off the parent process and terminating
 	 * if an error occurred. */
@@ -116,12 +323,66 @@ int main(int argc,	char *argv[])
 	close(STDOUT_FILENO);
 	close(STDERR_FILENO);
 
+	/* every connection holds a socket and a file, so take all the descriptors we're allowed */
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	/*
+	 * A client that hangs up mid transfer would kill the whole server with
+	 * SIGPIPE, rather than just failing the write to its socket.
+	 */
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	if (sigaction(SIGPIPE, &sa, NULL) == -1)
+	{
+		fprintf(log_file, "Sigaction failed.\n");
+		exit(errno);
+	}
+
+	if (process_count > 0)
+	{
+		fprintf(
+			log_file,
+			"Server up and listening for connections on port %u with %d processes of %d threads\n",
+			port,
+			process_count,
+			thread_count
+		);
+		run_master(port, process_count, thread_count, log_file);
+	}
+	else
+	{
+		sd = open_listener(port, 0, log_file);
+		fprintf(log_file, "Server up and listening for connections on port %u with %d threads\n", port, thread_count);
+		serve(sd, thread_count, log_file);
+	}
+
+	fclose(log_file);
+	exit(EXIT_SUCCESS);
+}
+
+/**
+ * Binds a non-blocking listening socket to the port. Preforked processes
+ * each bind their own with SO_REUSEPORT, and the kernel spreads incoming
+ * connections across them, so no process wakes for another's clients.
+ *
+ * Returns the socket, exiting if it can't be set up.
+ */
+static int open_listener(int port, int reuse_port, FILE* log_file)
+{
+	struct sockaddr_in sockname;
+	int sd, on = 1;
+
 	/* prepare our socket info */
 	memset(&sockname, 0, sizeof(sockname));
 	sockname.sin_family = AF_INET;
 	sockname.sin_port = htons(port);
 	sockname.sin_addr.s_addr = htonl(INADDR_ANY);
-	sd = socket(AF_INET, SOCK_STREAM, 0);
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
 	if (sd == -1)
 	{
@@ -129,227 +390,1213 @@ int main(int argc,	char *argv[])
 		err(1, "Failed socket setup");
 	}
 
+	/* a restarted server shouldn't have to wait out the last one's TIME_WAITs */
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+		(reuse_port && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1))
+	{
+		fprintf(log_file, "Failed setting socket options, errno: %d.\n", errno);
+		exit(errno);
+	}
+
 	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
 	{
 		fprintf(log_file, "Failed binding socket to port: %u.\n", port);
 		exit(errno);
 	}
 
-	if (listen(sd, 5) == -1)
+	/* a backlog of 5 turns clients away long before the threads are busy */
+	if (listen(sd, SOMAXCONN) == -1)
 	{
 		fprintf(log_file, "Failed to listen via socket, errno: %d.\n", errno);
 		exit(errno);
 	}
 
-	/*
-	 * we're now bound, and listening for connections on "sd" -
-	 * each call to "accept" will return us a descriptor talking to
-	 * a connected client
-	 *
-	 * first, let's make sure we can have children without leaving
-	 * zombies around when they die - we can do this by catching
-	 * SIGCHLD.
-	 */
-	sa.sa_handler = kidhandler;
-	sigemptyset(&sa.sa_mask);
+	return sd;
+}
 
-	/*
-	 * we want to allow system calls like accept to be restarted if they
-	 * get interrupted by a SIGCHLD
-	 */
-	sa.sa_flags = SA_RESTART;
-	if (sigaction(SIGCHLD, &sa, NULL) == -1)
+/**
+ * Runs the thread pool on a listening socket. Every thread waits on the
+ * listening socket and on the connections it accepted, so a connection
+ * stays on one thread from accept to close and no locking is needed.
+ *
+ * Doesn't return, the threads serve until the process is killed.
+ */
+static void serve(int sd, int thread_count, FILE* log_file)
+{
+	Worker workers[MAX_THREADS];
+	FileCache* cache = NULL;
+	struct sigaction sa;
+	sigset_t usr1;
+
+	if (cache_size > 0 && (cache = FileCache_new(cache_size)) == NULL)
+	{
+		fprintf(log_file, "Out of memory for the file cache.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the counters go to the log on SIGUSR1, from whichever thread it interrupts */
+	sa.sa_handler = reporthandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
 	{
 		fprintf(log_file, "Sigaction failed.\n");
 		exit(errno);
 	}
 
-	/*
-	 * finally - the main loop. accept connections and deal with 'em
-	 */
-	fprintf(log_file, "Server up and listening for connections on port %u\n", port);
-	while(1)
+	for (int i = 0; i < thread_count; i++)
 	{
-		int clientsd, client_pid;
-		clientlen = sizeof(&client);
+		struct epoll_event event;
 
-		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
-		if (clientsd == -1)
+		workers[i].listen_sd = sd;
+		workers[i].log_file = log_file;
+		workers[i].cache = cache;
+		workers[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (workers[i].epoll_fd == -1)
 		{
-			fprintf(log_file, "Connection accept failed.\n");
-			exit(-1);
+			fprintf(log_file, "Failed to create epoll set, errno: %d.\n", errno);
+			exit(errno);
 		}
 
-		/*
-		 * We fork child to deal with each connection, this way more
-		 * than one client can connect to us and get served at any one
-		 * time. There is a series of increasingly nesting if/else statements
-		 * here to make teardown easier to deal with in the event something
-		 * goes wrong.
-		 */
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		event.data.ptr = NULL;
+		if (epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, sd, &event) == -1)
+		{
+			fprintf(log_file, "Failed to watch listening socket, errno: %d.\n", errno);
+			exit(errno);
+		}
 
-		client_pid = fork();
-		if(client_pid > 0)
+		if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0)
 		{
-			/* log our start time */
-			time_t start_time = time(NULL);
+			fprintf(log_file, "Failed to start worker thread.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* this thread only waits, so leave SIGUSR1 to the ones that can act on it */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+	for (int i = 0; i < thread_count; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+}
+
+/**
+ * The prefork master: starts the serving processes and replaces any that
+ * die, so a crash only costs the connections that process had. Stops them
+ * all and returns on SIGTERM or SIGINT.
+ */
+static void run_master(int port, int process_count, int thread_count, FILE* log_file)
+{
+	struct sigaction sa;
+	pid_t processes[MAX_PROCESSES];
+	time_t started[MAX_PROCESSES];
+	pid_t pid;
+	int status, slot;
 
-			ssize_t written, w;
-			FILE* file;
-			int retries;
-			int result = 0;
-			char file_name[CHUNK_SIZE], result_msg[32];
+	/* no SA_RESTART, waitpid has to give up when we're told to stop */
+	sa.sa_handler = stophandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	if (sigaction(SIGTERM, &sa, NULL) == -1 || sigaction(SIGINT, &sa, NULL) == -1)
+	{
+		fprintf(log_file, "Sigaction failed.\n");
+		exit(errno);
+	}
+	sa.sa_handler = reporthandler;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+	{
+		fprintf(log_file, "Sigaction failed.\n");
+		exit(errno);
+	}
+
+	for (int i = 0; i < process_count; i++)
+	{
+		processes[i] = spawn_process(port, thread_count, log_file);
+		started[i] = time(NULL);
+	}
 
-			/* This next little bit is for parsing out IP/Port for logging */
-			struct sockaddr_in *sin = (struct sockaddr_in *) &client;
-			char* ip = inet_ntoa(sin->sin_addr);
-			unsigned short port = sin->sin_port;
+	while (!stopping)
+	{
+		pid = waitpid(WAIT_ANY, &status, 0);
+		if (pid == -1)
+		{
+			if (errno != EINTR)
+			{
+				fprintf(log_file, "Waiting for processes failed, errno: %d.\n", errno);
+				break;
+			}
 
-			/* parse incoming request */
-			if (read(clientsd, file_name, CHUNK_SIZE) > 0)
+			/* every process has its own cache, so they each report on it */
+			if (report)
 			{
-				file = fopen(file_name, "rb");
-				if (file != NULL)
+				report = 0;
+				for (int i = 0; i < process_count; i++)
 				{
-					/*
-					 * stream the file to the client, being sure to
-					 * handle a short write, or being interrupted by
-					 * a signal before we could write anything.
-					 */
-					result = 1;
-					written = 0;
-					retries = 0;
-					while (!feof(file))
+					if (processes[i] > 0)
 					{
-						int count = fread(buffer, 1, CHUNK_SIZE - 1, file);
-
-						/* null terminate stream at wherever the reading finished */
-						buffer[count] = 0;
-
-						/* try streaming to socket */
-						w = write(clientsd, buffer, count);
-						
-						if (w > 0)
-						{
-							written += count;
-							retries = 0;
-						}
-						else if(w == -1 && retries < 2)
-						{
-							/* if something went wrong rewind file to start of last */
-							/* chunk and try again */
-							fseek(file, count * -1, SEEK_CUR);
-							retries++;
-						}
-						else
-						{
-							result = -1;
-							break;
-						}
+						kill(processes[i], SIGUSR1);
 					}
-					
-					/*
-					 * If we finished successfully, and we've sent more than a
-					 * single chunk, terminate with "$" chunk.
-					 */
-					if (result == 1)
-					{
-						if (written > CHUNK_SIZE - 1)
-						{
-							if (write(clientsd, "$", 1) == -1)
-							{
-								fprintf(log_file, "Error sending EOF symbol.\n");
-							}
-						}
-
-						time_t finish = time(NULL);
-						log_response(
-							log_file,
-							ip,
-							port,
-							file_name,
-							start_time,
-							asctime(localtime(&finish))
-						);
-
-				
-					} else {
-						sprintf(result_msg, "transmission not completed");
-						log_response(
-							log_file,
-							ip,
-							port,
-							file_name,
-							start_time,
-							"file not found"
-						);
-					}
-
-					fclose(file);
-				}
-				else
-				{
-					log_response(
-						log_file,
-						ip,
-						port,
-						file_name,
-						start_time,
-						"file not found"
-					);
 				}
 			}
-			else
-			{
-				fprintf(log_file, "Error receiving incoming socket message.\n");
-			}
+			continue;
+		}
+
+		for (slot = 0; slot < process_count && processes[slot] != pid; slot++);
+		if (slot == process_count || stopping)
+		{
+			continue;
+		}
 
-			/* done serving request, terminate fork */
-			shutdown(clientsd, SHUT_RDWR);
-			close(clientsd);
-			exit(0);
+		if (WIFSIGNALED(status))
+		{
+			fprintf(log_file, "Process %d killed by signal %d, restarting.\n", (int) pid, WTERMSIG(status));
 		}
-		/* if we're dealing with the parent daemon, continue so we don't close anyhting */
-		else if(client_pid == -1)
+		else
 		{
-			fprintf(log_file, "Connection fork failed.\n");
+			fprintf(log_file, "Process %d exited with status %d, restarting.\n", (int) pid, WEXITSTATUS(status));
 		}
 
+		/* one that can't even start, say because the port is taken, shouldn't spin */
+		if (time(NULL) - started[slot] < 1)
+		{
+			sleep(1);
+		}
+		processes[slot] = spawn_process(port, thread_count, log_file);
+		started[slot] = time(NULL);
 	}
 
-	fclose(log_file);
-	exit(EXIT_SUCCESS);
+	for (int i = 0; i < process_count; i++)
+	{
+		if (processes[i] > 0)
+		{
+			kill(processes[i], SIGTERM);
+		}
+	}
+	while (wait(NULL) > 0 || errno == EINTR);
+	fprintf(log_file, "Server stopped.\n");
 }
 
 /**
- * Outputs transfer information in a specific format
+ * Forks a serving process with its own listening socket and thread pool.
+ *
+ * Returns its pid, or -1 if the fork failed.
  */
-void log_response(
-	FILE* log_file,
-	char* ip,
-	unsigned short port,
-	char* file_name,
-	time_t start,
-	char* result
-) {
-	fprintf(
-		log_file,
-		"%s %d %s %s %s\n",
-		ip,
-		ntohs(port),
-		file_name,
-		asctime(localtime(&start)),
-		result
-	);
+static pid_t spawn_process(int port, int thread_count, FILE* log_file)
+{
+	struct sigaction sa;
+	pid_t pid = fork();
 
-	fflush(log_file);
+	if (pid == -1)
+	{
+		fprintf(log_file, "Process fork failed.\n");
+	}
+	else if (pid == 0)
+	{
+		/* the master's handlers are for the master, a TERM just ends us */
+		sa.sa_handler = SIG_DFL;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGINT, &sa, NULL);
+
+		serve(open_listener(port, 1, log_file), thread_count, log_file);
+		exit(EXIT_SUCCESS);
+	}
+
+	return pid;
+}
+
+/**
+ * Sighandler for telling the prefork master to stop.
+ */
+static void stophandler(int signum)
+{
+	(void) signum;
+	stopping = 1;
+}
+
+/**
+ * Sighandler for asking for the cache counters.
+ */
+static void reporthandler(int signum)
+{
+	(void) signum;
+	report = 1;
+}
+
+/**
+ * The loop of a pool thread: accepts when the listening socket is ready and
+ * otherwise moves the connection that woke it along.
+ */
+static void* worker_run(void* arg)
+{
+	Worker* worker = arg;
+	struct epoll_event events[MAX_EVENTS];
+	int ready;
+
+	while(1)
+	{
+		ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+		if (ready == -1 && errno != EINTR)
+		{
+			fprintf(worker->log_file, "Waiting for connections failed, errno: %d.\n", errno);
+			exit(-1);
+		}
+
+		if (report)
+		{
+			report = 0;
+			if (worker->cache != NULL)
+			{
+				file_cache_report(worker->cache, worker->log_file);
+			}
+		}
+
+		for (int i = 0; i < ready; i++)
+		{
+			if (events[i].data.ptr == NULL)
+			{
+				accept_connections(worker);
+			}
+			else
+			{
+				connection_run(worker, events[i].data.ptr);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Takes a batch of connections off the backlog and starts watching them for
+ * their request.
+ */
+static void accept_connections(Worker* worker)
+{
+	struct epoll_event event;
+	socklen_t clientlen;
+	Connection* connection;
+
+	for (int i = 0; i < ACCEPT_BATCH; i++)
+	{
+		connection = calloc(1, sizeof(Connection));
+		if (connection == NULL)
+		{
+			fprintf(worker->log_file, "Out of memory for connections.\n");
+			return;
+		}
+
+		clientlen = sizeof(connection->client);
+		connection->sd = accept4(
+			worker->listen_sd,
+			(struct sockaddr *) &connection->client,
+			&clientlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC
+		);
+		if (connection->sd == -1)
+		{
+			/* another thread got there first, or the client already gave up */
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+			{
+				fprintf(worker->log_file, "Connection accept failed, errno: %d.\n", errno);
+			}
+			free(connection);
+			return;
+		}
+
+		/* log our start time */
+		connection->start_time = time(NULL);
+		connection->fd = -1;
+		connection->state = CONNECTION_READING;
+		connection->events = EPOLLIN;
+
+		event.events = EPOLLIN;
+		event.data.ptr = connection;
+		if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, connection->sd, &event) == -1)
+		{
+			fprintf(worker->log_file, "Failed to watch connection, errno: %d.\n", errno);
+			connection_close(worker, connection);
+		}
+	}
 }
 
 /**
- * Sighandler for making sure no child processes turn into zombies.
+ * Runs a connection's state machine until it has to wait on its socket,
+ * or it has had its share of the thread for this round.
  */
-static void kidhandler(int signum)
+static void connection_run(Worker* worker, Connection* connection)
 {
-	/* signal handler for SIGCHLD */
-	waitpid(WAIT_ANY, NULL, WNOHANG);
+	struct epoll_event event;
+	struct timespec cpu_before, cpu_after;
+	int progress = 1;
+
+	/* CPU time per transfer, as the thread's time is shared by all its connections */
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_before);
+	while (progress)
+	{
+		switch (connection->state)
+		{
+			case CONNECTION_READING:
+				progress = read_request(worker, connection);
+				break;
+
+			case CONNECTION_OPENING:
+				open_file(worker, connection);
+				break;
+
+			case CONNECTION_SENDING:
+				/* a cached file has its header in the same writev as the data */
+				progress = connection->entry != NULL ? 1 :
+					send_pending(connection, connection->head, connection->head_length, &connection->head_sent, MSG_MORE);
+				if (progress == 1)
+				{
+					progress = send_body(connection);
+				}
+
+				if (progress == 1)
+				{
+					progress = finish_response(worker, connection);
+				}
+				if (progress == -1)
+				{
+					connection_log(worker, connection, "transmission not completed");
+					connection->state = CONNECTION_CLOSING;
+					progress = 1;
+				}
+				break;
+
+			case CONNECTION_TERMINATING:
+				progress = send_pending(connection, connection->tail, connection->tail_length, &connection->tail_sent, 0);
+				if (progress == -1 && !connection->framed)
+				{
+					fprintf(worker->log_file, "Error sending EOF symbol.\n");
+					progress = 1;
+				}
+				else if (progress == -1)
+				{
+					connection_log(worker, connection, "transmission not completed");
+					connection->state = CONNECTION_CLOSING;
+					progress = 1;
+					break;
+				}
+
+				if (progress == 1)
+				{
+					if (connection->status == 200 || connection->status == 206)
+					{
+						connection_log(worker, connection, NULL);
+					}
+					/* a framed client may have more requests, or a pipeline of them already here */
+					if (connection->framed && connection->status != 400)
+					{
+						connection_reset(worker, connection);
+					}
+					else
+					{
+						connection->state = CONNECTION_CLOSING;
+					}
+				}
+				break;
+
+			case CONNECTION_CLOSING:
+				/* closing the socket takes it out of the epoll set too */
+				connection_close(worker, connection);
+				return;
+		}
+
+		/*
+		 * Wait for data while reading a request and for room in the socket
+		 * while answering one. Most small files fit the socket buffer in one
+		 * go, so switching takes an epoll_ctl only once a client falls behind.
+		 */
+		event.events = connection->state == CONNECTION_READING ? EPOLLIN : EPOLLOUT;
+		if (!progress && event.events != connection->events)
+		{
+			event.data.ptr = connection;
+			if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->sd, &event) == -1)
+			{
+				connection_log(worker, connection, "transmission not completed");
+				connection->state = CONNECTION_CLOSING;
+				progress = 1;
+			}
+			connection->events = event.events;
+		}
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_after);
+	connection->cpu_seconds +=
+		(cpu_after.tv_sec - cpu_before.tv_sec) + (cpu_after.tv_nsec - cpu_before.tv_nsec) / 1e9;
+}
+
+/**
+ * Reads until there's a whole request, unless a pipelining client already
+ * sent it along with the one before.
+ *
+ * Returns 1 once there's a request or the connection is done, or 0 to wait
+ * for more of it.
+ */
+static int read_request(Worker* worker, Connection* connection)
+{
+	ssize_t count;
+
+	while (!parse_request(connection, 0))
+	{
+		count = read(
+			connection->sd,
+			&connection->input[connection->input_length],
+			CHUNK_SIZE - 1 - connection->input_length
+		);
+		if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		else if (count == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (count <= 0)
+		{
+			/* a framed client that's done just hangs up, anyone else was meant to ask for something */
+			if (connection->requests == 0 && connection->input_length == 0)
+			{
+				fprintf(worker->log_file, "Error receiving incoming socket message.\n");
+			}
+			if (connection->input_length == 0 || !parse_request(connection, 1))
+			{
+				connection->state = CONNECTION_CLOSING;
+			}
+			else if (connection->status == 400)
+			{
+				connection_log(worker, connection, "bad request");
+			}
+			return 1;
+		}
+
+		connection->input_length += count;
+	}
+
+	if (connection->status == 400)
+	{
+		connection_log(worker, connection, "bad request");
+	}
+	return 1;
+}
+
+/**
+ * Takes the next request off the input. Framed requests are lines,
+ * "GET <file>\n" or "RANGE <offset> <length> <file>\n", and make the
+ * connection framed for good. Anything else is a legacy file name ending
+ * at a null, or wherever the input ends.
+ *
+ * Returns 1 if there was a request, which is then in file_name, or 0 if
+ * there isn't a whole one yet.
+ */
+static int parse_request(Connection* connection, int ended)
+{
+	char* input = connection->input;
+	size_t length = connection->input_length;
+	char* null = memchr(input, 0, length);
+	char* newline = memchr(input, '\n', length);
+	char* name = NULL;
+	long long offset, range;
+	int consumed = 0;
+	size_t line = 0;
+	int keyword = (length >= 4 && memcmp(input, "GET ", 4) == 0) || (length >= 6 && memcmp(input, "RANGE ", 6) == 0);
+
+	/* a request line that fills the whole buffer is framed too, just too long */
+	if (connection->framed ||
+		(keyword && newline != NULL && (null == NULL || newline < null)) ||
+		(keyword && newline == NULL && null == NULL && length >= CHUNK_SIZE - 1))
+	{
+		connection->framed = 1;
+		if (newline == NULL && length < CHUNK_SIZE - 1 && !ended)
+		{
+			return 0;
+		}
+
+		connection->requests++;
+		connection->state = CONNECTION_OPENING;
+		if (newline != NULL)
+		{
+			line = newline - input;
+			*newline = 0;
+			if (line > 0 && input[line - 1] == '\r')
+			{
+				input[line - 1] = 0;
+			}
+
+			if (memcmp(input, "GET ", 4) == 0)
+			{
+				name = &input[4];
+			}
+			else if (sscanf(input, "RANGE %lld %lld %n", &offset, &range, &consumed) == 2 &&
+				consumed > 0 && offset >= 0 && range >= 0)
+			{
+				connection->ranged = 1;
+				connection->offset = offset;
+				connection->length = range;
+				name = &input[consumed];
+			}
+		}
+
+		if (name == NULL)
+		{
+			/* too long, cut off or not a request, there's no telling where the next one starts */
+			strcpy(connection->file_name, "-");
+			connection->state = CONNECTION_SENDING;
+			respond(connection, 400, 0);
+			return 1;
+		}
+
+		strcpy(connection->file_name, name);
+		connection->input_length -= line + 1;
+		memmove(input, newline + 1, connection->input_length);
+		return 1;
+	}
+
+	if (null == NULL && length < CHUNK_SIZE - 1 && !ended)
+	{
+		return 0;
+	}
+
+	/* the request is meant to be terminated, but don't trust it */
+	memcpy(connection->file_name, input, length);
+	connection->file_name[length] = 0;
+	connection->input_length = 0;
+	connection->requests++;
+	connection->state = CONNECTION_OPENING;
+	return 1;
+}
+
+/**
+ * Opens the requested file and picks how to send it. Regular files go
+ * straight from the page cache to the socket with sendfile, so the data
+ * never passes through this process. Anything else, like a FIFO or a
+ * device, is turned away: opening or reading one can block, and with it
+ * every connection on this thread.
+ *
+ * A framed response needs the file's checksum, and sendfile never sees
+ * the data. Unless the cache remembers it, the file is copied instead,
+ * and the checksum worked out on the way is remembered for next time.
+ * A range is read from its offset on, and as the cache only knows whole
+ * files' checksums, it's always copied.
+ */
+static void open_file(Worker* worker, Connection* connection)
+{
+	int known = 0;
+	off_t length;
+	time_t now = time(NULL);
+
+	/* time for this transfer alone, from the first byte to the last */
+	clock_gettime(CLOCK_MONOTONIC, &connection->started);
+	connection->state = CONNECTION_SENDING;
+
+	/* a hot file that was checked recently doesn't touch the filesystem at all */
+	if (worker->cache != NULL)
+	{
+		connection->entry = file_cache_get(worker->cache, connection->file_name, now);
+		if (connection->entry != NULL && connection->entry->data != NULL)
+		{
+			respond_cached(worker, connection);
+			return;
+		}
+	}
+
+	/* a FIFO with no writer would otherwise hold up the open until one shows up */
+	connection->fd = open(connection->file_name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+	if (connection->fd != -1 &&
+		(fstat(connection->fd, &connection->info) != 0 || !S_ISREG(connection->info.st_mode)))
+	{
+		close(connection->fd);
+		connection->fd = -1;
+	}
+
+	if (connection->entry != NULL)
+	{
+		/* only the checksum of a big file, if it's still the same file and all of it is wanted */
+		if (connection->fd != -1 && !connection->ranged && file_cache_matches(connection->entry, &connection->info))
+		{
+			connection->checksum = connection->entry->checksum;
+			known = 1;
+		}
+		file_cache_release(worker->cache, connection->entry);
+		connection->entry = NULL;
+	}
+
+	if (connection->fd == -1)
+	{
+		connection_log(worker, connection, "file not found");
+		if (!connection->framed)
+		{
+			connection->state = CONNECTION_CLOSING;
+			return;
+		}
+		respond(connection, 404, 0);
+		return;
+	}
+
+	if (worker->cache != NULL && connection->info.st_size <= FILE_CACHE_MAX_FILE)
+	{
+		connection->entry = file_cache_load(worker->cache, connection->file_name, connection->fd, &connection->info, now);
+		if (connection->entry != NULL)
+		{
+			close(connection->fd);
+			connection->fd = -1;
+			respond_cached(worker, connection);
+			return;
+		}
+	}
+
+	length = connection->framed ? select_range(connection, connection->info.st_size) : -1;
+	if (connection->ranged && length == -1)
+	{
+		close(connection->fd);
+		connection->fd = -1;
+		return;
+	}
+	else if (connection->offset > 0 && lseek(connection->fd, connection->offset, SEEK_SET) == -1)
+	{
+		connection_log(worker, connection, "transmission not completed");
+		connection->state = CONNECTION_CLOSING;
+		return;
+	}
+
+	connection->method = "sendfile";
+	connection->checksumming = connection->framed && !known;
+	if (force_copy || connection->checksumming)
+	{
+		connection->method = "copy";
+		connection->copying = 1;
+		if (connection->buffer == NULL && (connection->buffer = malloc(COPY_SIZE)) == NULL)
+		{
+			connection_log(worker, connection, "transmission not completed");
+			connection->state = CONNECTION_CLOSING;
+			return;
+		}
+	}
+
+	/* a legacy client gets whatever is there when it reaches the end */
+	respond(connection, connection->ranged ? 206 : 200, length);
+}
+
+/**
+ * Works out how much of a file of total bytes to send: all of it, or the
+ * range that was asked for, cut short at the end of the file. A range
+ * starting past the end gets its 416 answer set up here.
+ *
+ * Returns the length to send, or -1 if there's nothing to send.
+ */
+static off_t select_range(Connection* connection, off_t total)
+{
+	connection->total = total;
+	if (!connection->ranged)
+	{
+		return total;
+	}
+	else if (connection->offset > total)
+	{
+		respond(connection, 416, 0);
+		return -1;
+	}
+
+	if (connection->length == 0 || connection->length > total - connection->offset)
+	{
+		return total - connection->offset;
+	}
+	return connection->length;
+}
+
+/**
+ * Answers from the cache entry the connection holds. A range of it needs
+ * its own checksum, but that's a pass over memory already in hand.
+ */
+static void respond_cached(Worker* worker, Connection* connection)
+{
+	CacheEntry* entry = connection->entry;
+	off_t length = select_range(connection, entry->size);
+
+	connection->method = "cache";
+	if (length == -1)
+	{
+		file_cache_release(worker->cache, entry);
+		connection->entry = NULL;
+		return;
+	}
+
+	if (connection->ranged)
+	{
+		connection->checksum = checksum_update(0, &entry->data[connection->offset], length);
+		respond(connection, 206, length);
+		return;
+	}
+	connection->checksum = entry->checksum;
+	respond(connection, 200, length);
+}
+
+/**
+ * Sets up the response's status and length, and its header for a framed
+ * client, "<status> <length>\n", with the file's size after it for a
+ * range.
+ */
+static void respond(Connection* connection, int status, off_t size)
+{
+	connection->status = status;
+	connection->size = size;
+	if (connection->ranged && (status == 206 || status == 416))
+	{
+		connection->head_length = sprintf(
+			connection->head,
+			"%d %lld %lld\n",
+			status,
+			(long long) size,
+			(long long) connection->total
+		);
+	}
+	else if (connection->framed)
+	{
+		connection->head_length = sprintf(connection->head, "%d %lld\n", status, (long long) size);
+	}
+	compose_tail(connection);
+}
+
+/**
+ * Works out what follows the body: the checksum as eight hex digits and a
+ * newline for a framed client, and for a legacy one the "$" that ends any
+ * file longer than a single chunk. The same answer comes out however often
+ * it's asked, so a cached file can have it sent along with the data.
+ */
+static void compose_tail(Connection* connection)
+{
+	off_t length = connection->size >= 0 ? connection->size : connection->sent;
+
+	if (connection->framed)
+	{
+		connection->tail_length = connection->status == 200 || connection->status == 206 ? sprintf(connection->tail, "%08x\n", connection->checksum) : 0;
+	}
+	else
+	{
+		connection->tail[0] = '$';
+		connection->tail_length = length > CHUNK_SIZE - 1 ? 1 : 0;
+	}
+}
+
+/**
+ * Sends the next part of the body, from the cache, with sendfile or
+ * through the copy buffer.
+ *
+ * Returns 1 once the whole body is sent, 0 if the socket is full or this
+ * connection has had its quantum, or -1 if the transfer failed.
+ */
+static int send_body(Connection* connection)
+{
+	if (connection->size >= 0 && connection->sent == connection->size && connection->entry == NULL)
+	{
+		return 1;
+	}
+	else if (connection->entry != NULL)
+	{
+		return send_cached(connection);
+	}
+
+	return connection->copying ? copy_file(connection) : send_file(connection);
+}
+
+/**
+ * Sends what's left of a header or trailer.
+ *
+ * Returns 1 once it's all sent, 0 if the socket is full, or -1 if the
+ * client is gone.
+ */
+static int send_pending(Connection* connection, const char* bytes, size_t length, size_t* done, int flags)
+{
+	ssize_t count;
+
+	while (*done < length)
+	{
+		count = send(connection->sd, &bytes[*done], length - *done, flags);
+		if (count == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			else if (errno != EINTR)
+			{
+				return -1;
+			}
+			continue;
+		}
+		*done += count;
+	}
+
+	return 1;
+}
+
+/**
+ * Sends the next part of a cached file, or of the range asked for,
+ * straight from memory. The header and trailer go in the same writev as
+ * the data, so a small file takes a single call.
+ *
+ * Returns 1 once the whole file is sent, 0 if the socket is full or this
+ * connection has had its quantum, or -1 if the transfer failed.
+ */
+static int send_cached(Connection* connection)
+{
+	struct iovec parts[3];
+	CacheEntry* entry = connection->entry;
+	ssize_t count;
+	size_t quantum = 0;
+
+	while (quantum < SEND_QUANTUM)
+	{
+		parts[0].iov_base = &connection->head[connection->head_sent];
+		parts[0].iov_len = connection->head_length - connection->head_sent;
+		parts[1].iov_base = &entry->data[connection->offset + connection->sent];
+		parts[1].iov_len = connection->size - connection->sent;
+		parts[2].iov_base = &connection->tail[connection->tail_sent];
+		parts[2].iov_len = connection->tail_length - connection->tail_sent;
+
+		count = writev(connection->sd, parts, 3);
+		if (count == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			else if (errno != EINTR)
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		quantum += count;
+		if ((size_t) count < parts[0].iov_len)
+		{
+			connection->head_sent += count;
+			continue;
+		}
+		connection->head_sent += parts[0].iov_len;
+		count -= parts[0].iov_len;
+		if ((size_t) count > parts[1].iov_len)
+		{
+			connection->tail_sent += count - parts[1].iov_len;
+			count = parts[1].iov_len;
+		}
+		connection->sent += count;
+		if (connection->sent == connection->size)
+		{
+			/* whatever of the trailer is still to go, it goes next */
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Sends the next part of a regular file with sendfile. A file on a
+ * filesystem sendfile doesn't support is handed over to the copy fallback,
+ * which picks up from the offset sendfile left behind.
+ *
+ * Returns 1 once the whole file is sent, 0 if the socket is full or this
+ * connection has had its quantum, or -1 if the transfer failed.
+ */
+static int send_file(Connection* connection)
+{
+	ssize_t count;
+	size_t quantum = 0, limit;
+
+	/* a legacy client gets the file up to its end, in case it grew while we were sending */
+	while (quantum < SEND_QUANTUM)
+	{
+		limit = SEND_QUANTUM - quantum;
+		if (connection->size >= 0 && (off_t) limit > connection->size - connection->sent)
+		{
+			limit = connection->size - connection->sent;
+		}
+
+		count = limit > 0 ? sendfile(connection->sd, connection->fd, NULL, limit) : 0;
+		if (count > 0)
+		{
+			connection->sent += count;
+			quantum += count;
+		}
+		else if (count == 0)
+		{
+			return 1;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return 0;
+		}
+		else if (errno == EINVAL || errno == ENOSYS)
+		{
+			connection->method = "copy";
+			connection->copying = 1;
+			if (connection->buffer == NULL && (connection->buffer = malloc(COPY_SIZE)) == NULL)
+			{
+				return -1;
+			}
+			return copy_file(connection);
+		}
+		else if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * The buffered fallback, reading a large block at a time and writing as
+ * much of it as the socket takes, keeping the rest for the next wakeup.
+ * Works the checksum out on the way when the cache didn't know it.
+ *
+ * Returns 1 once the whole file is sent, 0 if the socket is full or this
+ * connection has had its quantum, or -1 if the transfer failed.
+ */
+static int copy_file(Connection* connection)
+{
+	ssize_t count;
+	size_t quantum = 0, limit;
+
+	while (quantum < SEND_QUANTUM)
+	{
+		if (connection->flushed == connection->buffered)
+		{
+			limit = COPY_SIZE;
+			if (connection->size >= 0 && (off_t) limit > connection->size - connection->sent)
+			{
+				limit = connection->size - connection->sent;
+			}
+
+			count = limit > 0 ? read(connection->fd, connection->buffer, limit) : 0;
+			if (count == 0)
+			{
+				return 1;
+			}
+			else if (count == -1)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+				return -1;
+			}
+			connection->buffered = count;
+			connection->flushed = 0;
+			if (connection->checksumming)
+			{
+				connection->checksum = checksum_update(connection->checksum, connection->buffer, count);
+			}
+		}
+
+		count = write(
+			connection->sd,
+			&connection->buffer[connection->flushed],
+			connection->buffered - connection->flushed
+		);
+		if (count == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			else if (errno != EINTR)
+			{
+				return -1;
+			}
+			continue;
+		}
+		connection->flushed += count;
+		connection->sent += count;
+		quantum += count;
+	}
+
+	return 0;
+}
+
+/**
+ * Wraps up a body that's been sent in full. A framed body that came up
+ * short, because the file shrank, can't be finished: the client was told
+ * a length and all that's left is to hang up. One that worked out the
+ * whole file's checksum gets it remembered, if the file didn't change
+ * meanwhile.
+ *
+ * Returns 1 to go on to the trailer, or -1 if the transfer failed.
+ */
+static int finish_response(Worker* worker, Connection* connection)
+{
+	struct stat info;
+
+	if (connection->size >= 0 && connection->sent != connection->size)
+	{
+		return -1;
+	}
+
+	if (connection->checksumming && !connection->ranged && worker->cache != NULL &&
+		fstat(connection->fd, &info) == 0 && info.st_mtim.tv_sec == connection->info.st_mtim.tv_sec &&
+		info.st_mtim.tv_nsec == connection->info.st_mtim.tv_nsec && info.st_size == connection->info.st_size)
+	{
+		file_cache_remember(worker->cache, connection->file_name, &info, connection->checksum, time(NULL));
+	}
+
+	compose_tail(connection);
+	connection->state = CONNECTION_TERMINATING;
+	return 1;
+}
+
+/**
+ * Logs a request the way the forking server did, adding the size, method
+ * and timing of transfers that completed. A NULL result means it did.
+ */
+static void connection_log(Worker* worker, Connection* connection, char* result)
+{
+	/* This next little bit is for parsing out IP/Port for logging */
+	char ip[INET_ADDRSTRLEN];
+	char finished[32];
+	struct tm finish_time;
+	time_t finish;
+
+	inet_ntop(AF_INET, &connection->client.sin_addr, ip, sizeof(ip));
+	if (result == NULL)
+	{
+		finish = time(NULL);
+		result = asctime_r(localtime_r(&finish, &finish_time), finished);
+	}
+
+	log_response(
+		worker->log_file,
+		ip,
+		connection->client.sin_port,
+		connection->file_name,
+		connection->start_time,
+		result
+	);
+	if (result == finished)
+	{
+		log_transfer(
+			worker->log_file,
+			connection->file_name,
+			connection->sent,
+			connection->method,
+			&connection->started,
+			connection->cpu_seconds
+		);
+	}
+}
+
+/**
+ * Gets a framed connection ready for its next request, keeping what's
+ * left of the input and the copy buffer.
+ */
+static void connection_reset(Worker* worker, Connection* connection)
+{
+	if (connection->fd != -1)
+	{
+		close(connection->fd);
+		connection->fd = -1;
+	}
+	if (connection->entry != NULL)
+	{
+		file_cache_release(worker->cache, connection->entry);
+		connection->entry = NULL;
+	}
+
+	connection->state = CONNECTION_READING;
+	connection->start_time = time(NULL);
+	connection->status = 0;
+	connection->method = NULL;
+	connection->head_length = connection->head_sent = 0;
+	connection->tail_length = connection->tail_sent = 0;
+	connection->size = connection->sent = 0;
+	connection->ranged = 0;
+	connection->offset = connection->length = connection->total = 0;
+	connection->checksum = 0;
+	connection->checksumming = 0;
+	connection->copying = 0;
+	connection->buffered = connection->flushed = 0;
+	connection->cpu_seconds = 0;
+}
+
+/**
+ * Done serving request, tears the connection down.
+ */
+static void connection_close(Worker* worker, Connection* connection)
+{
+	if (connection->fd != -1)
+	{
+		close(connection->fd);
+	}
+	if (connection->entry != NULL)
+	{
+		file_cache_release(worker->cache, connection->entry);
+	}
+	shutdown(connection->sd, SHUT_RDWR);
+	close(connection->sd);
+	free(connection->buffer);
+	free(connection);
+}
+
+/**
+ * Outputs transfer information in a specific format
+ */
+void log_response(
+	FILE* log_file,
+	char* ip,
+	unsigned short port,
+	char* file_name,
+	time_t start,
+	char* result
+) {
+	char started[32];
+	struct tm start_time;
+
+	fprintf(
+		log_file,
+		"%s %d %s %s %s\n",
+		ip,
+		ntohs(port),
+		file_name,
+		asctime_r(localtime_r(&start, &start_time), started),
+		result
+	);
+
+	fflush(log_file);
+}
+
+/**
+ * Logs how a finished transfer went: its size, how it was sent, and the
+ * wall clock and CPU time it took.
+ */
+void log_transfer(
+	FILE* log_file,
+	char* file_name,
+	off_t bytes,
+	const char* method,
+	struct timespec* started,
+	double cpu_seconds
+) {
+	struct timespec finished;
+	double seconds;
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	seconds = (finished.tv_sec - started->tv_sec) + (finished.tv_nsec - started->tv_nsec) / 1e9;
+
+	fprintf(
+		log_file,
+		"%s: %lld bytes by %s in %.3f s, %.1f MB/s, %.3f s cpu\n",
+		file_name,
+		(long long) bytes,
+		method,
+		seconds,
+		seconds > 0 ? bytes / seconds / 1e6 : 0,
+		cpu_seconds
+	);
 }
@@ -1,77 +1,236 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-/* Test Declarations */
-void test_build_router_table();
-void test_receive_packet();
-void test_find_destination_router();
+#include "file_cache.h"
+#include "checksum.h"
 
-RouterTable* table;
+#define TEST_FILE_SIZE 1000
+
+/* Test Declarations */
+void test_checksum();
+void test_cache_eviction();
+void test_cache_replace();
+void test_cache_invalidate();
+void test_cache_too_big();
+void test_cache_checksum_only();
+void make_file(char* path, size_t size, char fill);
+CacheEntry* load_file(FileCache* cache, const char* path, time_t now);
 
 /**
-* Test runner.
+ * Test runner.
  */
 int main(int argc, char **argv)
 {
-    test_build_router_table();
-    test_receive_packet();
-    test_find_destination_router();
+	(void) argc;
+	(void) argv;
+
+	checksum_init();
+	test_checksum();
+	test_cache_eviction();
+	test_cache_replace();
+	test_cache_invalidate();
+	test_cache_too_big();
+	test_cache_checksum_only();
+
+	printf("All file server tests passed.\n");
+	return 0;
+}
 
-    // now tear everything back down
-	for(int i = 0; i < table->size; i++)
+void test_checksum()
+{
+	uint8_t data[1000];
+
+	// the standard check value, and another zlib gives
+	assert(checksum_update(0, "", 0) == 0);
+	assert(checksum_update(0, "123456789", 9) == 0xcbf43926u);
+	assert(checksum_update(0, "The quick brown fox jumps over the lazy dog", 43) == 0x414fa339u);
+
+	// however it's split, the eight byte loop and the tail agree
+	for (size_t i = 0; i < sizeof(data); i++)
 	{
-		free(table->routes[i]);
+		data[i] = (uint8_t) (i * 131 + 7);
 	}
-	free(table);
+	uint32_t whole = checksum_update(0, data, sizeof(data));
+	for (size_t split = 0; split <= sizeof(data); split++)
+	{
+		assert(checksum_update(checksum_update(0, data, split), &data[split], sizeof(data) - split) == whole);
+	}
+	assert(checksum_update(checksum_update(0, "1234", 4), "56789", 5) == 0xcbf43926u);
+}
+
+void test_cache_eviction()
+{
+	char a[] = "/tmp/fc_testXXXXXX", b[] = "/tmp/fc_testXXXXXX", c[] = "/tmp/fc_testXXXXXX";
+	size_t cost = TEST_FILE_SIZE + sizeof(CacheEntry) + sizeof(a);
+	// room for two entries but not three
+	FileCache* cache = FileCache_new(cost * 5 / 2);
+	CacheEntry* entry;
+
+	make_file(a, TEST_FILE_SIZE, 'a');
+	make_file(b, TEST_FILE_SIZE, 'b');
+	make_file(c, TEST_FILE_SIZE, 'c');
+
+	file_cache_release(cache, load_file(cache, a, 0));
+	file_cache_release(cache, load_file(cache, b, 0));
+	assert(cache->entries == 2 && cache->bytes == 2 * cost);
+
+	// a is used again, so b is now the least recently used
+	entry = file_cache_get(cache, a, 0);
+	assert(entry != NULL && entry->data[0] == 'a');
+	file_cache_release(cache, entry);
+
+	file_cache_release(cache, load_file(cache, c, 0));
+	assert(cache->entries == 2 && cache->evicted == 1);
+	assert(file_cache_get(cache, b, 0) == NULL);
+	entry = file_cache_get(cache, a, 0);
+	assert(entry != NULL);
+	file_cache_release(cache, entry);
+	entry = file_cache_get(cache, c, 0);
+	assert(entry != NULL && entry->data[0] == 'c');
+	file_cache_release(cache, entry);
+
+	FileCache_free(cache);
+	unlink(a);
+	unlink(b);
+	unlink(c);
+}
+
+void test_cache_replace()
+{
+	char path[] = "/tmp/fc_testXXXXXX";
+	FileCache* cache = FileCache_new(FILE_CACHE_DEFAULT_SIZE);
+	CacheEntry* old;
+	CacheEntry* entry;
+
+	make_file(path, TEST_FILE_SIZE, 'x');
+	old = load_file(cache, path, 0);
+
+	// loading the same path again replaces the entry, the old one lives on for its holder
+	entry = load_file(cache, path, 0);
+	assert(entry != old && cache->entries == 1);
+	assert(!old->cached && old->data[TEST_FILE_SIZE - 1] == 'x');
+	file_cache_release(cache, old);
+	file_cache_release(cache, entry);
+
+	entry = file_cache_get(cache, path, 0);
+	assert(entry != NULL && entry->cached);
+	file_cache_release(cache, entry);
+
+	FileCache_free(cache);
+	unlink(path);
 }
 
-void test_build_router_table()
+void test_cache_invalidate()
 {
-    // basic parsing test
-    char path[] = "./RT_A.txt";
-    table = build_router_table(path);
-    assert(table->size == 3);
-
-    // make sure a route looks good
-    Router* router = table->routes[1];
-    assert(strcmp(router->address, "192.168.128.0") == 0);
-    assert(strcmp(router->next_hop, "0") == 0);
-    assert(router->prefix_length == 17);
-
-    free(router);
+	char path[] = "/tmp/fc_testXXXXXX";
+	FileCache* cache = FileCache_new(FILE_CACHE_DEFAULT_SIZE);
+	CacheEntry* held;
+	FILE* file;
+
+	make_file(path, TEST_FILE_SIZE, 'y');
+	file_cache_release(cache, load_file(cache, path, 0));
+	held = file_cache_get(cache, path, 0);
+	assert(held != NULL && held->checksum == checksum_update(0, held->data, TEST_FILE_SIZE));
+
+	// a file that changed is dropped once it's due a check, but not from under its holder
+	file = fopen(path, "a");
+	fputs("more", file);
+	fclose(file);
+	assert(file_cache_get(cache, path, FILE_CACHE_VALID) == NULL);
+	assert(cache->invalidated == 1 && cache->entries == 0 && cache->bytes == 0);
+	assert(!held->cached && held->size == TEST_FILE_SIZE && held->data[0] == 'y');
+	file_cache_release(cache, held);
+	assert(file_cache_get(cache, path, FILE_CACHE_VALID) == NULL);
+
+	FileCache_free(cache);
+	unlink(path);
 }
 
-void test_receive_packet()
+void test_cache_too_big()
 {
-    char raw_packet[] = "215, 192.168.192.4, 192.224.0.7, 64, \"Hello\"";
-    Packet* packet = build_packet(raw_packet);
-
-    // make sure all data got martialled in properly
-    assert(packet->id == 215);
-    assert(strcmp(packet->src, "192.168.192.4") == 0);
-    assert(strcmp(packet->dest, "192.224.0.7") == 0);
-    assert(packet->TTL == 63);
-    assert(strcmp(packet->payload, "\"Hello\"") == 0);
-
-    // make sure we drop anything with a TTL of 1, decremented to 0
-    char raw_packet2[] = "215, 192.168.192.4, 192.224.0.7, 1, \"Hello\"";
-    Packet* packet2 = build_packet(raw_packet2);
-    assert(packet2 == NULL);
-
-    free(packet);
-    free(packet2);
+	char small[] = "/tmp/fc_testXXXXXX", big[] = "/tmp/fc_testXXXXXX";
+	size_t cost = TEST_FILE_SIZE + sizeof(CacheEntry) + sizeof(small);
+	FileCache* cache = FileCache_new(cost * 2);
+	struct stat info;
+
+	make_file(small, TEST_FILE_SIZE, 's');
+	make_file(big, cost * 2 - 10, 'b');
+	file_cache_release(cache, load_file(cache, small, 0));
+
+	// the file fits but the entry doesn't, and nothing is evicted for it
+	assert(load_file(cache, big, 0) == NULL);
+	assert(cache->entries == 1 && cache->evicted == 0);
+
+	FileCache_free(cache);
+
+	// the same goes for an entry that's only a checksum
+	cache = FileCache_new(sizeof(CacheEntry));
+	assert(stat(big, &info) == 0);
+	file_cache_remember(cache, big, &info, 0, 0);
+	assert(cache->entries == 0 && file_cache_get(cache, big, 0) == NULL);
+
+	FileCache_free(cache);
+	unlink(small);
+	unlink(big);
 }
 
-void test_find_destination_router()
+void test_cache_checksum_only()
 {
-    Packet packet = (Packet) {125, "192.168.128.0", "192.168.192.0", 2, "\"yoooo\""};
-    Router* router = find_destination_router(table, &packet);
-    assert(router != NULL);
-    assert(strcmp(router->next_hop, "RouterB") == 0);
-
-    Packet packet2 = (Packet) {6290, "192.168.128.0", "192.168.567.0", 2, "\"Sweeet\""};
-    Router* router2 = find_destination_router(table, &packet2);
-    assert(router2 == NULL);
+	char path[] = "/tmp/fc_testXXXXXX";
+	FileCache* cache = FileCache_new(FILE_CACHE_DEFAULT_SIZE);
+	CacheEntry* entry;
+	struct stat info;
+
+	make_file(path, FILE_CACHE_MAX_FILE + 1, 'z');
+	assert(load_file(cache, path, 0) == NULL);
+	assert(stat(path, &info) == 0);
+	file_cache_remember(cache, path, &info, 0x1234, 0);
+
+	// only the checksum is known, so the lookup isn't a hit from memory
+	entry = file_cache_get(cache, path, 0);
+	assert(entry != NULL && entry->data == NULL && entry->checksum == 0x1234);
+	assert(cache->hits == 0 && cache->checksum_hits == 1);
+	file_cache_release(cache, entry);
+
+	FileCache_free(cache);
+	unlink(path);
+}
+
+/**
+ * Creates a temporary file from the template in path, size bytes of fill.
+ */
+void make_file(char* path, size_t size, char fill)
+{
+	char* data = malloc(size);
+	int fd = mkstemp(path);
+
+	assert(data != NULL && fd != -1);
+	memset(data, fill, size);
+	assert(write(fd, data, size) == (ssize_t) size);
+	close(fd);
+	free(data);
+}
+
+/**
+ * Reads the file at path into the cache.
+ *
+ * Returns the entry, with a reference to release, or NULL if not cached.
+ */
+CacheEntry* load_file(FileCache* cache, const char* path, time_t now)
+{
+	struct stat info;
+	CacheEntry* entry;
+	FILE* file = fopen(path, "r");
+
+	assert(file != NULL && fstat(fileno(file), &info) == 0);
+	entry = file_cache_load(cache, path, fileno(file), &info, now);
+	fclose(file);
+	return entry;
 }